@@ -0,0 +1,826 @@
+/*
+ * mab-benchmark: a redis-benchmark style load generator for the mab.* commands.
+ *
+ * every connection keeps a window of $pipeline commands in flight. commands
+ * are drawn from a weighted mix of set/choice/reward/stat over a key space
+ * of $keys bandits. latency is recorded per command into a log-linear
+ * histogram, percentiles and throughput are reported when the run finishes,
+ * along with the server cpu time per call taken from INFO commandstats.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "pcg.h"
+
+#define BENCH_KEY_PREFIX    "mab-bench:"
+#define BENCH_IBUF_SIZE     (64 * 1024)
+#define BENCH_MAX_ARGS      (4 + 64 + 1)
+
+/* 32 sub buckets for every power of two, enough for latencies up to 2^40 us */
+#define HIST_SUB_BITS       5
+#define HIST_SUB            (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS        ((40 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum {
+    BENCH_CMD_SET = 0,
+    BENCH_CMD_CHOICE,
+    BENCH_CMD_REWARD,
+    BENCH_CMD_STAT,
+    BENCH_CMD_NUM
+};
+
+static const char *bench_cmd_names[BENCH_CMD_NUM] = {
+    "mab.set", "mab.choice", "mab.reward", "mab.statjson"
+};
+
+struct hist_s {
+    uint64_t    buckets[HIST_BUCKETS];
+    uint64_t    count;
+    uint64_t    max;
+    uint64_t    sum;
+};
+typedef struct hist_s hist_t;
+
+struct bench_stat_s {
+    hist_t      hist;
+    uint64_t    errors;
+
+    /* INFO commandstats of the server, delta over the run */
+    uint64_t    server_calls;
+    uint64_t    server_usec;
+};
+typedef struct bench_stat_s bench_stat_t;
+
+/* a command in flight. set is sent as "del + mab.set" so it waits for 2 replies */
+struct bench_pending_s {
+    int         cmd;
+    int         replies;
+    uint64_t    start;
+};
+typedef struct bench_pending_s bench_pending_t;
+
+struct bench_conn_s {
+    int                 fd;
+
+    char                *obuf;
+    size_t              olen;
+    size_t              opos;
+    size_t              ocap;
+
+    char                *ibuf;
+    size_t              ilen;
+
+    bench_pending_t     *pending;
+    int                 phead;
+    int                 npending;
+};
+typedef struct bench_conn_s bench_conn_t;
+
+struct bench_config_s {
+    const char  *host;
+    int         port;
+    const char  *sock;
+
+    int         clients;
+    long long   requests;
+    int         pipeline;
+    int         keys;
+    int         arms;
+    const char  *policy;
+    const char  *option;
+    int         mix[BENCH_CMD_NUM];
+    int         mix_total;
+    int         idxonly;
+    int         quiet;
+};
+typedef struct bench_config_s bench_config_t;
+
+static bench_config_t   config = {
+    .host = "127.0.0.1",
+    .port = 6379,
+    .sock = NULL,
+    .clients = 50,
+    .requests = 100000,
+    .pipeline = 1,
+    .keys = 1000,
+    .arms = 3,
+    .policy = "ucb1",
+    .option = NULL,
+    .mix = {0, 10, 10, 1},
+    .mix_total = 21,
+    .idxonly = 0,
+    .quiet = 0,
+};
+
+static bench_stat_t     stats[BENCH_CMD_NUM];
+static long long        issued = 0, finished = 0;
+
+static uint64_t
+ustime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+die(const char *msg)
+{
+    fprintf(stderr, "mab-benchmark: %s\n", msg);
+    exit(1);
+}
+
+static void *
+xrealloc(void *p, size_t s)
+{
+    p = realloc(p, s);
+    if(p == NULL){
+        die("run out of memory");
+    }
+    return p;
+}
+
+/*
+ * histogram
+ */
+static int
+hist_index(uint64_t v)
+{
+    if(v < HIST_SUB){
+        return (int)v;
+    }
+
+    int     e = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+    int     i = e * HIST_SUB + (int)((v >> (e - 1)) & (HIST_SUB - 1));
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+static uint64_t
+hist_value(int idx)
+{
+    if(idx < HIST_SUB){
+        return idx;
+    }
+
+    int     e = idx / HIST_SUB;
+    return ((uint64_t)(HIST_SUB + idx % HIST_SUB)) << (e - 1);
+}
+
+static void
+hist_record(hist_t *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if(v > h->max){
+        h->max = v;
+    }
+}
+
+static uint64_t
+hist_percentile(hist_t *h, double p)
+{
+    uint64_t    want = (uint64_t)(h->count * p / 100.0), seen = 0;
+    int         i;
+
+    for(i = 0; i < HIST_BUCKETS; i++){
+        seen += h->buckets[i];
+        if(seen > want){
+            return hist_value(i);
+        }
+    }
+    return h->max;
+}
+
+/*
+ * RESP encoding / decoding
+ */
+static void
+conn_append(bench_conn_t *c, const char *p, size_t len)
+{
+    if(c->olen + len > c->ocap){
+        c->ocap = (c->olen + len) * 2;
+        c->obuf = xrealloc(c->obuf, c->ocap);
+    }
+    memcpy(c->obuf + c->olen, p, len);
+    c->olen += len;
+}
+
+static void
+conn_append_cmd(bench_conn_t *c, int argc, const char **argv)
+{
+    char    hdr[32];
+    int     i, len;
+
+    len = snprintf(hdr, sizeof(hdr), "*%d\r\n", argc);
+    conn_append(c, hdr, len);
+    for(i = 0; i < argc; i++){
+        size_t  alen = strlen(argv[i]);
+
+        len = snprintf(hdr, sizeof(hdr), "$%zu\r\n", alen);
+        conn_append(c, hdr, len);
+        conn_append(c, argv[i], alen);
+        conn_append(c, "\r\n", 2);
+    }
+}
+
+/*
+ * return the length of the reply at the head of buf, 0 if it is incomplete,
+ * -1 on protocol error. *err is set if the reply is an error reply.
+ */
+static long
+resp_reply_len(const char *buf, size_t len, int *err)
+{
+    const char  *eol;
+    long        n, hlen, i, sub;
+
+    if(len < 3){
+        return 0;
+    }
+
+    eol = memchr(buf, '\r', len);
+    if(eol == NULL || (size_t)(eol - buf) + 2 > len){
+        return 0;
+    }
+    hlen = eol - buf + 2;
+
+    switch(buf[0]){
+        case '-':
+            *err = 1;
+            /* fall through */
+        case '+':
+        case ':':
+            return hlen;
+
+        case '$':
+            n = strtol(buf + 1, NULL, 10);
+            if(n < 0){
+                return hlen;
+            }
+            return ((size_t)(hlen + n + 2) <= len) ? hlen + n + 2 : 0;
+
+        case '*':
+            n = strtol(buf + 1, NULL, 10);
+            for(i = 0; i < n; i++){
+                int     suberr = 0;
+
+                sub = resp_reply_len(buf + hlen, len - hlen, &suberr);
+                if(sub <= 0){
+                    return sub;
+                }
+                hlen += sub;
+            }
+            return hlen;
+
+        default:
+            return -1;
+    }
+}
+
+/*
+ * command generation
+ */
+static int
+bench_pick_cmd(void)
+{
+    int     r = (int)randint(config.mix_total), i;
+
+    for(i = 0; i < BENCH_CMD_NUM; i++){
+        if(r < config.mix[i]){
+            return i;
+        }
+        r -= config.mix[i];
+    }
+    return BENCH_CMD_CHOICE;
+}
+
+static void
+bench_append_set(bench_conn_t *c, const char *key)
+{
+    const char  *argv[BENCH_MAX_ARGS];
+    char        num[16], choices[64][16];
+    int         argc = 0, i;
+
+    argv[0] = "del";
+    argv[1] = key;
+    conn_append_cmd(c, 2, argv);
+
+    snprintf(num, sizeof(num), "%d", config.arms);
+    argv[argc++] = "mab.set";
+    argv[argc++] = key;
+    argv[argc++] = config.policy;
+    argv[argc++] = num;
+    for(i = 0; i < config.arms; i++){
+        snprintf(choices[i], sizeof(choices[i]), "choice_%d", i);
+        argv[argc++] = choices[i];
+    }
+    if(config.option){
+        argv[argc++] = config.option;
+    }
+    conn_append_cmd(c, argc, argv);
+}
+
+static int
+bench_append(bench_conn_t *c, int cmd)
+{
+    const char  *argv[4];
+    char        key[64], idx[16], reward[32];
+
+    snprintf(key, sizeof(key), BENCH_KEY_PREFIX"%u", randint(config.keys));
+    switch(cmd){
+        case BENCH_CMD_SET:
+            bench_append_set(c, key);
+            return 2;
+
+        case BENCH_CMD_CHOICE:
+        case BENCH_CMD_STAT:
+            argv[0] = bench_cmd_names[cmd];
+            argv[1] = key;
+            argv[2] = "idxonly";
+            conn_append_cmd(c, cmd == BENCH_CMD_CHOICE && config.idxonly ? 3 : 2, argv);
+            return 1;
+
+        case BENCH_CMD_REWARD:
+            snprintf(idx, sizeof(idx), "%u", randint(config.arms));
+            snprintf(reward, sizeof(reward), "%.4f", randnumber());
+            argv[0] = bench_cmd_names[cmd];
+            argv[1] = key;
+            argv[2] = idx;
+            argv[3] = reward;
+            conn_append_cmd(c, 4, argv);
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * connection handling
+ */
+static int
+bench_connect(void)
+{
+    int     fd;
+
+    if(config.sock){
+        struct sockaddr_un  sa;
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0){
+            return -1;
+        }
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strncpy(sa.sun_path, config.sock, sizeof(sa.sun_path) - 1);
+        if(connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0){
+            close(fd);
+            return -1;
+        }
+    }else{
+        struct addrinfo     hints, *res, *ai;
+        char                port[16];
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(port, sizeof(port), "%d", config.port);
+        if(getaddrinfo(config.host, port, &hints, &res) != 0){
+            return -1;
+        }
+
+        fd = -1;
+        for(ai = res; ai != NULL; ai = ai->ai_next){
+            fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if(fd < 0){
+                continue;
+            }
+            if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+                int     yes = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if(fd < 0){
+            return -1;
+        }
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static bench_conn_t *
+bench_conn_new(void)
+{
+    bench_conn_t    *c = calloc(1, sizeof(*c));
+
+    if(c == NULL){
+        die("run out of memory");
+    }
+
+    c->fd = bench_connect();
+    if(c->fd < 0){
+        die("can not connect to server");
+    }
+    c->ibuf = xrealloc(NULL, BENCH_IBUF_SIZE);
+    c->pending = xrealloc(NULL, sizeof(bench_pending_t) * config.pipeline);
+    return c;
+}
+
+/* queue a new window of commands once the previous one is fully answered */
+static void
+bench_conn_fill(bench_conn_t *c)
+{
+    uint64_t    now = ustime();
+
+    c->phead = 0;
+    while(c->npending < config.pipeline && issued < config.requests){
+        bench_pending_t     *p = c->pending + c->npending++;
+
+        p->cmd = bench_pick_cmd();
+        p->replies = bench_append(c, p->cmd);
+        p->start = now;
+        issued++;
+    }
+}
+
+static int
+bench_conn_write(bench_conn_t *c)
+{
+    while(c->opos < c->olen){
+        ssize_t     n = write(c->fd, c->obuf + c->opos, c->olen - c->opos);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EINTR){
+                return 0;
+            }
+            return -1;
+        }
+        c->opos += n;
+    }
+
+    c->opos = c->olen = 0;
+    return 0;
+}
+
+static int
+bench_conn_read(bench_conn_t *c)
+{
+    ssize_t     n = read(c->fd, c->ibuf + c->ilen, BENCH_IBUF_SIZE - c->ilen);
+    size_t      pos = 0;
+    uint64_t    now;
+
+    if(n <= 0){
+        if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+            return 0;
+        }
+        return -1;
+    }
+    c->ilen += n;
+    now = ustime();
+
+    while(c->phead < c->npending){
+        bench_pending_t     *p = c->pending + c->phead;
+        int                 err = 0;
+        long                len = resp_reply_len(c->ibuf + pos, c->ilen - pos, &err);
+
+        if(len < 0){
+            return -1;
+        }
+        if(len == 0){
+            break;
+        }
+        pos += len;
+
+        /* the "del" in front of mab.set is not accounted */
+        if(err && (p->cmd != BENCH_CMD_SET || p->replies == 1)){
+            stats[p->cmd].errors++;
+        }
+        if(--p->replies == 0){
+            hist_record(&stats[p->cmd].hist, now - p->start);
+            c->phead++;
+            finished++;
+        }
+    }
+
+    memmove(c->ibuf, c->ibuf + pos, c->ilen - pos);
+    c->ilen -= pos;
+    if(c->ilen == BENCH_IBUF_SIZE){
+        return -1;
+    }
+
+    if(c->phead == c->npending){
+        c->npending = 0;
+        bench_conn_fill(c);
+    }
+    return 0;
+}
+
+/* create all bandits of the key space so that choice/reward hit existing keys */
+static void
+bench_prepare(bench_conn_t *c)
+{
+    struct pollfd   pfd;
+    int             i, batch, want;
+    char            key[64];
+
+    for(i = 0; i < config.keys; i += batch){
+        for(batch = 0; batch < 512 && i + batch < config.keys; batch++){
+            snprintf(key, sizeof(key), BENCH_KEY_PREFIX"%d", i + batch);
+            bench_append_set(c, key);
+        }
+
+        for(want = batch * 2; want > 0;){
+            pfd.fd = c->fd;
+            pfd.events = POLLIN | (c->olen ? POLLOUT : 0);
+            poll(&pfd, 1, -1);
+
+            if(bench_conn_write(c) != 0){
+                die("write to server fail");
+            }
+
+            ssize_t     n = read(c->fd, c->ibuf + c->ilen, BENCH_IBUF_SIZE - c->ilen);
+            if(n <= 0){
+                if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+                    continue;
+                }
+                die("read from server fail");
+            }
+            c->ilen += n;
+
+            size_t  pos = 0;
+            long    len;
+            int     err = 0;
+            while((len = resp_reply_len(c->ibuf + pos, c->ilen - pos, &err)) > 0){
+                if(err){
+                    die("mab.set fail, is the module loaded?");
+                }
+                pos += len;
+                want--;
+            }
+            memmove(c->ibuf, c->ibuf + pos, c->ilen - pos);
+            c->ilen -= pos;
+        }
+    }
+}
+
+/*
+ * send one command on a connection with nothing in flight and wait for the
+ * reply. return it NUL terminated, the caller frees it
+ */
+static char *
+bench_sync_cmd(bench_conn_t *c, int argc, const char **argv)
+{
+    struct pollfd   pfd;
+    long            len = 0;
+    int             err = 0;
+    char            *reply;
+
+    conn_append_cmd(c, argc, argv);
+    while(len == 0){
+        pfd.fd = c->fd;
+        pfd.events = POLLIN | (c->olen ? POLLOUT : 0);
+        poll(&pfd, 1, -1);
+
+        if(bench_conn_write(c) != 0){
+            die("write to server fail");
+        }
+
+        ssize_t     n = read(c->fd, c->ibuf + c->ilen, BENCH_IBUF_SIZE - c->ilen);
+        if(n <= 0){
+            if(n < 0 && (errno == EAGAIN || errno == EINTR)){
+                continue;
+            }
+            die("read from server fail");
+        }
+        c->ilen += n;
+
+        len = resp_reply_len(c->ibuf, c->ilen, &err);
+        if(len < 0 || (len == 0 && c->ilen == BENCH_IBUF_SIZE)){
+            die("invalid reply from server");
+        }
+    }
+
+    reply = xrealloc(NULL, len + 1);
+    memcpy(reply, c->ibuf, len);
+    reply[len] = '\0';
+    memmove(c->ibuf, c->ibuf + len, c->ilen - len);
+    c->ilen -= len;
+    return reply;
+}
+
+/*
+ * add $sign times the cmdstat_<name>:calls=..,usec=.. counters of every
+ * benchmarked command to its server stats
+ */
+static void
+bench_commandstats(bench_conn_t *c, int sign)
+{
+    const char  *argv[2] = {"info", "commandstats"};
+    char        *info = bench_sync_cmd(c, 2, argv), field[64], *p;
+    int         i;
+
+    for(i = 0; i < BENCH_CMD_NUM; i++){
+        unsigned long long  calls, usec;
+
+        snprintf(field, sizeof(field), "cmdstat_%s:", bench_cmd_names[i]);
+        p = strstr(info, field);
+        if(p && sscanf(p + strlen(field), "calls=%llu,usec=%llu", &calls, &usec) == 2){
+            stats[i].server_calls += sign * calls;
+            stats[i].server_usec += sign * usec;
+        }
+    }
+    free(info);
+}
+
+static void
+bench_report(uint64_t elapsed)
+{
+    int     i;
+    double  secs = elapsed / 1e6;
+
+    printf("====== mab-benchmark ======\n");
+    printf("  %lld requests completed in %.2f seconds\n", finished, secs);
+    printf("  %d parallel clients, pipeline %d, %d keys, %d arms, policy %s\n",
+            config.clients, config.pipeline, config.keys, config.arms, config.policy);
+    printf("  throughput: %.2f requests per second\n\n", finished / secs);
+
+    printf("%-14s %10s %8s %12s %9s %9s %9s %9s %9s %9s\n", "command", "requests",
+            "errors", "rps", "avg(us)", "p50", "p90", "p99", "p99.9", "max");
+    for(i = 0; i < BENCH_CMD_NUM; i++){
+        hist_t  *h = &stats[i].hist;
+
+        if(h->count == 0){
+            continue;
+        }
+        printf("%-14s %10lu %8lu %12.2f %9.1f %9lu %9lu %9lu %9lu %9lu\n",
+                bench_cmd_names[i], h->count, stats[i].errors, h->count / secs,
+                (double)h->sum / h->count, hist_percentile(h, 50),
+                hist_percentile(h, 90), hist_percentile(h, 99),
+                hist_percentile(h, 99.9), h->max);
+    }
+
+    printf("\nserver cpu (INFO commandstats)\n%-14s %10s %12s\n", "command", "calls",
+            "usec/call");
+    for(i = 0; i < BENCH_CMD_NUM; i++){
+        if(stats[i].server_calls == 0){
+            continue;
+        }
+        printf("%-14s %10lu %12.3f\n", bench_cmd_names[i], stats[i].server_calls,
+                (double)stats[i].server_usec / stats[i].server_calls);
+    }
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+"usage: mab-benchmark [options]\n"
+"  -h <host>       server hostname (default 127.0.0.1)\n"
+"  -p <port>       server port (default 6379)\n"
+"  -s <socket>     server unix socket (overrides host and port)\n"
+"  -c <clients>    number of parallel connections (default 50)\n"
+"  -n <requests>   total number of requests (default 100000)\n"
+"  -P <numreq>     pipeline <numreq> requests per connection (default 1)\n"
+"  -k <keys>       number of bandit keys (default 1000)\n"
+"  -a <arms>       number of arms of every bandit (default 3)\n"
+"  -t <policy>     policy used by mab.set (default ucb1)\n"
+"  -o <option>     policy option used by mab.set, e.g. epsilon for egreedy\n"
+"  -r <mix>        command weights set:choice:reward:stat (default 0:10:10:1)\n"
+"  -I              send mab.choice with IDXONLY\n"
+"  -q              do not print progress\n");
+    exit(1);
+}
+
+static void
+parse_mix(const char *s)
+{
+    int     i;
+    char    *end;
+
+    config.mix_total = 0;
+    for(i = 0; i < BENCH_CMD_NUM; i++){
+        long    v = strtol(s, &end, 10);
+        if(end == s || v < 0){
+            usage();
+        }
+        config.mix[i] = (int)v;
+        config.mix_total += (int)v;
+
+        if(i + 1 < BENCH_CMD_NUM){
+            if(*end != ':'){
+                usage();
+            }
+            s = end + 1;
+        }
+    }
+    if(config.mix_total == 0){
+        usage();
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int     opt, i;
+
+    while((opt = getopt(argc, argv, "h:p:s:c:n:P:k:a:t:o:r:Iq")) != -1){
+        switch(opt){
+            case 'h': config.host = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 's': config.sock = optarg; break;
+            case 'c': config.clients = atoi(optarg); break;
+            case 'n': config.requests = atoll(optarg); break;
+            case 'P': config.pipeline = atoi(optarg); break;
+            case 'k': config.keys = atoi(optarg); break;
+            case 'a': config.arms = atoi(optarg); break;
+            case 't': config.policy = optarg; break;
+            case 'o': config.option = optarg; break;
+            case 'r': parse_mix(optarg); break;
+            case 'I': config.idxonly = 1; break;
+            case 'q': config.quiet = 1; break;
+            default: usage();
+        }
+    }
+    if(config.clients <= 0 || config.pipeline <= 0 || config.keys <= 0 ||
+            config.arms <= 0 || config.arms > 64 || config.requests <= 0){
+        usage();
+    }
+
+    pcg32_srandom(time(NULL) ^ (uint64_t)getpid(), (uint64_t)getpid());
+
+    bench_conn_t    **conns = xrealloc(NULL, sizeof(bench_conn_t *) * config.clients);
+    struct pollfd   *pfds = xrealloc(NULL, sizeof(struct pollfd) * config.clients);
+
+    for(i = 0; i < config.clients; i++){
+        conns[i] = bench_conn_new();
+    }
+
+    bench_prepare(conns[0]);
+    bench_commandstats(conns[0], -1);
+
+    uint64_t    start = ustime(), last = start;
+    for(i = 0; i < config.clients; i++){
+        bench_conn_fill(conns[i]);
+    }
+
+    while(finished < config.requests){
+        for(i = 0; i < config.clients; i++){
+            pfds[i].fd = conns[i]->fd;
+            pfds[i].events = POLLIN | (conns[i]->olen ? POLLOUT : 0);
+        }
+        if(poll(pfds, config.clients, 1000) < 0 && errno != EINTR){
+            die("poll fail");
+        }
+
+        for(i = 0; i < config.clients; i++){
+            bench_conn_t    *c = conns[i];
+
+            if((pfds[i].revents & POLLOUT) || c->olen){
+                if(bench_conn_write(c) != 0){
+                    die("write to server fail");
+                }
+            }
+            if(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+                if(bench_conn_read(c) != 0){
+                    die("read from server fail");
+                }
+                if(c->olen && bench_conn_write(c) != 0){
+                    die("write to server fail");
+                }
+            }
+        }
+
+        uint64_t    now = ustime();
+        if(!config.quiet && now - last > 1000000){
+            fprintf(stderr, "\r%lld/%lld requests, %.2f rps", finished,
+                    config.requests, finished / ((now - start) / 1e6));
+            last = now;
+        }
+    }
+    if(!config.quiet){
+        fprintf(stderr, "\n");
+    }
+
+    uint64_t    elapsed = ustime() - start;
+
+    bench_commandstats(conns[0], 1);
+    bench_report(elapsed);
+    return 0;
+}
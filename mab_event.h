@@ -0,0 +1,62 @@
+#ifndef MAB_EVENT_H
+#define MAB_EVENT_H
+
+#include <stdint.h>
+
+/*
+ * binary event log of mabredis (module arg EVENTLOG), read by mab-replay.
+ * a file is a mab_event_header_t followed by fixed size records in host
+ * byte order, so it can be mapped and scanned without parsing
+ */
+#define MAB_EVENT_MAGIC     "MABEVLOG"
+#define MAB_EVENT_VERSION   2
+
+enum {
+    MAB_EVENT_CHOICE = 1,
+    MAB_EVENT_REWARD = 2,
+    MAB_EVENT_BETA = 3
+};
+
+struct mab_event_header_s {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    size;       /* of a record */
+};
+typedef struct mab_event_header_s mab_event_header_t;
+
+struct mab_event_s {
+    uint64_t    hash;       /* of the key name */
+    uint64_t    stamp;      /* unix time in ms << 8 | type */
+    double      value;      /* propensity of a choice (see below), reward (sum) of a reward */
+    uint32_t    idx;
+    uint32_t    n;          /* arms of the bandit for a choice, trials for a reward */
+};
+typedef struct mab_event_s mab_event_t;
+
+/*
+ * a thompsen or htree choice logs the beta posteriors it drew from
+ * (multi_arm_posterior) instead of its propensity, the reader estimates
+ * it. the choice is preceded by one MAB_EVENT_BETA record per candidate,
+ * in level order, and carries value = -share. its propensity is
+ *   share * P(every chosen candidate wins its level) + (1 - share if a
+ *   chosen candidate has MAB_EVENT_BETA_BEST)
+ * a choice value of 0 is an unknown propensity. same size as mab_event_t
+ */
+#define MAB_EVENT_BETA_CHOSEN   1   /* on the path to the chosen arm */
+#define MAB_EVENT_BETA_BEST     2   /* the chosen arm is the best arm of a frozen bandit */
+
+struct mab_event_beta_s {
+    uint64_t    hash;
+    uint64_t    stamp;      /* as the choice, type MAB_EVENT_BETA */
+    uint32_t    alpha;      /* saturated at UINT32_MAX */
+    uint32_t    beta;
+    uint32_t    level;
+    uint32_t    flags;
+};
+typedef struct mab_event_beta_s mab_event_beta_t;
+
+#define MAB_EVENT_STAMP(ms, type)   ((uint64_t)(ms) << 8 | (type))
+#define MAB_EVENT_TYPE(e)           ((int)((e)->stamp & 0xff))
+#define MAB_EVENT_MS(e)             ((e)->stamp >> 8)
+
+#endif
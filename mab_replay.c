@@ -0,0 +1,611 @@
+/*
+ * mab-replay: offline evaluation of bandit policies on an event log written
+ * by mabredis (module arg EVENTLOG), with the redis free multiarm.c core.
+ *
+ * the keys are spread over the worker threads by hash, every thread maps
+ * the log files in order and handles the events of its keys only, so the
+ * events of a key are seen in log order. a key gets one candidate bandit
+ * per policy. a logged choice asks every candidate for its choice, a reward
+ * is joined to the oldest pending choice of the same key and arm, it is
+ * fed to the candidates which made that choice. two estimators of the mean
+ * reward of a candidate are reported:
+ *
+ *   replay   mean reward of the matching choices (rejection sampling), fair
+ *            when the logging policy chose uniformly
+ *   ips      sum of reward / propensity over the matching choices divided by
+ *            the number of logged choices, over the choices with a known
+ *            propensity. a choice which is never rewarded counts as 0
+ *
+ * the propensity of a thompsen or htree choice is estimated here from the
+ * posteriors logged with it, propensities below a floor are clipped to it
+ * and counted.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "multiarm.h"
+#include "mab_event.h"
+#include "pcg.h"
+
+#define REPLAY_MAX_POLICIES     16
+#define REPLAY_PENDING          8
+#define REPLAY_MIN_TABLE        1024
+#define REPLAY_DRAWS            256
+#define REPLAY_CLIP             0.01
+
+struct replay_policy_s {
+    char        name[64];
+    char        label[80];  /* policy[:option] */
+    const char  *option;
+
+    /* summed over threads */
+    uint64_t    matched;
+    double      reward;     /* of the matching choices */
+    double      ips;        /* reward / propensity of the matching choices */
+};
+typedef struct replay_policy_s replay_policy_t;
+
+/*
+ * choices of an arm waiting for their reward, oldest first. weight is
+ * 1 / propensity (0 unknown), bit j of match is set if policy j made the
+ * same choice
+ */
+struct replay_arm_s {
+    float       weight[REPLAY_PENDING];
+    uint16_t    match[REPLAY_PENDING];
+    uint8_t     head;
+    uint8_t     len;
+};
+typedef struct replay_arm_s replay_arm_t;
+
+struct replay_key_s {
+    uint64_t        hash;
+    uint32_t        narms;
+    replay_arm_t    *arms;
+    multi_arm_t     *ma[];      /* one candidate per policy */
+};
+typedef struct replay_key_s replay_key_t;
+
+struct replay_worker_s {
+    pthread_t       tid;
+    int             id;
+
+    /* open addressing on the key hash */
+    replay_key_t    **table;
+    size_t          cap;
+    size_t          len;
+
+    /* candidates of the next thompson choice of key beta_hash */
+    multi_arm_beta_t    *betas;
+    int             nbetas;
+    int             cbetas;
+    int             best;
+    uint64_t        beta_hash;
+
+    uint64_t        events;
+    uint64_t        choices;
+    uint64_t        known;      /* choices with a known propensity */
+    uint64_t        clipped;    /* of them below the floor */
+    uint64_t        rewarded;   /* choices joined to a reward */
+    uint64_t        orphans;    /* rewards without a pending choice */
+    uint64_t        unrewarded; /* choices pushed out of a full queue or left pending */
+    double          reward;     /* logged reward of the rewarded choices */
+
+    uint64_t        matched[REPLAY_MAX_POLICIES];
+    double          preward[REPLAY_MAX_POLICIES];
+    double          ips[REPLAY_MAX_POLICIES];
+};
+typedef struct replay_worker_s replay_worker_t;
+
+struct replay_config_s {
+    replay_policy_t policies[REPLAY_MAX_POLICIES];
+    int             npolicies;
+
+    char            **files;
+    int             nfiles;
+    uint64_t        bytes;
+    int             threads;
+    int             draws;      /* per level of a thompson propensity */
+    double          clip;       /* floor of the propensities */
+    uint64_t        seed;
+};
+typedef struct replay_config_s replay_config_t;
+
+static replay_config_t  config = {
+    .npolicies = 0,
+    .files = NULL,
+    .nfiles = 0,
+    .bytes = 0,
+    .threads = 0,
+    .draws = REPLAY_DRAWS,
+    .clip = REPLAY_CLIP,
+    .seed = 0,
+};
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+die(const char *msg)
+{
+    fprintf(stderr, "mab-replay: %s\n", msg);
+    exit(1);
+}
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+    void    *p = calloc(n, size);
+
+    if(p == NULL){
+        die("run out of memory");
+    }
+    return p;
+}
+
+static void
+replay_key_reset(replay_key_t *k, uint32_t narms)
+{
+    void    **choices = xcalloc(narms, sizeof(void *));
+    int     j;
+
+    for(j = 0; j < config.npolicies; j++){
+        if(k->ma[j]){
+            multi_arm_free(k->ma[j]);
+        }
+        k->ma[j] = multi_arm_new(config.policies[j].name, choices, (int)narms,
+                config.policies[j].option);
+        if(k->ma[j] == NULL){
+            die("create multi arm bandit fail");
+        }
+    }
+    free(choices);
+
+    free(k->arms);
+    k->arms = xcalloc(narms, sizeof(replay_arm_t));
+    k->narms = narms;
+}
+
+static void
+replay_table_grow(replay_worker_t *w)
+{
+    replay_key_t    **old = w->table;
+    size_t          cap = w->cap, i, j;
+
+    w->cap = cap ? cap * 2 : REPLAY_MIN_TABLE;
+    w->table = xcalloc(w->cap, sizeof(replay_key_t *));
+    for(i = 0; i < cap; i++){
+        if(old[i] == NULL){
+            continue;
+        }
+        for(j = old[i]->hash & (w->cap - 1); w->table[j]; j = (j + 1) & (w->cap - 1));
+        w->table[j] = old[i];
+    }
+    free(old);
+}
+
+/* the state of key hash, created with narms arms if create is set */
+static replay_key_t *
+replay_key(replay_worker_t *w, uint64_t hash, uint32_t narms, int create)
+{
+    replay_key_t    *k;
+    size_t          i;
+
+    if(w->cap == 0){
+        replay_table_grow(w);
+    }
+    for(i = hash & (w->cap - 1); (k = w->table[i]) != NULL; i = (i + 1) & (w->cap - 1)){
+        if(k->hash == hash){
+            return k;
+        }
+    }
+    if(!create){
+        return NULL;
+    }
+
+    k = xcalloc(1, sizeof(*k) + sizeof(multi_arm_t *) * config.npolicies);
+    k->hash = hash;
+    replay_key_reset(k, narms);
+
+    w->table[i] = k;
+    if(++w->len * 10 > w->cap * 7){
+        replay_table_grow(w);
+    }
+    return k;
+}
+
+/* a candidate of the thompson choice of its key which follows */
+static void
+replay_beta(replay_worker_t *w, const mab_event_beta_t *e)
+{
+    multi_arm_beta_t    *b;
+
+    if(w->nbetas > 0 && w->beta_hash != e->hash){
+        w->nbetas = 0;
+    }
+    if(w->nbetas == w->cbetas){
+        w->cbetas = w->cbetas ? w->cbetas * 2 : 64;
+        w->betas = realloc(w->betas, sizeof(multi_arm_beta_t) * w->cbetas);
+        if(w->betas == NULL){
+            die("run out of memory");
+        }
+    }
+    if(w->nbetas == 0){
+        w->beta_hash = e->hash;
+        w->best = 0;
+    }
+
+    b = w->betas + w->nbetas++;
+    b->alpha = e->alpha;
+    b->beta = e->beta;
+    b->level = (int)e->level;
+    b->chosen = (e->flags & MAB_EVENT_BETA_CHOSEN) != 0;
+    w->best |= (e->flags & MAB_EVENT_BETA_BEST) != 0;
+}
+
+/* the propensity of a logged choice clipped to the floor, 0 if unknown */
+static double
+replay_propensity(replay_worker_t *w, const mab_event_t *e)
+{
+    double  share = -e->value, p = e->value;
+    int     known = e->value > 0.0;
+
+    //a thompson choice whose posteriors were dropped is unknown
+    if(e->value < 0.0 && w->nbetas > 0 && w->beta_hash == e->hash){
+        p = share * multi_arm_posterior_propensity(w->betas, w->nbetas, config.draws) +
+            (w->best ? 1.0 - share : 0.0);
+        known = 1;
+    }
+    w->nbetas = 0;
+
+    if(!known){
+        return 0.0;
+    }
+    w->known++;
+    if(p < config.clip){
+        p = config.clip;
+        w->clipped++;
+    }
+    return p;
+}
+
+static void
+replay_choice(replay_worker_t *w, const mab_event_t *e)
+{
+    replay_key_t    *k;
+    replay_arm_t    *arm;
+    uint16_t        match = 0;
+    double          p = replay_propensity(w, e);
+    int             j, idx, slot;
+
+    if(e->n == 0 || e->idx >= e->n){
+        return;
+    }
+    k = replay_key(w, e->hash, e->n, 1);
+    if(k->narms != e->n){
+        //arms were added or removed, start the candidates over
+        replay_key_reset(k, e->n);
+    }
+
+    for(j = 0; j < config.npolicies; j++){
+        multi_arm_choice(k->ma[j], &idx);
+        if(idx == (int)e->idx){
+            match |= 1 << j;
+        }
+    }
+
+    arm = k->arms + e->idx;
+    if(arm->len == REPLAY_PENDING){
+        arm->head = (arm->head + 1) % REPLAY_PENDING;
+        arm->len--;
+        w->unrewarded++;
+    }
+    slot = (arm->head + arm->len++) % REPLAY_PENDING;
+    arm->weight[slot] = p > 0.0 ? (float)(1.0 / p) : 0.0f;
+    arm->match[slot] = match;
+    w->choices++;
+}
+
+/*
+ * join the trials rewards of an event to as many pending choices of the
+ * arm, each one gets the mean reward
+ */
+static void
+replay_reward(replay_worker_t *w, const mab_event_t *e)
+{
+    replay_key_t    *k = replay_key(w, e->hash, 0, 0);
+    replay_arm_t    *arm;
+    uint64_t        n, trials = e->n ? e->n : 1, matched[REPLAY_MAX_POLICIES] = {0};
+    double          r = e->value / trials, weight;
+    int             j, slot;
+
+    if(k == NULL || e->idx >= k->narms){
+        w->orphans += trials;
+        return;
+    }
+
+    arm = k->arms + e->idx;
+    for(n = 0; n < trials && arm->len > 0; n++){
+        slot = arm->head;
+        arm->head = (arm->head + 1) % REPLAY_PENDING;
+        arm->len--;
+
+        weight = arm->weight[slot];
+        w->rewarded++;
+        w->reward += r;
+        for(j = 0; j < config.npolicies; j++){
+            if(arm->match[slot] & (1 << j)){
+                matched[j]++;
+                w->matched[j]++;
+                w->preward[j] += r;
+                w->ips[j] += r * weight;
+            }
+        }
+    }
+    w->orphans += trials - n;
+
+    for(j = 0; j < config.npolicies; j++){
+        if(matched[j] == 1){
+            multi_arm_reward(k->ma[j], (int)e->idx, r);
+        }else if(matched[j] > 1){
+            multi_arm_reward_agg(k->ma[j], (int)e->idx, matched[j], r * matched[j],
+                    (uint64_t)(r * matched[j] + 0.5));
+        }
+    }
+}
+
+static void
+replay_file(replay_worker_t *w, const char *path)
+{
+    const mab_event_header_t    *h;
+    const mab_event_t           *e, *end;
+    struct stat                 st;
+    uint8_t                     *base;
+    int                         fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0){
+        fprintf(stderr, "mab-replay: can not open %s\n", path);
+        exit(1);
+    }
+    if(st.st_size < (off_t)sizeof(*h)){
+        close(fd);
+        return;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED){
+        die("mmap event log fail");
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    h = (const mab_event_header_t *)base;
+    if(memcmp(h->magic, MAB_EVENT_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version > MAB_EVENT_VERSION || h->size != sizeof(mab_event_t)){
+        fprintf(stderr, "mab-replay: %s is not an event log\n", path);
+        exit(1);
+    }
+
+    //a log being written may end with a partial record
+    e = (const mab_event_t *)(base + sizeof(*h));
+    end = e + (st.st_size - sizeof(*h)) / sizeof(mab_event_t);
+    for(; e < end; e++){
+        //high bits, the key tables index by the low ones
+        if((e->hash >> 32) % config.threads != (uint64_t)w->id){
+            continue;
+        }
+        w->events++;
+        switch(MAB_EVENT_TYPE(e)){
+            case MAB_EVENT_CHOICE: replay_choice(w, e); break;
+            case MAB_EVENT_REWARD: replay_reward(w, e); break;
+            case MAB_EVENT_BETA: replay_beta(w, (const mab_event_beta_t *)e); break;
+        }
+    }
+
+    munmap(base, st.st_size);
+}
+
+static void *
+replay_worker(void *arg)
+{
+    replay_worker_t *w = arg;
+    size_t          k;
+    uint32_t        a;
+    int             i;
+
+    pcg32_srandom(config.seed, (uint64_t)w->id);
+    for(i = 0; i < config.nfiles; i++){
+        replay_file(w, config.files[i]);
+    }
+
+    for(k = 0; k < w->cap; k++){
+        if(w->table[k] == NULL){
+            continue;
+        }
+        for(a = 0; a < w->table[k]->narms; a++){
+            w->unrewarded += w->table[k]->arms[a].len;
+        }
+    }
+    return NULL;
+}
+
+static void
+replay_report(replay_worker_t *workers, double elapsed)
+{
+    uint64_t    events = 0, choices = 0, rewarded = 0, known = 0, clipped = 0, orphans = 0;
+    uint64_t    unrewarded = 0, keys = 0;
+    double      reward = 0.0;
+    int         i, j;
+
+    for(i = 0; i < config.threads; i++){
+        replay_worker_t *w = workers + i;
+
+        events += w->events;
+        choices += w->choices;
+        rewarded += w->rewarded;
+        known += w->known;
+        clipped += w->clipped;
+        orphans += w->orphans;
+        unrewarded += w->unrewarded;
+        keys += w->len;
+        reward += w->reward;
+        for(j = 0; j < config.npolicies; j++){
+            config.policies[j].matched += w->matched[j];
+            config.policies[j].reward += w->preward[j];
+            config.policies[j].ips += w->ips[j];
+        }
+    }
+
+    printf("====== mab-replay ======\n");
+    printf("  %lu events of %lu keys from %d files, %d threads, %.2f seconds, "
+            "%.0f events/sec, %.1f MB/sec\n", events, keys, config.nfiles, config.threads,
+            elapsed, events / elapsed, config.bytes / elapsed / (1 << 20));
+    printf("  %lu choices, %lu of them rewarded, %lu rewards without a choice, %lu choices "
+            "never rewarded\n", choices, rewarded, orphans, unrewarded);
+    printf("  %lu choices with a propensity, %lu of them clipped to %g (%.2f%%)\n\n", known,
+            clipped, config.clip, known ? 100.0 * clipped / known : 0.0);
+
+    printf("%-16s %14s %10s %12s %12s\n", "policy", "matched", "match%", "replay", "ips");
+    printf("%-16s %14lu %10.2f %12.6f %12s\n", "(logged)", rewarded, 100.0,
+            rewarded ? reward / rewarded : 0.0, "-");
+    for(j = 0; j < config.npolicies; j++){
+        replay_policy_t *p = config.policies + j;
+
+        printf("%-16s %14lu %10.2f %12.6f ", p->label, p->matched,
+                rewarded ? 100.0 * p->matched / rewarded : 0.0,
+                p->matched ? p->reward / p->matched : 0.0);
+        if(known){
+            printf("%12.6f\n", p->ips / known);
+        }else{
+            printf("%12s\n", "-");
+        }
+    }
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+"usage: mab-replay [options] <log> [<log> ...]\n"
+"  the logs of a server in the order they were written, oldest first\n"
+"  -p <policies>   comma separated policy[:option] list (default ucb1,egreedy:0.1,thompsen)\n"
+"  -t <threads>    worker threads (default number of online cpus)\n"
+"  -d <draws>      draws per level to estimate a thompson propensity (default %d)\n"
+"  -c <clip>       floor of the propensities, lower ones are clipped and counted (default %g)\n"
+"  -S <seed>       seed (default time based)\n", REPLAY_DRAWS, REPLAY_CLIP);
+    exit(1);
+}
+
+static void
+parse_policies(char *s)
+{
+    char    *tok, *save = NULL, *opt;
+
+    for(tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+        if(config.npolicies == REPLAY_MAX_POLICIES){
+            usage();
+        }
+
+        replay_policy_t *p = config.policies + config.npolicies++;
+
+        opt = strchr(tok, ':');
+        if(opt){
+            *opt++ = '\0';
+        }
+        snprintf(p->name, sizeof(p->name), "%s", tok);
+        snprintf(p->label, sizeof(p->label), "%s%s%s", tok, opt ? ":" : "", opt ? opt : "");
+        p->option = opt;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    char            defaults[] = "ucb1,egreedy:0.1,thompsen";
+    replay_worker_t *workers;
+    struct stat     st;
+    double          start;
+    int             opt, i;
+
+    config.seed = (uint64_t)time(NULL);
+    while((opt = getopt(argc, argv, "p:t:d:c:S:")) != -1){
+        switch(opt){
+            case 'p': parse_policies(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'd': config.draws = atoi(optarg); break;
+            case 'c': config.clip = atof(optarg); break;
+            case 'S': config.seed = strtoull(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+    if(optind == argc || config.draws <= 0 || config.clip <= 0.0 || config.clip > 1.0){
+        usage();
+    }
+    config.files = argv + optind;
+    config.nfiles = argc - optind;
+
+    if(config.npolicies == 0){
+        parse_policies(defaults);
+    }
+    if(config.threads <= 0){
+        config.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        config.threads = config.threads > 0 ? config.threads : 1;
+    }
+
+    for(i = 0; i < config.nfiles; i++){
+        if(stat(config.files[i], &st) != 0){
+            fprintf(stderr, "mab-replay: can not open %s\n", config.files[i]);
+            return 1;
+        }
+        config.bytes += st.st_size;
+    }
+
+    multi_arm_init(NULL, NULL, NULL);
+
+    /* reject unknown policies and bad options before starting the workers */
+    for(i = 0; i < config.npolicies; i++){
+        void            *choices[2] = {NULL};
+        replay_policy_t *p = config.policies + i;
+        multi_arm_t     *ma = multi_arm_new(p->name, choices, 2, p->option);
+
+        if(ma == NULL){
+            fprintf(stderr, "mab-replay: invalid policy %s\n", p->name);
+            return 1;
+        }
+        multi_arm_free(ma);
+    }
+
+    workers = xcalloc(config.threads, sizeof(replay_worker_t));
+    start = now_seconds();
+    for(i = 0; i < config.threads; i++){
+        workers[i].id = i;
+        if(pthread_create(&workers[i].tid, NULL, replay_worker, workers + i) != 0){
+            die("create worker thread fail");
+        }
+    }
+    for(i = 0; i < config.threads; i++){
+        pthread_join(workers[i].tid, NULL);
+    }
+
+    replay_report(workers, now_seconds() - start);
+    return 0;
+}
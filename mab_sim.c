@@ -0,0 +1,405 @@
+/*
+ * mab-sim: offline bandit simulator built on the redis free multiarm.c core.
+ *
+ * every policy is run against $envs independent environments. an environment
+ * owns its arms (bernoulli or gaussian rewards, optionally drifting means)
+ * and its own multi_arm_t. environments are spread over a pool of worker
+ * threads, each thread draws from its own pcg32 stream which is reseeded per
+ * environment so a run is reproducible whatever the scheduling is.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "multiarm.h"
+#include "pcg.h"
+
+#define SIM_MAX_ARMS        64
+#define SIM_MAX_POLICIES    16
+#define SIM_MAX_POINTS      1000
+
+enum {
+    SIM_DIST_BERNOULLI = 0,
+    SIM_DIST_GAUSSIAN
+};
+
+struct sim_policy_s {
+    char        name[64];
+    const char  *option;
+
+    /* summed over environments, one slot per curve point */
+    double      *regret;
+    double      seconds;
+    uint64_t    decisions;
+};
+typedef struct sim_policy_s sim_policy_t;
+
+struct sim_config_s {
+    sim_policy_t    policies[SIM_MAX_POLICIES];
+    int             npolicies;
+
+    double          means[SIM_MAX_ARMS];
+    int             narms;
+    int             dist;
+    double          sigma;
+    double          drift;
+    double          freeze;     /* explore of multi_arm_set_freeze, < 0 off */
+    long long       ts_normal;  /* multi_arm_set_ts_normal, < 0 keeps the default */
+
+    long            envs;
+    long long       steps;
+    int             threads;
+    int             points;
+    uint64_t        seed;
+};
+typedef struct sim_config_s sim_config_t;
+
+static sim_config_t     config = {
+    .npolicies = 0,
+    .means = {0.1, 0.2, 0.3},
+    .narms = 3,
+    .dist = SIM_DIST_BERNOULLI,
+    .sigma = 0.1,
+    .drift = 0.0,
+    .freeze = -1.0,
+    .ts_normal = -1,
+    .envs = 100,
+    .steps = 100000,
+    .threads = 0,
+    .points = 10,
+    .seed = 0,
+};
+
+static long             next_job = 0;
+static pthread_mutex_t  result_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+die(const char *msg)
+{
+    fprintf(stderr, "mab-sim: %s\n", msg);
+    exit(1);
+}
+
+static double
+clamp01(double v)
+{
+    return v < 0.0 ? 0.0 : (v > 1.0 ? 1.0 : v);
+}
+
+/* standard normal variate by box-muller, from the calling thread's stream */
+static double
+gaussian(void)
+{
+    double  u = randnumber(), v = randnumber();
+
+    if(u < 1e-300){
+        u = 1e-300;
+    }
+    return sqrt(-2.0 * log(u)) * cos(2.0 * 3.14159265358979323846 * v);
+}
+
+static double
+sim_reward(double mean)
+{
+    if(config.dist == SIM_DIST_BERNOULLI){
+        return randnumber() < mean ? 1.0 : 0.0;
+    }
+    return clamp01(mean + config.sigma * gaussian());
+}
+
+/*
+ * run environment $env of policy $p, add its regret curve into $curve
+ * return the number of decisions made
+ */
+static uint64_t
+sim_run_env(sim_policy_t *p, long env, double *curve)
+{
+    double          means[SIM_MAX_ARMS], best, regret = 0.0;
+    void            *choices[SIM_MAX_ARMS];
+    int             i, idx, point = 0;
+    long long       step, next_point;
+    multi_arm_t     *ma;
+
+    pcg32_srandom(config.seed + (uint64_t)env, (uint64_t)(p - config.policies));
+
+    for(i = 0; i < config.narms; i++){
+        means[i] = config.means[i];
+        choices[i] = NULL;
+    }
+
+    ma = multi_arm_new(p->name, choices, config.narms, p->option);
+    if(ma == NULL){
+        die("create multi arm bandit fail");
+    }
+    if(config.freeze >= 0.0){
+        multi_arm_set_freeze(ma, config.freeze);
+    }
+
+    best = 0.0;
+    for(i = 0; i < config.narms; i++){
+        best = means[i] > best ? means[i] : best;
+    }
+
+    next_point = config.steps / config.points;
+    for(step = 1; step <= config.steps; step++){
+        multi_arm_choice(ma, &idx);
+        regret += best - means[idx];
+        multi_arm_reward(ma, idx, sim_reward(means[idx]));
+
+        if(config.drift > 0.0){
+            best = 0.0;
+            for(i = 0; i < config.narms; i++){
+                means[i] = clamp01(means[i] + config.drift * gaussian());
+                best = means[i] > best ? means[i] : best;
+            }
+        }
+
+        if(step == next_point){
+            curve[point++] += regret;
+            next_point = config.steps * (point + 1) / config.points;
+        }
+    }
+
+    multi_arm_free(ma);
+    return (uint64_t)config.steps;
+}
+
+static void *
+sim_worker(void *arg)
+{
+    double      *curve = calloc(config.points, sizeof(double));
+    long        job, njobs = config.envs * config.npolicies;
+
+    (void)arg;
+    if(curve == NULL){
+        die("run out of memory");
+    }
+
+    while((job = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < njobs){
+        sim_policy_t    *p = config.policies + job / config.envs;
+        double          start = now_seconds();
+        uint64_t        n;
+        int             i;
+
+        memset(curve, 0, sizeof(double) * config.points);
+        n = sim_run_env(p, job % config.envs, curve);
+
+        pthread_mutex_lock(&result_lock);
+        for(i = 0; i < config.points; i++){
+            p->regret[i] += curve[i];
+        }
+        p->seconds += now_seconds() - start;
+        p->decisions += n;
+        pthread_mutex_unlock(&result_lock);
+    }
+
+    free(curve);
+    return NULL;
+}
+
+static void
+sim_report(double elapsed)
+{
+    uint64_t    total = 0;
+    int         i, j;
+
+    printf("====== mab-sim ======\n");
+    printf("  %d arms (%s), drift %g, %ld environments x %lld steps per policy, %d threads\n\n",
+            config.narms, config.dist == SIM_DIST_BERNOULLI ? "bernoulli" : "gaussian",
+            config.drift, config.envs, config.steps, config.threads);
+
+    printf("average cumulative regret\n%14s", "step");
+    for(j = 0; j < config.npolicies; j++){
+        printf(" %16s", config.policies[j].name);
+    }
+    printf("\n");
+
+    for(i = 0; i < config.points; i++){
+        printf("%14lld", config.steps * (i + 1) / config.points);
+        for(j = 0; j < config.npolicies; j++){
+            printf(" %16.3f", config.policies[j].regret[i] / config.envs);
+        }
+        printf("\n");
+    }
+
+    printf("\n%-16s %20s %20s\n", "policy", "decisions", "decisions/sec/thread");
+    for(j = 0; j < config.npolicies; j++){
+        sim_policy_t    *p = config.policies + j;
+
+        printf("%-16s %20lu %20.0f\n", p->name, p->decisions, p->decisions / p->seconds);
+        total += p->decisions;
+    }
+    printf("\n  %lu decisions in %.2f seconds, %.0f decisions/sec\n", total, elapsed,
+            total / elapsed);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+"usage: mab-sim [options]\n"
+"  -p <policies>   comma separated policy[:option] list (default ucb1,egreedy:0.1,thompsen)\n"
+"  -m <means>      comma separated mean reward of every arm (default 0.1,0.2,0.3)\n"
+"  -d <dist>       reward distribution, bernoulli or gaussian (default bernoulli)\n"
+"  -s <sigma>      standard deviation of gaussian rewards (default 0.1)\n"
+"  -D <drift>      standard deviation of the per step random walk of arm means (default 0)\n"
+"  -F <explore>    freeze converged bandits, explore is the share of choices left to the policy (default off)\n"
+"  -N <count>      thompson draws a normal above this count, 0 always exact (default %d)\n"
+"  -e <envs>       independent environments per policy (default 100)\n"
+"  -n <steps>      steps per environment (default 100000)\n"
+"  -t <threads>    worker threads (default number of online cpus)\n"
+"  -c <points>     number of points of the regret curve (default 10)\n"
+"  -S <seed>       base seed (default time based)\n", MULTI_ARM_TS_NORMAL_DEFAULT);
+    exit(1);
+}
+
+static void
+parse_policies(char *s)
+{
+    char    *tok, *save = NULL, *opt;
+
+    for(tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+        if(config.npolicies == SIM_MAX_POLICIES){
+            usage();
+        }
+
+        sim_policy_t    *p = config.policies + config.npolicies++;
+
+        opt = strchr(tok, ':');
+        if(opt){
+            *opt++ = '\0';
+        }
+        snprintf(p->name, sizeof(p->name), "%s", tok);
+        p->option = opt;
+    }
+}
+
+static void
+parse_means(const char *s)
+{
+    char    *end;
+
+    config.narms = 0;
+    while(*s){
+        if(config.narms == SIM_MAX_ARMS){
+            usage();
+        }
+
+        double  v = strtod(s, &end);
+        if(end == s || v < 0.0 || v > 1.0){
+            usage();
+        }
+        config.means[config.narms++] = v;
+
+        s = (*end == ',') ? end + 1 : end;
+        if(*end != ',' && *end != '\0'){
+            usage();
+        }
+    }
+    if(config.narms == 0){
+        usage();
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    char    defaults[] = "ucb1,egreedy:0.1,thompsen";
+    int     opt, i;
+
+    config.seed = (uint64_t)time(NULL);
+    while((opt = getopt(argc, argv, "p:m:d:s:D:F:N:e:n:t:c:S:")) != -1){
+        switch(opt){
+            case 'p': parse_policies(optarg); break;
+            case 'm': parse_means(optarg); break;
+            case 'd':
+                if(strcmp(optarg, "bernoulli") == 0){
+                    config.dist = SIM_DIST_BERNOULLI;
+                }else if(strcmp(optarg, "gaussian") == 0){
+                    config.dist = SIM_DIST_GAUSSIAN;
+                }else{
+                    usage();
+                }
+                break;
+            case 's': config.sigma = atof(optarg); break;
+            case 'D': config.drift = atof(optarg); break;
+            case 'F': config.freeze = atof(optarg); break;
+            case 'N': config.ts_normal = atoll(optarg); break;
+            case 'e': config.envs = atol(optarg); break;
+            case 'n': config.steps = atoll(optarg); break;
+            case 't': config.threads = atoi(optarg); break;
+            case 'c': config.points = atoi(optarg); break;
+            case 'S': config.seed = strtoull(optarg, NULL, 10); break;
+            default: usage();
+        }
+    }
+
+    if(config.npolicies == 0){
+        parse_policies(defaults);
+    }
+    if(config.threads <= 0){
+        config.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        config.threads = config.threads > 0 ? config.threads : 1;
+    }
+    if(config.envs <= 0 || config.steps <= 0 || config.points <= 0 || config.freeze > 1.0 ||
+            config.points > SIM_MAX_POINTS || config.points > config.steps){
+        usage();
+    }
+
+    multi_arm_init(NULL, NULL, NULL);
+    if(config.ts_normal >= 0){
+        multi_arm_set_ts_normal((uint64_t)config.ts_normal);
+    }
+
+    /* reject unknown policies and bad options before starting the workers */
+    for(i = 0; i < config.npolicies; i++){
+        void            *choices[SIM_MAX_ARMS] = {NULL};
+        sim_policy_t    *p = config.policies + i;
+        multi_arm_t     *ma = multi_arm_new(p->name, choices, config.narms, p->option);
+
+        if(ma == NULL){
+            fprintf(stderr, "mab-sim: invalid policy %s\n", p->name);
+            return 1;
+        }
+        multi_arm_free(ma);
+
+        p->regret = calloc(config.points, sizeof(double));
+        if(p->regret == NULL){
+            die("run out of memory");
+        }
+    }
+
+    pthread_t   *threads = calloc(config.threads, sizeof(pthread_t));
+    double      start = now_seconds();
+
+    if(threads == NULL){
+        die("run out of memory");
+    }
+    for(i = 0; i < config.threads; i++){
+        if(pthread_create(threads + i, NULL, sim_worker, NULL) != 0){
+            die("create worker thread fail");
+        }
+    }
+    for(i = 0; i < config.threads; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    sim_report(now_seconds() - start);
+    return 0;
+}
@@ -1,13 +1,65 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#define REDISMODULE_EXPERIMENTAL_API
 #include "redismodule.h"
 #include "multiarm.h"
+#include "mab_event.h"
 
-#define MABREDIS_ENCODING_VERSION   0
+#define MABREDIS_ENCODING_VERSION   2
 #define MABREDIS_TYPE_NAME          "mab-nadia"
-#define MABREDIS_STATBUF_SIZE       1024
+#define MABREDIS_STATBUF_SIZE       1024    //statjson buffer, plus per arm
+#define MABREDIS_STATBUF_ARM_SIZE   128
 #define MABREDIS_MAXCHOICE_NUM      64
+/* the hierarchical policy chooses in O(log n), it may hold a lot more arms */
+#define MABREDIS_HTREE_MAXCHOICE_NUM    (1 << 20)
+
+/* INFO replication is parsed at most once per interval ms for MAXSTALE */
+#define MABREDIS_STALE_INTERVAL     100
+
+/* cold bandit sweep, runs every interval ms and folds at most steps objects */
+#define MABREDIS_COLD_INTERVAL      100
+#define MABREDIS_COLD_STEPS         1000
+
+/*
+ * hot key sketch, depth rows of width counters, and default top-k / half-life (s).
+ * the counters of a key lie in one block of 16, one cache line
+ */
+#define MABREDIS_HOT_DEPTH          4
+#define MABREDIS_HOT_WIDTH          (1 << 14)
+#define MABREDIS_HOT_TOPK           32
+#define MABREDIS_HOT_MAX_TOPK       1024
+#define MABREDIS_HOT_HALFLIFE       60
+
+/* decision tickets, default pending limit and ttl (s), expired tickets handled per command */
+#define MABREDIS_TICKET_MAX         (1 << 20)
+#define MABREDIS_TICKET_TTL         600
+#define MABREDIS_TICKET_MIN_RING    1024
+#define MABREDIS_TICKET_STEPS       64
+#define MABREDIS_TICKET_INTERVAL    1000
+
+/*
+ * event log, events per buffer, buffers in flight, idle flush interval (ms),
+ * default rotation size (MB) and beta records of a thompson choice
+ */
+#define MABREDIS_EVENT_BATCH        4096
+#define MABREDIS_EVENT_BUFFERS      16
+#define MABREDIS_EVENT_FLUSH        1000
+#define MABREDIS_EVENT_ROTATE       1024
+#define MABREDIS_EVENT_BETAS        256
+#define MABREDIS_EVENT_MAX_BETAS    1024
 
 static RedisModuleType *mabType;
 
@@ -17,13 +69,273 @@ struct sstr_s{
 };
 typedef struct sstr_s sstr_t;
 
+/*
+ * choices shared by a template and the bandits mab.msetfrom created from
+ * it. the last reference frees them, it may be dropped by lazyfree out of
+ * the main thread
+ */
+struct mab_shared_choices_s {
+    sstr_t              **choices;
+    int                 choice_num;
+    uint64_t            refs;
+};
+typedef struct mab_shared_choices_s mab_shared_choices_t;
+
 struct mab_type_obj_s {
     sstr_t              **choices;
     int                 choice_num;
+
+    //owner of choices if set, see mab_type_obj_share
+    mab_shared_choices_t    *shared;
     multi_arm_t         *ma;
+
+    /*
+     * serialized form (see mab_type_obj_dump) kept as loaded from rdb, the
+     * object is materialized on its first access. choices and ma are unset
+     * while blob is set
+     */
+    uint8_t             *blob;
+    size_t              bloblen;
+
+    //bumped on every change, see mab_type_obj_modified
+    uint64_t                version;
+
+    //registration of the pending tickets, see mab_ticket_issue
+    uint32_t                ticket;
+
+    //cold list links, see mab_cold_touch
+    struct mab_type_obj_s   *prev;
+    struct mab_type_obj_s   *next;
+    long long               atime;
 };
 typedef struct mab_type_obj_s mab_type_obj_t;
 
+/*
+ * materialized objects ordered by last access, most recent first. a
+ * background thread folds the objects idle for more than idle_ms back into
+ * their serialized form, they are materialized again on the next access.
+ * the lock guards the list against the free callback, which lazyfree may
+ * run out of the main thread
+ */
+struct mab_cold_s {
+    pthread_mutex_t     lock;
+    mab_type_obj_t      *head;
+    mab_type_obj_t      *tail;
+    long long           idle_ms;
+};
+typedef struct mab_cold_s mab_cold_t;
+
+static mab_cold_t   mabCold = {PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0};
+
+/*
+ * keys hit by choice, reward, step and rewardagg. a count-min sketch with
+ * conservative update estimates the hits of every key, the topk keys with
+ * the highest estimate are kept in a min heap. the sketch and the heap are
+ * halved every halflife_ms, so the counts weigh the recent traffic most.
+ * index is an open addressing table from the key hash to the heap position
+ * + 1 (0 is a free slot), each entry keeps its slot to follow the swaps
+ */
+struct mab_hot_key_s {
+    uint64_t            hash;
+    uint32_t            count;
+    uint32_t            slot;
+    size_t              len;
+    char                *name;
+};
+typedef struct mab_hot_key_s mab_hot_key_t;
+
+struct mab_hot_s {
+    uint32_t            *sketch;
+    mab_hot_key_t       *heap;
+    uint32_t            *index;
+    uint32_t            mask;
+    int                 topk;
+    int                 len;
+    long long           halflife_ms;
+    long long           decay_at;
+    uint64_t            hits;
+};
+typedef struct mab_hot_s mab_hot_t;
+
+static mab_hot_t    mabHot = {NULL, NULL, NULL, 0, MABREDIS_HOT_TOPK, 0,
+    MABREDIS_HOT_HALFLIFE * 1000, 0, 0};
+
+/*
+ * pending decision tickets. a ticket is a sequence number, the tickets in
+ * [tail, head) live in a ring indexed by seq & (cap - 1) which grows up to
+ * max. an entry holds the arm and the bandit, an id into bandits shared by
+ * the tickets of the same bandit, bandit 0 marks a ticket resolved. the
+ * first seq is the load time in ms << 20 so ticket ids are not reused
+ * across restarts
+ */
+struct mab_ticket_s {
+    uint32_t            bandit;
+    uint32_t            idx;
+    uint32_t            sec;        /* issue time, seconds since start */
+};
+typedef struct mab_ticket_s mab_ticket_t;
+
+/*
+ * a bandit with pending tickets. obj is only compared with the value of
+ * key in db, the object may be gone (and freed by lazyfree) while tickets
+ * are pending, those tickets are dropped
+ */
+struct mab_ticket_bandit_s {
+    mab_type_obj_t      *obj;
+    int                 db;
+    char                *key;
+    size_t              keylen;
+    uint64_t            pending;
+};
+typedef struct mab_ticket_bandit_s mab_ticket_bandit_t;
+
+struct mab_tickets_s {
+    mab_ticket_t        *ring;
+    uint64_t            cap;
+    uint64_t            max;
+    uint64_t            head;
+    uint64_t            tail;
+    long long           start;
+    long long           ttl;
+    int                 expire_zero;
+
+    mab_ticket_bandit_t *bandits;
+    uint32_t            len;
+    uint32_t            size;
+    uint32_t            *free;
+    uint32_t            nfree;
+};
+typedef struct mab_tickets_s mab_tickets_t;
+
+static mab_tickets_t    mabTickets = {NULL, 0, MABREDIS_TICKET_MAX, 0, 0, 0,
+    MABREDIS_TICKET_TTL, 0, NULL, 1, 0, NULL, 0};
+
+/*
+ * choice and reward events, see mab_event.h. the commands append to the
+ * buffer at fill % MABREDIS_EVENT_BUFFERS, a full buffer is handed to a
+ * writer thread which appends the buffers [flush, fill) to path and renames
+ * the file to path.$ms once it holds rotate bytes. new events are dropped
+ * while every buffer waits for the writer, the commands never wait for the
+ * disk. fill and flush are guarded by lock, fd and size belong to the writer
+ */
+struct mab_events_s {
+    char                *path;
+    long long           rotate;
+    int                 nbetas;
+    multi_arm_beta_t    *betas;     /* scratch of mab_event_choice */
+
+    mab_event_t         *bufs;
+    int                 lens[MABREDIS_EVENT_BUFFERS];
+    int                 len;
+    uint64_t            fill;
+    uint64_t            flush;
+    uint64_t            dropped;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+
+    int                 fd;
+    long long           size;
+    long long           rotated;    /* ms of the last rotated file */
+};
+typedef struct mab_events_s mab_events_t;
+
+static mab_events_t     mabEvents = {NULL, (long long)MABREDIS_EVENT_ROTATE << 20,
+    MABREDIS_EVENT_BETAS, NULL, NULL, {0}, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, -1, 0, 0};
+
+/*
+ * last version given to a bandit. it starts from the load time in ms << 20
+ * so the versions of a key keep growing across restarts
+ */
+static uint64_t     mabVersion;
+
+/*
+ * how far behind its master a replica is, cached until expire (ms). lag is
+ * master_last_io_seconds_ago of INFO replication, -1 if the link is down
+ */
+struct mab_stale_s {
+    long long           expire;
+    long long           lag;
+};
+typedef struct mab_stale_s mab_stale_t;
+
+static mab_stale_t  mabStale = {0, -1};
+
+/*
+ * mab.export file, in host byte order (checked through byteorder). the
+ * header is followed by one column per field, column i starts at
+ * columns[i], 8 byte aligned. n is the number of bandits, m the number of
+ * arms, the {off, len} refs point into HEAP
+ *
+ *   KEY        n       x ref       key name
+ *   POLICY     n       x ref       policy name
+ *   TOTAL      n       x u64       total count
+ *   ARMS       n + 1   x u64       the arms of bandit i are [ARMS[i], ARMS[i + 1])
+ *   STATE      n       x ref       serialized bandit, as saved in rdb
+ *   COUNT      m       x u64
+ *   REWARD     m       x double
+ *   CHOICE     m       x ref
+ *   HEAP       bytes
+ *
+ * mab.import only reads KEY and STATE, the other columns are for readers
+ * which do not want to parse the serialized form
+ */
+#define MABREDIS_EXPORT_MAGIC       "MABEXP01"
+#define MABREDIS_EXPORT_BYTEORDER   0x0102030405060708ULL
+#define MABREDIS_EXPORT_SCAN_COUNT  1000
+
+enum {
+    MAB_EXPORT_KEY = 0,
+    MAB_EXPORT_POLICY,
+    MAB_EXPORT_TOTAL,
+    MAB_EXPORT_ARMS,
+    MAB_EXPORT_STATE,
+    MAB_EXPORT_COUNT,
+    MAB_EXPORT_REWARD,
+    MAB_EXPORT_CHOICE,
+    MAB_EXPORT_HEAP,
+    MAB_EXPORT_COLUMNS
+};
+
+struct mab_export_header_s {
+    char        magic[8];
+    uint64_t    byteorder;
+    uint64_t    bandits;
+    uint64_t    arms;
+    uint64_t    size;
+    uint64_t    columns[MAB_EXPORT_COLUMNS];
+};
+typedef struct mab_export_header_s mab_export_header_t;
+
+struct mab_export_ref_s {
+    uint64_t    off;
+    uint64_t    len;
+};
+typedef struct mab_export_ref_s mab_export_ref_t;
+
+//a bandit copied out of the keyspace
+struct mab_export_entry_s {
+    char        *key;
+    size_t      keylen;
+    uint8_t     *blob;
+    size_t      bloblen;
+    int         arms;       //-1 if the blob is corrupt
+};
+typedef struct mab_export_entry_s mab_export_entry_t;
+
+struct mab_export_job_s {
+    RedisModuleBlockedClient    *bc;
+    char                        *path;
+
+    mab_export_entry_t          *entries;
+    size_t                      len;
+    size_t                      cap;
+
+    long long                   exported;
+    const char                  *err;
+};
+typedef struct mab_export_job_s mab_export_job_t;
+
 static void *mabTypeRDBLoad(RedisModuleIO *rdb, int encv);
 static void mabTypeRDBSave(RedisModuleIO *rdb, void *value);
 static void mabTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key,
@@ -34,20 +346,92 @@ static void mabTypeDigest(RedisModuleDigest *md, void *value);
 
 static int mabTypeSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
         int);
+static int mabTypeTemplate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeMSetFrom_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabType_Set(RedisModuleCtx *ctx, RedisModuleString **, int, int template);
 static int mabTypeChoice_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
         int);
+static int mabTypeMChoice_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
 static int mabTypeReward_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
         int);
 static int mabTypeConfig_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
         int);
 static int mabTypeStatJson_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
         int );
+static int mabTypeAddArm_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeDelArm_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeStep_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeRewardAgg_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeAutoFreeze_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeRestore_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeExport_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeSnapshot_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeImport_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeHotKeys_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
+static int mabTypeRewardTicket_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **,
+        int);
 static RedisModuleKey * mabType_OpenKey(RedisModuleCtx *ctx, RedisModuleString *);
+static int mabType_ParseMask(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+        int arm_num, uint64_t *mask);
 
 static mab_type_obj_t * mab_type_obj_new(RedisModuleString *type,
         RedisModuleString **choices, int choice_num, RedisModuleString *option);
-
+static int mabType_ParseWindow(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+        long long *span, long long *buckets, int *policy);
+static int mabType_MaxChoiceNum(const char *policy);
+static long long mabType_ReplicaLag(RedisModuleCtx *ctx);
+static int mabType_StringToIdx(RedisModuleString *str, long long *idx);
+static int mabType_StringToReward(RedisModuleString *str, double *reward);
+
+static mab_type_obj_t * mab_type_obj_raw(uint8_t *blob, size_t bloblen);
 static void mab_type_obj_free(mab_type_obj_t *);
+static void mab_sstrs_free(sstr_t **strs, int n);
+static void mab_type_obj_dump(mab_type_obj_t *, multi_arm_buf_t *);
+static int mab_type_obj_check(const uint8_t *blob, size_t len);
+static int mab_type_obj_parse(const uint8_t *, size_t, sstr_t ***, multi_arm_t **);
+static int mab_type_obj_materialize(mab_type_obj_t *);
+static void mab_type_obj_fold(mab_type_obj_t *);
+static void mab_type_obj_modified(mab_type_obj_t *);
+static mab_shared_choices_t * mab_type_obj_share(mab_type_obj_t *);
+static void mab_type_obj_unshare(mab_type_obj_t *);
+static void mab_type_obj_free_choices(mab_type_obj_t *);
+
+static void mab_cold_touch(mab_type_obj_t *);
+static void mab_cold_unlink(mab_type_obj_t *);
+static void * mab_cold_thread(void *);
+
+static void mab_hot_hit(RedisModuleString *key);
+static void mab_hot_decay(long long now);
+static void mab_hot_reset(void);
+
+static long long mab_ticket_issue(RedisModuleCtx *ctx, RedisModuleString *key,
+        mab_type_obj_t *mabobj, int idx);
+static int mab_ticket_resolve(RedisModuleCtx *ctx, RedisModuleString *key,
+        long long ticket, double reward, RedisModuleString *reward_str);
+static int mab_ticket_expire(RedisModuleCtx *ctx, int steps);
+static void * mab_ticket_thread(void *);
+
+static uint64_t mab_hot_hash(const char *p, size_t len);
+
+static int mab_event_open(void);
+static void mab_event_choice(RedisModuleString *key, mab_type_obj_t *mabobj,
+        const uint64_t *mask, int idx);
+static void mab_event_reward(RedisModuleCtx *ctx, RedisModuleString *key, int idx,
+        uint64_t trials, double reward);
+static void * mab_event_thread(void *);
 
 /*
  * helper function
@@ -55,18 +439,68 @@ static void mab_type_obj_free(mab_type_obj_t *);
 static sstr_t **RedisModule_StringToSStrs(RedisModuleString **strs, int num);
 static char * RedisModule_StringToCStr(RedisModuleString *str);
 
+static uint64_t
+mabType_Clock(void)
+{
+    return (uint64_t)RedisModule_Milliseconds();
+}
+
 int
 RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
+    int         i;
 
     multi_arm_init(RedisModule_Alloc, RedisModule_Free, RedisModule_Realloc);
+    multi_arm_set_clock(mabType_Clock);
 
     if(RedisModule_Init(ctx, MABREDIS_TYPE_NAME, 1,
                 REDISMODULE_APIVER_1) == REDISMODULE_ERR){
         return REDISMODULE_ERR;
     }
+    mabVersion = (uint64_t)RedisModule_Milliseconds() << 20;
+    mabTickets.start = RedisModule_Milliseconds();
+    mabTickets.head = mabTickets.tail = (uint64_t)mabTickets.start << 20;
+
+    //module args: [COLD-IDLE $seconds] [HOTKEYS $topk] [HOTKEYS-HALFLIFE $seconds]
+    //  [TICKETS $max] [TICKET-TTL $seconds] [TICKET-EXPIRE-ZERO 0|1] [TS-NORMAL $count]
+    //  [EVENTLOG $path] [EVENTLOG-ROTATE $mb] [EVENTLOG-BETAS $max]
+    for(i = 0; i < argc; i += 2){
+        const char  *name = RedisModule_StringPtrLen(argv[i], NULL);
+        long long   val;
+
+        if(strcasecmp(name, "eventlog") == 0 && i + 1 < argc){
+            mabEvents.path = RedisModule_Strdup(RedisModule_StringPtrLen(argv[i + 1], NULL));
+            continue;
+        }
+        if(i + 1 == argc || RedisModule_StringToLongLong(argv[i + 1], &val) != REDISMODULE_OK ||
+                val < 0){
+            RedisModule_Log(ctx, "warning", "invalid value for module arg %s", name);
+            return REDISMODULE_ERR;
+        }
+        if(strcasecmp(name, "cold-idle") == 0){
+            mabCold.idle_ms = val * 1000;
+        }else if(strcasecmp(name, "hotkeys") == 0 && val <= MABREDIS_HOT_MAX_TOPK){
+            mabHot.topk = (int)val;
+        }else if(strcasecmp(name, "hotkeys-halflife") == 0 && val > 0){
+            mabHot.halflife_ms = val * 1000;
+        }else if(strcasecmp(name, "tickets") == 0 && val <= UINT32_MAX){
+            //the ring size, a power of two
+            for(mabTickets.max = val ? 1 : 0; mabTickets.max < (uint64_t)val; mabTickets.max *= 2);
+        }else if(strcasecmp(name, "ticket-ttl") == 0 && val > 0 && val <= UINT32_MAX){
+            mabTickets.ttl = val;
+        }else if(strcasecmp(name, "ticket-expire-zero") == 0 && val <= 1){
+            mabTickets.expire_zero = (int)val;
+        }else if(strcasecmp(name, "ts-normal") == 0){
+            multi_arm_set_ts_normal((uint64_t)val);
+        }else if(strcasecmp(name, "eventlog-rotate") == 0 && val > 0 && val <= INT_MAX){
+            mabEvents.rotate = val << 20;
+        }else if(strcasecmp(name, "eventlog-betas") == 0 && val <= MABREDIS_EVENT_MAX_BETAS){
+            mabEvents.nbetas = (int)val;
+        }else{
+            RedisModule_Log(ctx, "warning", "unknown module arg %s", name);
+            return REDISMODULE_ERR;
+        }
+    }
 
     RedisModuleTypeMethods  tm = {
         .version = REDISMODULE_TYPE_METHOD_VERSION,
@@ -89,8 +523,24 @@ RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         return REDISMODULE_ERR;
     }
 
+    if(RedisModule_CreateCommand(ctx, "mab.template", mabTypeTemplate_RedisCommand,
+                "write deny-oom", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.msetfrom", mabTypeMSetFrom_RedisCommand,
+                "write deny-oom", 1, -1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
     if(RedisModule_CreateCommand(ctx, "mab.choice", mabTypeChoice_RedisCommand,
-                "random", 1, 1, 1) == REDISMODULE_ERR){
+                "readonly random fast", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    //all keys must be in one slot in a cluster, as for mget
+    if(RedisModule_CreateCommand(ctx, "mab.mchoice", mabTypeMChoice_RedisCommand,
+                "readonly random", 1, -1, 1) == REDISMODULE_ERR){
         return REDISMODULE_ERR;
     }
 
@@ -99,6 +549,11 @@ RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
         return REDISMODULE_ERR;
     }
 
+    if(RedisModule_CreateCommand(ctx, "mab.rewardagg", mabTypeRewardAgg_RedisCommand,
+                "write fast deny-oom", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
     if(RedisModule_CreateCommand(ctx, "mab.config", mabTypeConfig_RedisCommand,
                 "write fast", 1, 1, 1) == REDISMODULE_ERR){
         return REDISMODULE_ERR;
@@ -108,6 +563,103 @@ RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
                 "readonly", 1, 1, 1) == REDISMODULE_ERR){
         return REDISMODULE_ERR;
     }
+
+    if(RedisModule_CreateCommand(ctx, "mab.addarm", mabTypeAddArm_RedisCommand,
+                "write deny-oom", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.delarm", mabTypeDelArm_RedisCommand,
+                "write fast", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.step", mabTypeStep_RedisCommand,
+                "write random fast deny-oom", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.autofreeze", mabTypeAutoFreeze_RedisCommand,
+                "write fast", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.restore", mabTypeRestore_RedisCommand,
+                "write deny-oom", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.snapshot", mabTypeSnapshot_RedisCommand,
+                "readonly", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.export", mabTypeExport_RedisCommand,
+                "readonly admin", 0, 0, 0) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.import", mabTypeImport_RedisCommand,
+                "write deny-oom admin", 0, 0, 0) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.rewardticket", mabTypeRewardTicket_RedisCommand,
+                "write fast deny-oom", 1, 1, 1) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    if(RedisModule_CreateCommand(ctx, "mab.hotkeys", mabTypeHotKeys_RedisCommand,
+                "readonly", 0, 0, 0) == REDISMODULE_ERR){
+        return REDISMODULE_ERR;
+    }
+
+    //HOTKEYS 0 turns the tracking off
+    if(mabHot.topk > 0){
+        mabHot.sketch = RedisModule_Calloc(MABREDIS_HOT_DEPTH * MABREDIS_HOT_WIDTH,
+                sizeof(uint32_t));
+        mabHot.heap = RedisModule_Calloc(mabHot.topk, sizeof(mab_hot_key_t));
+        //at most half full so a probe ends after a couple of slots
+        for(mabHot.mask = 1; mabHot.mask < 2 * (uint32_t)mabHot.topk; mabHot.mask <<= 1);
+        mabHot.index = RedisModule_Calloc(mabHot.mask, sizeof(uint32_t));
+        mabHot.mask--;
+        mabHot.decay_at = RedisModule_Milliseconds() + mabHot.halflife_ms;
+    }
+
+    if(mabEvents.path){
+        pthread_t   tid;
+
+        if(mab_event_open() != 0){
+            RedisModule_Log(ctx, "warning", "can not open event log %s", mabEvents.path);
+            return REDISMODULE_ERR;
+        }
+        mabEvents.bufs = RedisModule_Alloc(sizeof(mab_event_t) *
+                MABREDIS_EVENT_BUFFERS * MABREDIS_EVENT_BATCH);
+        mabEvents.betas = RedisModule_Alloc(sizeof(multi_arm_beta_t) *
+                (mabEvents.nbetas ? mabEvents.nbetas : 1));
+        if(pthread_create(&tid, NULL, mab_event_thread, NULL) != 0){
+            return REDISMODULE_ERR;
+        }
+        pthread_detach(tid);
+    }
+
+    if(mabCold.idle_ms > 0){
+        pthread_t   tid;
+
+        if(pthread_create(&tid, NULL, mab_cold_thread, NULL) != 0){
+            return REDISMODULE_ERR;
+        }
+        pthread_detach(tid);
+    }
+
+    if(mabTickets.max > 0){
+        pthread_t   tid;
+
+        if(pthread_create(&tid, NULL, mab_ticket_thread, NULL) != 0){
+            return REDISMODULE_ERR;
+        }
+        pthread_detach(tid);
+    }
     
     return REDISMODULE_OK;
 }
@@ -117,6 +669,10 @@ RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
  * command:
  *
  * mab.set $key $type $choice_num $choice1 $choice2 $choice3 ... [$option]
+ *      [WINDOW $bucket_ms $buckets [STATONLY]]
+ *
+ * WINDOW also keeps per arm statistics over the last $bucket_ms * $buckets
+ * ms, the policy decides on them unless STATONLY is given.
  * 
  * return:
  *
@@ -125,6 +681,32 @@ RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
 
 static int
 mabTypeSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString *argv[], int argc)
+{
+    return mabType_Set(ctx, argv, argc, 0);
+}
+
+/*
+ * command:
+ *
+ * mab.template $key $type $choice_num $choice1 $choice2 $choice3 ... [$option]
+ *      [WINDOW $bucket_ms $buckets [STATONLY]]
+ *
+ * same as mab.set, the bandit is meant to be cloned by mab.msetfrom and
+ * keeps its choices in a block the clones share.
+ *
+ * return:
+ *
+ * $choice_num
+ */
+static int
+mabTypeTemplate_RedisCommand(RedisModuleCtx *ctx, RedisModuleString *argv[], int argc)
+{
+    return mabType_Set(ctx, argv, argc, 1);
+}
+
+/* body of mab.set and mab.template */
+static int
+mabType_Set(RedisModuleCtx *ctx, RedisModuleString *argv[], int argc, int template)
 {
     RedisModule_AutoMemory(ctx); 
 
@@ -137,14 +719,30 @@ mabTypeSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString *argv[], int argc
         return RedisModule_ReplyWithError(ctx,
                 "ERR choice number must be a interger");
     }
-    if(choice_num > MABREDIS_MAXCHOICE_NUM){
+    if(choice_num > mabType_MaxChoiceNum(RedisModule_StringPtrLen(argv[2], NULL))){
         return RedisModule_ReplyWithError(ctx, "ERR choice_num too big");
     }
 
-    if(choice_num != argc - 4 && choice_num != argc - 5){
+    if(choice_num <= 0 || choice_num > argc - 4){
         return RedisModule_WrongArity(ctx);
     }
 
+    //what follows the choices: [$option] [WINDOW ...]
+    RedisModuleString   **extra = argv + 4 + choice_num, *option = NULL;
+    int                 extra_num = argc - 4 - (int)choice_num;
+    long long           span = 0, buckets = 0;
+    int                 window_policy = 0;
+
+    if(extra_num > 0 && strcasecmp(RedisModule_StringPtrLen(extra[0], NULL), "window") != 0){
+        option = extra[0];
+        extra++;
+        extra_num--;
+    }
+    if(extra_num > 0 && mabType_ParseWindow(ctx, extra, extra_num, &span, &buckets,
+                &window_policy) != 0){
+        return REDISMODULE_OK;
+    }
+
     RedisModuleKey  *key = RedisModule_OpenKey(ctx, argv[1], 
         REDISMODULE_READ|REDISMODULE_WRITE);
 
@@ -154,13 +752,24 @@ mabTypeSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString *argv[], int argc
     }
 
     mab_type_obj_t    *mabobj = mab_type_obj_new(argv[2], argv + 4, (int)choice_num,
-            (choice_num == argc - 5) ? argv[argc - 1]: NULL);
+            option);
     if(mabobj == NULL){
         RedisModule_DeleteKey(key);
         return RedisModule_ReplyWithError(ctx, "ERR mab obj create failed");
     }
 
+    if(span > 0 && multi_arm_set_window(mabobj->ma, span, buckets, window_policy) != 0){
+        mab_type_obj_free(mabobj);
+        RedisModule_DeleteKey(key);
+        return RedisModule_ReplyWithError(ctx, "ERR mab obj create failed");
+    }
+
+    if(template){
+        mab_type_obj_share(mabobj);
+    }
+
     RedisModule_ModuleTypeSetValue(key, mabType, mabobj);
+    mab_cold_touch(mabobj);
     RedisModule_ReplyWithLongLong(ctx, choice_num);
 
     RedisModule_ReplicateVerbatim(ctx);
@@ -168,67 +777,153 @@ mabTypeSet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString *argv[], int argc
 }
 
 
-/* 
+/*
  * command:
- * mab.choice $key
  *
- * 
+ * mab.msetfrom $template $key1 $key2 ...
+ *
+ * create every key as a copy of the bandit $template: same policy, option,
+ * window and statistics. the copies share the choices of the template and
+ * skip parsing the policy, none is created if one of the keys exists.
+ *
  * return:
- * (idx, choice)
+ *
+ * number of keys created
  */
 static int
-mabTypeChoice_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
-        int argc)
+mabTypeMSetFrom_RedisCommand(RedisModuleCtx *ctx, RedisModuleString *argv[], int argc)
 {
-    RedisModule_AutoMemory(ctx);
-    if(argc != 2){
+    RedisModuleKey          *key;
+    mab_type_obj_t          *tmpl, *mabobj;
+    mab_shared_choices_t    *shared;
+    multi_arm_buf_t         b = {NULL, 0, 0};
+    long long               created = 0;
+    int                     i;
+
+    if(argc < 3){
         return RedisModule_WrongArity(ctx);
     }
 
-    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
-    if(key == NULL){
-        return REDISMODULE_OK;
-    }
+    //bulk creation opens a key per argument, close them as we go
+    for(i = 2; i < argc; i++){
+        int     exist;
 
-    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+        key = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ);
+        exist = RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY;
+        RedisModule_CloseKey(key);
+        if(exist){
+            return RedisModule_ReplyWithError(ctx, "ERR key already exist");
+        }
+    }
 
-    int             idx;
-    sstr_t          *choice = multi_arm_choice(mabobj->ma, &idx);
+    if((key = mabType_OpenKey(ctx, argv[1])) == NULL){
+        return REDISMODULE_OK;
+    }
+    tmpl = RedisModule_ModuleTypeGetValue(key);
+    shared = mab_type_obj_share(tmpl);
+    multi_arm_dump(tmpl->ma, &b);
+    RedisModule_CloseKey(key);
+
+    for(i = 2; i < argc; i++){
+        multi_arm_reader_t  r = {b.data, b.data + b.len, 0};
+
+        key = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ|REDISMODULE_WRITE);
+        if(RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY){
+            //the same key given twice
+            RedisModule_CloseKey(key);
+            continue;
+        }
 
-    RedisModule_ReplyWithArray(ctx, 2);
-    RedisModule_ReplyWithLongLong(ctx, idx);
-    RedisModule_ReplyWithStringBuffer(ctx, (char *)choice->data, choice->len);
+        mabobj = mab_type_obj_raw(NULL, 0);
+        mabobj->ma = multi_arm_restore(&r);
+        if(mabobj->ma == NULL){
+            RedisModule_CloseKey(key);
+            RedisModule_Free(mabobj);
+            multi_arm_buf_free(&b);
+            return RedisModule_ReplyWithError(ctx, "ERR mab obj create failed");
+        }
+        multi_arm_set_choices(mabobj->ma, (void **)shared->choices);
+        mabobj->choices = shared->choices;
+        mabobj->choice_num = shared->choice_num;
+        mabobj->shared = shared;
+        __atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+
+        RedisModule_ModuleTypeSetValue(key, mabType, mabobj);
+        RedisModule_CloseKey(key);
+        mab_cold_touch(mabobj);
+        created++;
+    }
+    multi_arm_buf_free(&b);
 
+    RedisModule_ReplyWithLongLong(ctx, created);
+    RedisModule_ReplicateVerbatim(ctx);
     return REDISMODULE_OK;
 }
 
+
 /* 
- * command
- * mab.reward $key $idx $reward
+ * command:
+ * mab.choice $key [MAXSTALE $seconds] [IDXONLY] [TICKET] [INCLUDE|EXCLUDE $idx1 $idx2 ... | INCLUDEMASK|EXCLUDEMASK $bitmap]
  *
- * return 0
+ * INCLUDE/EXCLUDE restrict the choice to (or skip) the listed arms, the
+ * *MASK variants take a bitmap in redis SETBIT order instead. only one
+ * of them can be given. a replica refuses the choice if it did not hear
+ * from its master for more than MAXSTALE seconds, a master ignores it.
+ * TICKET also returns a ticket to reward the choice later with
+ * mab.rewardticket, masters only.
  *
+ * choice, reward and step are the hot path, they run without AutoMemory
+ * and close their key themselves.
+ * 
+ * return:
+ * (idx, choice), or idx alone with IDXONLY. the ticket is appended with TICKET
  */
 static int
-mabTypeReward_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+mabTypeChoice_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
         int argc)
 {
-    RedisModule_AutoMemory(ctx);
-
-    if(argc != 4){
+    if(argc < 2){
         return RedisModule_WrongArity(ctx);
     }
 
-    long long idx;
-    if(RedisModule_StringToLongLong(argv[2], &idx) == REDISMODULE_ERR){
-        return RedisModule_ReplyWithError(ctx,
-                "ERR invalid idx value must be a integer");
+    int             opt = 2, idxonly = 0, ticket = 0;
+
+    while(opt < argc){
+        const char  *name = RedisModule_StringPtrLen(argv[opt], NULL);
+
+        if(strcasecmp(name, "idxonly") == 0){
+            idxonly = 1;
+            opt++;
+        }else if(strcasecmp(name, "ticket") == 0){
+            if(mabTickets.max == 0){
+                return RedisModule_ReplyWithError(ctx, "ERR tickets are disabled");
+            }
+            if(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE){
+                return RedisModule_ReplyWithError(ctx, "ERR tickets are issued by the master");
+            }
+            ticket = 1;
+            opt++;
+        }else if(strcasecmp(name, "maxstale") == 0){
+            long long   maxstale, lag;
+
+            if(opt + 1 == argc){
+                return RedisModule_WrongArity(ctx);
+            }
+            if(RedisModule_StringToLongLong(argv[opt + 1], &maxstale) != REDISMODULE_OK ||
+                    maxstale < 0){
+                return RedisModule_ReplyWithError(ctx, "ERR invalid maxstale value");
+            }
+            lag = mabType_ReplicaLag(ctx);
+            if(lag < 0 || lag > maxstale){
+                return RedisModule_ReplyWithError(ctx, "ERR replica is stale");
+            }
+            opt += 2;
+        }else{
+            break;
+        }
     }
-
-    double reward;
-    if(RedisModule_StringToDouble(argv[3], &reward) == REDISMODULE_ERR){
-        return RedisModule_ReplyWithError(ctx,
-                "ERR invalid reward value must be double");
+    if(argc == opt + 1){
+        return RedisModule_WrongArity(ctx);
     }
 
     RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
@@ -238,20 +933,368 @@ mabTypeReward_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
 
     mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
 
-    if(multi_arm_reward(mabobj->ma, (int)idx, reward) != 0){
-        return RedisModule_ReplyWithError(ctx,
-                "ERR invalid argument for reward operate");
+    mab_hot_hit(argv[1]);
+
+    int             idx;
+    sstr_t          *choice;
+    uint64_t        word, *mask = NULL;
+
+    if(argc == opt){
+        choice = multi_arm_choice(mabobj->ma, &idx);
+    }else{
+        /* only htree bandits outgrow one word */
+        mask = &word;
+        if(mabobj->choice_num > 64){
+            mask = RedisModule_PoolAlloc(ctx,
+                    sizeof(uint64_t) * MULTI_ARM_MASK_WORDS(mabobj->choice_num));
+        }
+
+        if(mabType_ParseMask(ctx, argv + opt, argc - opt, mabobj->choice_num, mask) != 0){
+            RedisModule_CloseKey(key);
+            return REDISMODULE_OK;
+        }
+
+        choice = multi_arm_choice_masked(mabobj->ma, mask, &idx);
+        if(choice == NULL){
+            RedisModule_CloseKey(key);
+            return RedisModule_ReplyWithError(ctx, "ERR no eligible arm");
+        }
     }
+    mab_event_choice(argv[1], mabobj, mask, idx);
 
-    RedisModule_ReplyWithLongLong(ctx, 0);
-    RedisModule_ReplicateVerbatim(ctx);
+    if(ticket){
+        RedisModule_ReplyWithArray(ctx, idxonly ? 2 : 3);
+        RedisModule_ReplyWithLongLong(ctx, idx);
+        if(!idxonly){
+            RedisModule_ReplyWithStringBuffer(ctx, (char *)choice->data, choice->len);
+        }
+        RedisModule_ReplyWithLongLong(ctx, mab_ticket_issue(ctx, argv[1], mabobj, idx));
+    }else if(idxonly){
+        RedisModule_ReplyWithLongLong(ctx, idx);
+    }else{
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithLongLong(ctx, idx);
+        RedisModule_ReplyWithStringBuffer(ctx, (char *)choice->data, choice->len);
+    }
+
+    RedisModule_CloseKey(key);
     return REDISMODULE_OK;
 }
 
-
 /*
- * reconfig specific bandit arm count reward value. used by redis aof
- *
+ * command:
+ * mab.mchoice $key1 [$key2 ...]
+ *
+ * mab.choice of several bandits in one round trip, e.g. the slots of a
+ * page. a key which is missing or not a bandit gets its error in place
+ * and does not fail the others.
+ *
+ * return:
+ * one (idx, choice) or error per key, in the order of the keys
+ */
+static int
+mabTypeMChoice_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+        int argc)
+{
+    RedisModuleKey  *key;
+    mab_type_obj_t  *mabobj;
+    sstr_t          *choice;
+    int             i, idx;
+
+    if(argc < 2){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModule_ReplyWithArray(ctx, argc - 1);
+    for(i = 1; i < argc; i++){
+        //replies the error of the key itself
+        if((key = mabType_OpenKey(ctx, argv[i])) == NULL){
+            continue;
+        }
+        mabobj = RedisModule_ModuleTypeGetValue(key);
+
+        mab_hot_hit(argv[i]);
+        choice = multi_arm_choice(mabobj->ma, &idx);
+        mab_event_choice(argv[i], mabobj, NULL, idx);
+
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithLongLong(ctx, idx);
+        RedisModule_ReplyWithStringBuffer(ctx, (char *)choice->data, choice->len);
+        RedisModule_CloseKey(key);
+    }
+    return REDISMODULE_OK;
+}
+
+/* 
+ * command
+ * mab.reward $key $idx $reward
+ *
+ * return 0
+ *
+ */
+static int
+mabTypeReward_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+        int argc)
+{
+    if(argc != 4){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    long long idx;
+    if(mabType_StringToIdx(argv[2], &idx) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid idx value must be a integer");
+    }
+
+    double reward;
+    if(mabType_StringToReward(argv[3], &reward) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid reward value must be double");
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+
+    mab_hot_hit(argv[1]);
+    if(multi_arm_reward(mabobj->ma, (int)idx, reward) != 0){
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid argument for reward operate");
+    }
+    mab_type_obj_modified(mabobj);
+    RedisModule_CloseKey(key);
+    mab_event_reward(ctx, argv[1], (int)idx, 1, reward);
+
+    RedisModule_ReplyWithLongLong(ctx, 0);
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+
+/*
+ * command
+ * mab.rewardagg $key $idx $trials $reward_sum [$successes]
+ *
+ * $trials rewards of arm $idx summing to $reward_sum, $successes of them
+ * non zero ($reward_sum rounded by default, exact for 0/1 rewards)
+ *
+ * return 0
+ */
+static int
+mabTypeRewardAgg_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 5 && argc != 6){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    long long   idx, trials, successes;
+    double      reward;
+
+    if(RedisModule_StringToLongLong(argv[2], &idx) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid idx value must be a integer");
+    }
+    if(RedisModule_StringToLongLong(argv[3], &trials) == REDISMODULE_ERR || trials <= 0){
+        return RedisModule_ReplyWithError(ctx, "ERR invalid trials value");
+    }
+    if(RedisModule_StringToDouble(argv[4], &reward) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid reward value must be double");
+    }
+    if(argc == 6){
+        if(RedisModule_StringToLongLong(argv[5], &successes) == REDISMODULE_ERR ||
+                successes < 0){
+            return RedisModule_ReplyWithError(ctx, "ERR invalid successes value");
+        }
+    }else{
+        successes = (long long)(reward + 0.5);
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+
+    mab_hot_hit(argv[1]);
+    if(multi_arm_reward_agg(mabobj->ma, (int)idx, (uint64_t)trials, reward,
+                (uint64_t)successes) != 0){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid argument for reward operate");
+    }
+    mab_type_obj_modified(mabobj);
+    mab_event_reward(ctx, argv[1], (int)idx, (uint64_t)trials, reward);
+
+    RedisModule_ReplyWithLongLong(ctx, 0);
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+
+/*
+ * command
+ * mab.rewardticket $key $ticket $reward
+ *
+ * reward the choice of $key which returned $ticket. the reward is
+ * replicated as mab.reward of $key
+ *
+ * return 0
+ */
+static int
+mabTypeRewardTicket_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 4){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    long long   ticket;
+    double      reward;
+
+    if(RedisModule_StringToLongLong(argv[2], &ticket) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx, "ERR invalid ticket");
+    }
+    if(mabType_StringToReward(argv[3], &reward) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid reward value must be double");
+    }
+
+    switch(mab_ticket_resolve(ctx, argv[1], ticket, reward, argv[3])){
+        case 0:
+            break;
+        case 1:
+            return RedisModule_ReplyWithError(ctx, "ERR unknown or expired ticket");
+        case 2:
+            return RedisModule_ReplyWithError(ctx, "ERR ticket of another key");
+        default:
+            return RedisModule_ReplyWithError(ctx,
+                    "ERR invalid argument for reward operate");
+    }
+
+    return RedisModule_ReplyWithLongLong(ctx, 0);
+}
+
+
+/*
+ * reward the previous choice and choose the next one in one round trip.
+ * only the reward is replicated, as mab.reward
+ *
+ * command:
+ * mab.step $key $prev_idx $reward [IDXONLY]
+ *
+ * return:
+ * (idx, choice), or idx alone with IDXONLY
+ */
+static int
+mabTypeStep_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if(argc != 4 && argc != 5){
+        return RedisModule_WrongArity(ctx);
+    }
+    if(argc == 5 && strcasecmp(RedisModule_StringPtrLen(argv[4], NULL), "idxonly") != 0){
+        return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+    }
+
+    long long idx;
+    if(mabType_StringToIdx(argv[2], &idx) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid idx value must be a integer");
+    }
+
+    double reward;
+    if(mabType_StringToReward(argv[3], &reward) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid reward value must be double");
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+
+    mab_hot_hit(argv[1]);
+    if(multi_arm_reward(mabobj->ma, (int)idx, reward) != 0){
+        RedisModule_CloseKey(key);
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid argument for reward operate");
+    }
+    mab_type_obj_modified(mabobj);
+    RedisModule_Replicate(ctx, "mab.reward", "sss", argv[1], argv[2], argv[3]);
+    mab_event_reward(ctx, argv[1], (int)idx, 1, reward);
+
+    int             next;
+    sstr_t          *choice = multi_arm_choice(mabobj->ma, &next);
+
+    mab_event_choice(argv[1], mabobj, NULL, next);
+
+    if(argc == 5){
+        RedisModule_ReplyWithLongLong(ctx, next);
+    }else{
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithLongLong(ctx, next);
+        RedisModule_ReplyWithStringBuffer(ctx, (char *)choice->data, choice->len);
+    }
+
+    RedisModule_CloseKey(key);
+    return REDISMODULE_OK;
+}
+
+
+/*
+ * command:
+ * mab.autofreeze $key $explore|OFF
+ *
+ * once the best arm is separated from the others choose it directly, only a
+ * share $explore of the choices still runs the policy. OFF turns it off
+ *
+ * return:
+ * 1 if the bandit is frozen now, 0 otherwise
+ */
+static int
+mabTypeAutoFreeze_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 3){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    double  explore = -1.0;
+    if(strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "off") != 0 &&
+            (RedisModule_StringToDouble(argv[2], &explore) != REDISMODULE_OK ||
+             explore < 0.0 || explore > 1.0)){
+        return RedisModule_ReplyWithError(ctx, "ERR invalid explore value");
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+
+    multi_arm_set_freeze(mabobj->ma, explore);
+    mab_type_obj_modified(mabobj);
+
+    RedisModule_ReplyWithLongLong(ctx, multi_arm_frozen(mabobj->ma));
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+
+/*
+ * reconfig specific bandit arm count reward value. used by redis aof
+ *
  * command:
  * mab.config $key $arm_idx1 $count1 $reward1 ....
  *
@@ -263,200 +1306,2288 @@ mabTypeConfig_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int ar
 {
     RedisModule_AutoMemory(ctx);
 
-    if(argc < 5 || (argc - 2) % 3 != 0){
-        return RedisModule_WrongArity(ctx);
+    if(argc < 5 || (argc - 2) % 3 != 0){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+    size_t          arm_len = mabobj->choice_num;
+
+    long long       tmp1;
+    double          tmp2;
+    int             i;
+
+    //check input args
+    for(i = 2; i < argc;){
+        //for $arm_idx
+        if(RedisModule_StringToLongLong(argv[i++], &tmp1) != REDISMODULE_OK){
+            return RedisModule_ReplyWithError(ctx, "ERR expect a integer for arm idx");
+        }
+        if(tmp1 < 0 || tmp1 >= (long long)arm_len){
+            return RedisModule_ReplyWithError(ctx, "ERR invalid idx value");
+        }
+
+        //for $count
+        if(RedisModule_StringToLongLong(argv[i++], &tmp1) != REDISMODULE_OK){
+            return RedisModule_ReplyWithError(ctx, "ERR expect a integer for count");
+        }
+        if(tmp1 < 0){
+            return RedisModule_ReplyWithError(ctx, "ERR invalid count value");
+        }
+
+        //for reward
+        if(RedisModule_StringToDouble(argv[i++], &tmp2) != REDISMODULE_OK){
+            return RedisModule_ReplyWithError(ctx, "ERR expect a double for reward");
+        }
+        if(tmp2 < 0){
+            return RedisModule_ReplyWithError(ctx, "ERR invalid reward value");
+        }
+
+        //ensure average reward less than 1.0
+        if((tmp1 == 0 && tmp2 > 1.0) || (tmp2 / tmp1 > 1.0)){
+            return RedisModule_ReplyWithError(ctx, "ERR invalid reward/count value");
+        }
+    }
+
+
+    long long   idx;
+    for(i = 2; i < argc;){
+        //for $arm_idx
+        RedisModule_StringToLongLong(argv[i++], &idx);
+
+        RedisModule_StringToLongLong(argv[i++], &tmp1);
+
+        RedisModule_StringToDouble(argv[i++], &tmp2);
+        multi_arm_set_arm(mabobj->ma, (int)idx, (uint64_t)tmp1, tmp2);
+    }
+    mab_type_obj_modified(mabobj);
+
+    RedisModule_ReplyWithLongLong(ctx, 0);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+
+/*
+ * command:
+ * mab.statjson $key
+ *
+ * return:
+ * a json string
+ */
+static int
+mabTypeStatJson_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 2){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleKey *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+    size_t          size = MABREDIS_STATBUF_SIZE +
+            MABREDIS_STATBUF_ARM_SIZE * (size_t)mabobj->ma->len;
+    char            *buf = RedisModule_Alloc(size);
+
+    //htree bandits hold up to 2^20 arms, grow until every arm fits
+    while(multi_arm_stat_json(mabobj->ma, buf, size) != 0){
+        size *= 2;
+        buf = RedisModule_Realloc(buf, size);
+    }
+
+    RedisModule_ReplyWithSimpleString(ctx, buf);
+    RedisModule_Free(buf);
+    return REDISMODULE_OK;
+}
+
+/*
+ * command:
+ * mab.addarm $key $choice1 [$choice2 ...]
+ *
+ * new arms are appended with empty statistics, existing arms keep theirs
+ *
+ * return:
+ * the number of arms
+ */
+static int
+mabTypeAddArm_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc < 3){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+    int             num = argc - 2, i;
+
+    if(mabobj->choice_num + num > mabType_MaxChoiceNum(mabobj->ma->policy.name)){
+        return RedisModule_ReplyWithError(ctx, "ERR choice_num too big");
+    }
+
+    sstr_t          **choices = RedisModule_StringToSStrs(argv + 2, num);
+
+    mab_type_obj_unshare(mabobj);
+    mabobj->choices = RedisModule_Realloc(mabobj->choices,
+            sizeof(sstr_t *) * (mabobj->choice_num + num));
+    multi_arm_set_choices(mabobj->ma, (void **)mabobj->choices);
+    for(i = 0; i < num; i++){
+        mabobj->choices[mabobj->choice_num++] = choices[i];
+        multi_arm_add_arm(mabobj->ma, choices[i]);
+    }
+    RedisModule_Free(choices);
+    mab_type_obj_modified(mabobj);
+
+    RedisModule_ReplyWithLongLong(ctx, mabobj->choice_num);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+/*
+ * command:
+ * mab.delarm $key $idx
+ *
+ * the arms after $idx shift down by one
+ *
+ * return:
+ * the number of arms
+ */
+static int
+mabTypeDelArm_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 3){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    long long idx;
+    if(RedisModule_StringToLongLong(argv[2], &idx) == REDISMODULE_ERR){
+        return RedisModule_ReplyWithError(ctx,
+                "ERR invalid idx value must be a integer");
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+
+    if(idx < 0 || idx >= mabobj->choice_num){
+        return RedisModule_ReplyWithError(ctx, "ERR invalid idx value");
+    }
+    mab_type_obj_unshare(mabobj);
+    if(multi_arm_del_arm(mabobj->ma, (int)idx) != 0){
+        return RedisModule_ReplyWithError(ctx, "ERR can not delete the last arm");
+    }
+
+    RedisModule_Free(mabobj->choices[idx]->data);
+    RedisModule_Free(mabobj->choices[idx]);
+    memmove(mabobj->choices + idx, mabobj->choices + idx + 1,
+            sizeof(sstr_t *) * (mabobj->choice_num - idx - 1));
+    mabobj->choice_num--;
+    mab_type_obj_modified(mabobj);
+
+    //the arms after idx move down, drop the pending tickets of the bandit
+    mabobj->ticket = 0;
+
+    RedisModule_ReplyWithLongLong(ctx, mabobj->choice_num);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+/*
+ * command:
+ * mab.restore $key $serialized
+ *
+ * create a bandit from its serialized form (the rdb payload of the type),
+ * the keys created by mab.import are replicated through it and the aof
+ * rewrite emits it
+ *
+ * return:
+ * the number of arms
+ */
+static int
+mabTypeRestore_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 3){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    RedisModuleKey  *key = RedisModule_OpenKey(ctx, argv[1],
+            REDISMODULE_READ|REDISMODULE_WRITE);
+
+    if(RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY){
+        return RedisModule_ReplyWithError(ctx, "ERR key already exist");
+    }
+
+    size_t          len;
+    const char      *p = RedisModule_StringPtrLen(argv[2], &len);
+    uint8_t         *blob = RedisModule_Alloc(len ? len : 1);
+    mab_type_obj_t  *mabobj;
+
+    memcpy(blob, p, len);
+    mabobj = mab_type_obj_raw(blob, len);
+    if(mab_type_obj_materialize(mabobj) != 0){
+        mab_type_obj_free(mabobj);
+        return RedisModule_ReplyWithError(ctx, "ERR corrupt mab object");
+    }
+
+    RedisModule_ModuleTypeSetValue(key, mabType, mabobj);
+    mab_cold_touch(mabobj);
+    RedisModule_ReplyWithLongLong(ctx, mabobj->choice_num);
+
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+/*
+ * command:
+ * mab.snapshot $key [IF-VERSION $version]
+ *
+ * the serialized form of the bandit (as taken by mab.restore) for clients
+ * which sample locally. every change gives the bandit a larger version
+ *
+ * return:
+ * (version, serialized), nil if the bandit is still at IF-VERSION
+ */
+static int
+mabTypeSnapshot_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 2 && argc != 4){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    long long   version = -1;
+    if(argc == 4){
+        if(strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "if-version") != 0){
+            return RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        }
+        if(RedisModule_StringToLongLong(argv[3], &version) != REDISMODULE_OK){
+            return RedisModule_ReplyWithError(ctx, "ERR invalid version value");
+        }
+    }
+
+    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
+    if(key == NULL){
+        return REDISMODULE_OK;
+    }
+
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
+    multi_arm_buf_t b = {NULL, 0, 0};
+
+    if((uint64_t)version == mabobj->version){
+        return RedisModule_ReplyWithNull(ctx);
+    }
+
+    mab_type_obj_dump(mabobj, &b);
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithLongLong(ctx, (long long)mabobj->version);
+    RedisModule_ReplyWithStringBuffer(ctx, (char *)b.data, b.len);
+    multi_arm_buf_free(&b);
+
+    return REDISMODULE_OK;
+}
+
+/*
+ * compute the column offsets and the size of an export file
+ */
+static void
+mab_export_layout(mab_export_header_t *hdr, uint64_t bandits, uint64_t arms, uint64_t heap)
+{
+    uint64_t    off = sizeof(*hdr);
+
+    hdr->bandits = bandits;
+    hdr->arms = arms;
+
+    hdr->columns[MAB_EXPORT_KEY] = off;
+    off += bandits * sizeof(mab_export_ref_t);
+    hdr->columns[MAB_EXPORT_POLICY] = off;
+    off += bandits * sizeof(mab_export_ref_t);
+    hdr->columns[MAB_EXPORT_TOTAL] = off;
+    off += bandits * sizeof(uint64_t);
+    hdr->columns[MAB_EXPORT_ARMS] = off;
+    off += (bandits + 1) * sizeof(uint64_t);
+    hdr->columns[MAB_EXPORT_STATE] = off;
+    off += bandits * sizeof(mab_export_ref_t);
+    hdr->columns[MAB_EXPORT_COUNT] = off;
+    off += arms * sizeof(uint64_t);
+    hdr->columns[MAB_EXPORT_REWARD] = off;
+    off += arms * sizeof(double);
+    hdr->columns[MAB_EXPORT_CHOICE] = off;
+    off += arms * sizeof(mab_export_ref_t);
+    hdr->columns[MAB_EXPORT_HEAP] = off;
+
+    hdr->size = off + heap;
+}
+
+/* copy the serialized form of a bandit into the job, runs with the GIL held */
+static void
+mab_export_add(mab_export_job_t *job, RedisModuleString *name, mab_type_obj_t *mabobj)
+{
+    mab_export_entry_t  *e;
+    size_t              len;
+    const char          *p = RedisModule_StringPtrLen(name, &len);
+
+    if(job->len == job->cap){
+        job->cap = job->cap ? job->cap * 2 : 64;
+        job->entries = RedisModule_Realloc(job->entries, sizeof(*e) * job->cap);
+    }
+    e = job->entries + job->len++;
+
+    e->key = RedisModule_Alloc(len ? len : 1);
+    e->keylen = len;
+    memcpy(e->key, p, len);
+
+    if(mabobj->blob && mabobj->shared == NULL){
+        e->blob = RedisModule_Alloc(mabobj->bloblen);
+        e->bloblen = mabobj->bloblen;
+        memcpy(e->blob, mabobj->blob, mabobj->bloblen);
+    }else{
+        multi_arm_buf_t b = {NULL, 0, 0};
+
+        mab_type_obj_dump(mabobj, &b);
+        e->blob = b.data;
+        e->bloblen = b.len;
+    }
+}
+
+/*
+ * copy out every bandit of the db of the client. the GIL is held for one
+ * SCAN batch at a time, the server keeps serving in between
+ */
+static int
+mab_export_collect(RedisModuleCtx *ctx, mab_export_job_t *job)
+{
+    char                    cursor[32] = "0";
+    RedisModuleCallReply    *reply, *keys;
+    RedisModuleString       *name;
+    RedisModuleKey          *key;
+    const char              *p;
+    size_t                  len, i;
+
+    do{
+        RedisModule_ThreadSafeContextLock(ctx);
+        reply = RedisModule_Call(ctx, "SCAN", "ccl", cursor, "COUNT",
+                (long long)MABREDIS_EXPORT_SCAN_COUNT);
+        if(reply == NULL || RedisModule_CallReplyType(reply) != REDISMODULE_REPLY_ARRAY ||
+                RedisModule_CallReplyLength(reply) != 2){
+            if(reply){
+                RedisModule_FreeCallReply(reply);
+            }
+            RedisModule_ThreadSafeContextUnlock(ctx);
+            job->err = "ERR scan keyspace failed";
+            return 1;
+        }
+
+        p = RedisModule_CallReplyStringPtr(RedisModule_CallReplyArrayElement(reply, 0), &len);
+        len = len < sizeof(cursor) - 1 ? len : sizeof(cursor) - 1;
+        memcpy(cursor, p, len);
+        cursor[len] = '\0';
+
+        keys = RedisModule_CallReplyArrayElement(reply, 1);
+        for(i = 0; i < RedisModule_CallReplyLength(keys); i++){
+            name = RedisModule_CreateStringFromCallReply(RedisModule_CallReplyArrayElement(keys, i));
+            key = RedisModule_OpenKey(ctx, name, REDISMODULE_READ);
+            if(key && RedisModule_ModuleTypeGetType(key) == mabType){
+                mab_export_add(job, name, RedisModule_ModuleTypeGetValue(key));
+            }
+            RedisModule_CloseKey(key);
+            RedisModule_FreeString(ctx, name);
+        }
+
+        RedisModule_FreeCallReply(reply);
+        RedisModule_ThreadSafeContextUnlock(ctx);
+    }while(strcmp(cursor, "0") != 0);
+
+    return 0;
+}
+
+/* free what mab_type_obj_parse built */
+static void
+mab_export_release(sstr_t **strs, int n, multi_arm_t *ma)
+{
+    int     i;
+
+    for(i = 0; i < n; i++){
+        RedisModule_Free(strs[i]->data);
+        RedisModule_Free(strs[i]);
+    }
+    RedisModule_Free(strs);
+    multi_arm_free(ma);
+}
+
+/* append p to the heap of the mapped file, ref points at it */
+static void
+mab_export_heap(uint8_t *map, mab_export_header_t *hdr, uint64_t *heap, const void *p,
+        size_t len, mab_export_ref_t *ref)
+{
+    ref->off = *heap;
+    ref->len = len;
+    memcpy(map + hdr->columns[MAB_EXPORT_HEAP] + *heap, p, len);
+    *heap += len;
+}
+
+/*
+ * lay the copied bandits out in columns. the file is sized by a first
+ * pass, filled through a shared mapping then renamed over path
+ */
+static int
+mab_export_write(mab_export_job_t *job)
+{
+    mab_export_header_t hdr;
+    mab_export_ref_t    *keys, *policies, *states, *choices;
+    uint64_t            *totals, *starts, *counts, bandits = 0, arms = 0, heap = 0;
+    double              *rewards;
+    uint8_t             *map;
+    sstr_t              **strs;
+    multi_arm_t         *ma;
+    char                tmp[PATH_MAX];
+    size_t              i;
+    int                 fd, n, j, synced;
+
+    //first pass, the size of every column
+    for(i = 0; i < job->len; i++){
+        mab_export_entry_t  *e = job->entries + i;
+
+        n = mab_type_obj_parse(e->blob, e->bloblen, &strs, &ma);
+        if(n == 0){
+            //corrupt, skipped
+            e->arms = -1;
+            continue;
+        }
+
+        e->arms = n;
+        bandits++;
+        arms += n;
+        heap += e->keylen + strlen(ma->policy.name) + e->bloblen;
+        for(j = 0; j < n; j++){
+            heap += strs[j]->len;
+        }
+        mab_export_release(strs, n, ma);
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MABREDIS_EXPORT_MAGIC, sizeof(hdr.magic));
+    hdr.byteorder = MABREDIS_EXPORT_BYTEORDER;
+    mab_export_layout(&hdr, bandits, arms, heap);
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", job->path) >= (int)sizeof(tmp)){
+        job->err = "ERR export path too long";
+        return 1;
+    }
+    fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    if(fd < 0){
+        job->err = "ERR can not open export file";
+        return 1;
+    }
+    if(ftruncate(fd, hdr.size) != 0 ||
+            (map = mmap(NULL, hdr.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        close(fd);
+        unlink(tmp);
+        job->err = "ERR can not write export file";
+        return 1;
+    }
+
+    memcpy(map, &hdr, sizeof(hdr));
+    keys = (mab_export_ref_t *)(map + hdr.columns[MAB_EXPORT_KEY]);
+    policies = (mab_export_ref_t *)(map + hdr.columns[MAB_EXPORT_POLICY]);
+    totals = (uint64_t *)(map + hdr.columns[MAB_EXPORT_TOTAL]);
+    starts = (uint64_t *)(map + hdr.columns[MAB_EXPORT_ARMS]);
+    states = (mab_export_ref_t *)(map + hdr.columns[MAB_EXPORT_STATE]);
+    counts = (uint64_t *)(map + hdr.columns[MAB_EXPORT_COUNT]);
+    rewards = (double *)(map + hdr.columns[MAB_EXPORT_REWARD]);
+    choices = (mab_export_ref_t *)(map + hdr.columns[MAB_EXPORT_CHOICE]);
+
+    bandits = arms = heap = 0;
+    for(i = 0; i < job->len; i++){
+        mab_export_entry_t  *e = job->entries + i;
+
+        if(e->arms < 0 || mab_type_obj_parse(e->blob, e->bloblen, &strs, &ma) == 0){
+            continue;
+        }
+
+        mab_export_heap(map, &hdr, &heap, e->key, e->keylen, keys + bandits);
+        mab_export_heap(map, &hdr, &heap, ma->policy.name, strlen(ma->policy.name),
+                policies + bandits);
+        mab_export_heap(map, &hdr, &heap, e->blob, e->bloblen, states + bandits);
+        totals[bandits] = ma->total_count;
+        starts[bandits] = arms;
+
+        for(j = 0; j < e->arms; j++){
+            multi_arm_get_arm(ma, j, counts + arms, rewards + arms);
+            mab_export_heap(map, &hdr, &heap, strs[j]->data, strs[j]->len, choices + arms);
+            arms++;
+        }
+        bandits++;
+        mab_export_release(strs, e->arms, ma);
+    }
+    starts[bandits] = arms;
+
+    synced = msync(map, hdr.size, MS_SYNC) == 0;
+    munmap(map, hdr.size);
+    if(close(fd) != 0 || !synced || rename(tmp, job->path) != 0){
+        unlink(tmp);
+        job->err = "ERR can not write export file";
+        return 1;
+    }
+
+    job->exported = (long long)bandits;
+    return 0;
+}
+
+static void *
+mab_export_thread(void *arg)
+{
+    mab_export_job_t    *job = arg;
+    RedisModuleCtx      *ctx = RedisModule_GetThreadSafeContext(job->bc);
+    size_t              i;
+
+    if(mab_export_collect(ctx, job) == 0){
+        mab_export_write(job);
+    }
+
+    for(i = 0; i < job->len; i++){
+        RedisModule_Free(job->entries[i].key);
+        RedisModule_Free(job->entries[i].blob);
+    }
+    RedisModule_Free(job->entries);
+    job->entries = NULL;
+    job->len = job->cap = 0;
+
+    RedisModule_FreeThreadSafeContext(ctx);
+    RedisModule_UnblockClient(job->bc, job);
+    return NULL;
+}
+
+static int
+mab_export_reply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    mab_export_job_t    *job = RedisModule_GetBlockedClientPrivateData(ctx);
+
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    if(job->err){
+        return RedisModule_ReplyWithError(ctx, job->err);
+    }
+    return RedisModule_ReplyWithLongLong(ctx, job->exported);
+}
+
+/*
+ * redis 5 and later call free_privdata with the context first, the
+ * redismodule.h in this tree predates that argument
+ */
+static void
+mab_export_free(RedisModuleCtx *ctx, void *privdata)
+{
+    mab_export_job_t    *job = privdata;
+
+    REDISMODULE_NOT_USED(ctx);
+    RedisModule_Free(job->path);
+    RedisModule_Free(job);
+}
+
+/*
+ * command:
+ * mab.hotkeys [$count]
+ * mab.hotkeys RESET
+ *
+ * the keys hit most by choice, reward, step and rewardagg on this server,
+ * their counts halve every HOTKEYS-HALFLIFE seconds
+ *
+ * return:
+ * key1 count1 key2 count2 ..., hottest first. OK for RESET
+ */
+static int
+mabTypeHotKeys_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    if(argc > 2){
+        return RedisModule_WrongArity(ctx);
+    }
+    if(mabHot.topk == 0){
+        return RedisModule_ReplyWithError(ctx, "ERR hot key tracking is disabled");
+    }
+
+    long long   count = mabHot.topk;
+
+    if(argc == 2){
+        if(strcasecmp(RedisModule_StringPtrLen(argv[1], NULL), "reset") == 0){
+            mab_hot_reset();
+            return RedisModule_ReplyWithSimpleString(ctx, "OK");
+        }
+        if(RedisModule_StringToLongLong(argv[1], &count) != REDISMODULE_OK || count < 0){
+            return RedisModule_ReplyWithError(ctx, "ERR invalid count value");
+        }
+    }
+
+    //pop a copy of the heap, the decay is applied first so idle keys age too
+    mab_hot_key_t   *keys = RedisModule_PoolAlloc(ctx, sizeof(mab_hot_key_t) * (mabHot.len + 1));
+    int             len = mabHot.len, n = 0, i;
+
+    mab_hot_decay(RedisModule_Milliseconds());
+    memcpy(keys, mabHot.heap, sizeof(mab_hot_key_t) * len);
+    count = count < len ? count : len;
+
+    RedisModule_ReplyWithArray(ctx, count * 2);
+    while(n < count){
+        int     best = 0;
+
+        for(i = 1; i < len; i++){
+            if(keys[i].count > keys[best].count){
+                best = i;
+            }
+        }
+        RedisModule_ReplyWithStringBuffer(ctx, keys[best].name, keys[best].len);
+        RedisModule_ReplyWithLongLong(ctx, keys[best].count);
+        keys[best] = keys[--len];
+        n++;
+    }
+    return REDISMODULE_OK;
+}
+
+
+/*
+ * command:
+ * mab.export $path
+ *
+ * write every bandit of the db to $path in a columnar file (see
+ * mab_export_header_t). the bandits are copied out one SCAN batch at a
+ * time and the file is written by a background thread, the client is
+ * blocked until it is done
+ *
+ * return:
+ * the number of exported bandits
+ */
+static int
+mabTypeExport_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 2){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    mab_export_job_t    *job = RedisModule_Calloc(1, sizeof(*job));
+    pthread_t           tid;
+
+    job->path = RedisModule_StringToCStr(argv[1]);
+    job->bc = RedisModule_BlockClient(ctx, mab_export_reply, NULL,
+            (void (*)(void *))(void (*)(void))mab_export_free, 0);
+    if(pthread_create(&tid, NULL, mab_export_thread, job) != 0){
+        RedisModule_AbortBlock(job->bc);
+        mab_export_free(NULL, job);
+        return RedisModule_ReplyWithError(ctx, "ERR can not start export thread");
+    }
+    pthread_detach(tid);
+    return REDISMODULE_OK;
+}
+
+/*
+ * map an export file and check its layout. return the header, NULL if the
+ * file is not an export
+ */
+static const mab_export_header_t *
+mab_import_map(const char *path, uint8_t **map, size_t *size)
+{
+    const mab_export_header_t   *hdr;
+    mab_export_header_t         want;
+    struct stat                 st;
+    int                         fd = open(path, O_RDONLY);
+
+    *map = NULL;
+    if(fd < 0){
+        return NULL;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*hdr)){
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(*map == MAP_FAILED){
+        *map = NULL;
+        return NULL;
+    }
+
+    hdr = (const mab_export_header_t *)*map;
+    if(memcmp(hdr->magic, MABREDIS_EXPORT_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->byteorder != MABREDIS_EXPORT_BYTEORDER || hdr->size != *size ||
+            hdr->bandits > *size / sizeof(uint64_t) || hdr->arms > *size / sizeof(uint64_t) ||
+            hdr->columns[MAB_EXPORT_HEAP] > *size){
+        return NULL;
+    }
+
+    mab_export_layout(&want, hdr->bandits, hdr->arms, *size - hdr->columns[MAB_EXPORT_HEAP]);
+    if(memcmp(want.columns, hdr->columns, sizeof(want.columns)) != 0 || want.size != *size){
+        return NULL;
+    }
+    return hdr;
+}
+
+/*
+ * command:
+ * mab.import $path
+ *
+ * create the bandits of an export file which do not exist yet. they keep
+ * their serialized form until their first access, as after an rdb load,
+ * and are replicated as mab.restore. corrupt bandits are skipped
+ *
+ * return:
+ * the number of imported bandits
+ */
+static int
+mabTypeImport_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+{
+    RedisModule_AutoMemory(ctx);
+
+    if(argc != 2){
+        return RedisModule_WrongArity(ctx);
+    }
+
+    const mab_export_header_t   *hdr;
+    const mab_export_ref_t      *keys, *states;
+    const uint8_t               *heap;
+    uint8_t                     *map, *blob;
+    uint64_t                    heaplen, i;
+    size_t                      size;
+    long long                   imported = 0, corrupt = 0;
+    RedisModuleString           *name;
+    RedisModuleKey              *key;
+    mab_type_obj_t              *mabobj;
+    sstr_t                      **choices;
+    multi_arm_t                 *ma;
+    int                         choice_num;
+
+    hdr = mab_import_map(RedisModule_StringPtrLen(argv[1], NULL), &map, &size);
+    if(hdr == NULL){
+        if(map){
+            munmap(map, size);
+        }
+        return RedisModule_ReplyWithError(ctx, "ERR invalid export file");
+    }
+
+    keys = (const mab_export_ref_t *)(map + hdr->columns[MAB_EXPORT_KEY]);
+    states = (const mab_export_ref_t *)(map + hdr->columns[MAB_EXPORT_STATE]);
+    heap = map + hdr->columns[MAB_EXPORT_HEAP];
+    heaplen = size - hdr->columns[MAB_EXPORT_HEAP];
+
+    for(i = 0; i < hdr->bandits; i++){
+        if(keys[i].off > heaplen || keys[i].len > heaplen - keys[i].off ||
+                states[i].off > heaplen || states[i].len > heaplen - states[i].off){
+            continue;
+        }
+
+        name = RedisModule_CreateString(ctx, (const char *)heap + keys[i].off, keys[i].len);
+        key = RedisModule_OpenKey(ctx, name, REDISMODULE_READ|REDISMODULE_WRITE);
+        if(RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY){
+            continue;
+        }
+
+        //parse it once, mab.restore refuses a corrupt one on the replicas
+        choice_num = mab_type_obj_parse(heap + states[i].off, states[i].len, &choices, &ma);
+        if(choice_num == 0){
+            corrupt++;
+            continue;
+        }
+        multi_arm_free(ma);
+        mab_sstrs_free(choices, choice_num);
+
+        blob = RedisModule_Alloc(states[i].len ? states[i].len : 1);
+        memcpy(blob, heap + states[i].off, states[i].len);
+        mabobj = mab_type_obj_raw(blob, states[i].len);
+        RedisModule_ModuleTypeSetValue(key, mabType, mabobj);
+        RedisModule_Replicate(ctx, "mab.restore", "sb", name, (const char *)blob,
+                (size_t)states[i].len);
+        imported++;
+    }
+
+    munmap(map, size);
+    if(corrupt > 0){
+        RedisModule_Log(ctx, "warning", "mab.import skipped %lld corrupt bandits", corrupt);
+    }
+    return RedisModule_ReplyWithLongLong(ctx, imported);
+}
+
+static RedisModuleKey *
+mabType_OpenKey(RedisModuleCtx *ctx, RedisModuleString *key)
+{
+    RedisModuleKey *ret = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
+    if(ret == NULL){
+        RedisModule_ReplyWithError(ctx, "ERR mab key not exist");
+        return NULL;
+    }
+
+    //the hot commands run without AutoMemory, do not leave the key open
+    if(RedisModule_ModuleTypeGetType(ret) != mabType){
+        RedisModule_CloseKey(ret);
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return NULL;
+    }
+
+    //loaded lazily from rdb or folded while cold, build it now
+    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(ret);
+    if(mab_type_obj_materialize(mabobj) != 0){
+        RedisModule_CloseKey(ret);
+        RedisModule_ReplyWithError(ctx, "ERR corrupt mab object");
+        return NULL;
+    }
+    mab_cold_touch(mabobj);
+    return ret;
+}
+
+/*
+ * build the eligibility mask of a choice from
+ * INCLUDE|EXCLUDE $idx1 $idx2 ... or INCLUDEMASK|EXCLUDEMASK $bitmap,
+ * the options do not combine
+ *
+ * reply an error and return -1 on invalid arguments
+ */
+static int
+mabType_ParseMask(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+        int arm_num, uint64_t *mask)
+{
+    const char  *opt = RedisModule_StringPtrLen(argv[0], NULL);
+    int         include, bitmap, i, words = MULTI_ARM_MASK_WORDS(arm_num);
+    long long   idx;
+
+    if(strcasecmp(opt, "include") == 0){
+        include = 1;
+        bitmap = 0;
+    }else if(strcasecmp(opt, "exclude") == 0){
+        include = 0;
+        bitmap = 0;
+    }else if(strcasecmp(opt, "includemask") == 0){
+        include = 1;
+        bitmap = 1;
+    }else if(strcasecmp(opt, "excludemask") == 0){
+        include = 0;
+        bitmap = 1;
+    }else{
+        RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        return -1;
+    }
+
+    memset(mask, 0, sizeof(uint64_t) * words);
+    if(bitmap){
+        size_t          len;
+        const uint8_t   *bits;
+
+        if(argc != 2){
+            RedisModule_WrongArity(ctx);
+            return -1;
+        }
+        bits = (const uint8_t *)RedisModule_StringPtrLen(argv[1], &len);
+        for(i = 0; i < arm_num && (size_t)(i >> 3) < len; i++){
+            if(bits[i >> 3] & (0x80 >> (i & 7))){
+                MULTI_ARM_MASK_SET(mask, i);
+            }
+        }
+    }else{
+        for(i = 1; i < argc; i++){
+            if(RedisModule_StringToLongLong(argv[i], &idx) != REDISMODULE_OK){
+                RedisModule_ReplyWithError(ctx, "ERR expect a integer for arm idx");
+                return -1;
+            }
+            if(idx < 0 || idx >= arm_num){
+                RedisModule_ReplyWithError(ctx, "ERR invalid idx value");
+                return -1;
+            }
+            MULTI_ARM_MASK_SET(mask, idx);
+        }
+    }
+
+    if(!include){
+        for(i = 0; i < words; i++){
+            mask[i] = ~mask[i];
+        }
+        if(arm_num & 63){
+            mask[words - 1] &= ((uint64_t)1 << (arm_num & 63)) - 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * parse WINDOW $bucket_ms $buckets [STATONLY], reply an error and return
+ * -1 on invalid input
+ */
+static int
+mabType_ParseWindow(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+        long long *span, long long *buckets, int *policy)
+{
+    if(argc != 3 && argc != 4){
+        RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        return -1;
+    }
+    if(strcasecmp(RedisModule_StringPtrLen(argv[0], NULL), "window") != 0){
+        RedisModule_ReplyWithError(ctx, "ERR syntax error");
+        return -1;
+    }
+
+    if(RedisModule_StringToLongLong(argv[1], span) != REDISMODULE_OK || *span <= 0){
+        RedisModule_ReplyWithError(ctx, "ERR invalid window bucket ms");
+        return -1;
+    }
+    if(RedisModule_StringToLongLong(argv[2], buckets) != REDISMODULE_OK ||
+            *buckets <= 0 || *buckets > MULTI_ARM_WINDOW_MAX_BUCKETS){
+        RedisModule_ReplyWithError(ctx, "ERR invalid window bucket number");
+        return -1;
+    }
+
+    *policy = 1;
+    if(argc == 4){
+        if(strcasecmp(RedisModule_StringPtrLen(argv[3], NULL), "statonly") != 0){
+            RedisModule_ReplyWithError(ctx, "ERR syntax error");
+            return -1;
+        }
+        *policy = 0;
+    }
+    return 0;
+}
+
+/*
+ * seconds since a replica last heard from its master, -1 if the link is
+ * down, 0 on a master. the master pings every repl-ping-replica-period
+ * seconds, an idle but healthy link reads up to that much
+ */
+static long long
+mabType_ReplicaLag(RedisModuleCtx *ctx)
+{
+    RedisModuleCallReply    *reply;
+    const char              *p, *end, *eol;
+    char                    line[128];
+    size_t                  len;
+    long long               now = RedisModule_Milliseconds(), io = -1;
+    int                     up = 0;
+
+    if(!(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE)){
+        return 0;
+    }
+    if(now < mabStale.expire){
+        return mabStale.lag;
+    }
+
+    reply = RedisModule_Call(ctx, "INFO", "c", "replication");
+    if(reply && RedisModule_CallReplyType(reply) == REDISMODULE_REPLY_STRING){
+        p = RedisModule_CallReplyStringPtr(reply, &len);
+        for(end = p + len; p < end; p = eol + 1){
+            eol = memchr(p, '\n', end - p);
+            eol = eol ? eol : end;
+            len = (size_t)(eol - p) < sizeof(line) - 1 ? (size_t)(eol - p) : sizeof(line) - 1;
+            memcpy(line, p, len);
+            line[len] = '\0';
+
+            if(strncmp(line, "master_link_status:up", 21) == 0){
+                up = 1;
+            }else{
+                sscanf(line, "master_last_io_seconds_ago:%lld", &io);
+            }
+        }
+    }
+    if(reply){
+        RedisModule_FreeCallReply(reply);
+    }
+
+    mabStale.lag = up && io >= 0 ? io : -1;
+    mabStale.expire = now + MABREDIS_STALE_INTERVAL;
+    return mabStale.lag;
+}
+
+/*
+ * parse an arm index. plain decimals are parsed in place, anything else
+ * goes through RedisModule_StringToLongLong
+ */
+static int
+mabType_StringToIdx(RedisModuleString *str, long long *idx)
+{
+    size_t      len, i;
+    const char  *p = RedisModule_StringPtrLen(str, &len);
+    long long   v = 0;
+
+    if(len == 0 || len > 9 || (p[0] == '0' && len > 1)){
+        return RedisModule_StringToLongLong(str, idx);
+    }
+    for(i = 0; i < len; i++){
+        if(p[i] < '0' || p[i] > '9'){
+            return RedisModule_StringToLongLong(str, idx);
+        }
+        v = v * 10 + (p[i] - '0');
+    }
+
+    *idx = v;
+    return REDISMODULE_OK;
+}
+
+/*
+ * parse a reward. "ddd.ddd" with at most 15 digits is an integer below 2^53
+ * divided by an exact power of ten, which rounds exactly like strtod. anything
+ * else goes through RedisModule_StringToDouble
+ */
+static int
+mabType_StringToReward(RedisModuleString *str, double *reward)
+{
+    static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+        1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+    size_t              len, i, digits = 0;
+    const char          *p = RedisModule_StringPtrLen(str, &len);
+    int64_t             m = 0;
+    int                 frac = -1;
+
+    for(i = 0; i < len; i++){
+        if(p[i] >= '0' && p[i] <= '9'){
+            m = m * 10 + (p[i] - '0');
+            digits++;
+            frac += frac >= 0;
+        }else if(p[i] == '.' && frac < 0){
+            frac = 0;
+        }else{
+            break;
+        }
+    }
+    if(i != len || digits == 0 || digits > 15){
+        return RedisModule_StringToDouble(str, reward);
+    }
+
+    *reward = frac > 0 ? (double)m / pow10[frac] : (double)m;
+    return REDISMODULE_OK;
+}
+
+/* the arm limit of a policy */
+static int
+mabType_MaxChoiceNum(const char *policy)
+{
+    if(strcasecmp(policy, "htree") == 0){
+        return MABREDIS_HTREE_MAXCHOICE_NUM;
+    }
+    return MABREDIS_MAXCHOICE_NUM;
+}
+
+static mab_type_obj_t *
+mab_type_obj_new(RedisModuleString *type, RedisModuleString **choice_strs, int choice_num,
+        RedisModuleString *option_str)
+{
+    mab_type_obj_t  *ret = RedisModule_Alloc(sizeof(*ret));
+
+    sstr_t          **choices = RedisModule_StringToSStrs(choice_strs, choice_num);
+    char            *option = NULL, *t = RedisModule_StringToCStr(type);
+
+    if(option_str != NULL){
+        option = RedisModule_StringToCStr(option_str);
+    }
+
+    ret->ma = multi_arm_new(t, (void **)choices, choice_num, option);
+    if(ret->ma == NULL){
+        int i;
+        for(i = 0; i < choice_num; i++){
+            RedisModule_Free(choices[i]->data);
+            RedisModule_Free(choices[i]);
+        }
+
+        RedisModule_Free(choices);
+        RedisModule_Free(ret);
+        ret = NULL;
+
+    }else{
+        ret->choice_num = choice_num;
+        ret->choices = choices;
+        ret->shared = NULL;
+        ret->blob = NULL;
+        ret->bloblen = 0;
+        ret->ticket = 0;
+        ret->prev = ret->next = NULL;
+        mab_type_obj_modified(ret);
+    }
+
+    if(option != NULL){
+        RedisModule_Free(option);
+    }
+    RedisModule_Free(t);
+
+    return ret;
+}
+
+/* an object holding only its serialized form, it takes over blob */
+static mab_type_obj_t *
+mab_type_obj_raw(uint8_t *blob, size_t bloblen)
+{
+    mab_type_obj_t  *mabobj = RedisModule_Alloc(sizeof(*mabobj));
+
+    mabobj->choices = NULL;
+    mabobj->choice_num = 0;
+    mabobj->shared = NULL;
+    mabobj->ma = NULL;
+    mabobj->blob = blob;
+    mabobj->bloblen = bloblen;
+    mabobj->ticket = 0;
+    mabobj->prev = mabobj->next = NULL;
+    mab_type_obj_modified(mabobj);
+    return mabobj;
+}
+
+/* give the object a new version, after every change of its state */
+static void
+mab_type_obj_modified(mab_type_obj_t *mabobj)
+{
+    mabobj->version = ++mabVersion;
+}
+
+static void
+mab_type_obj_free(mab_type_obj_t *mabobj)
+{
+    mab_cold_unlink(mabobj);
+
+    if(mabobj->blob){
+        //a folded shared bandit still holds its reference
+        if(mabobj->shared){
+            mab_type_obj_free_choices(mabobj);
+        }
+        RedisModule_Free(mabobj->blob);
+        RedisModule_Free(mabobj);
+        return;
+    }
+
+    mab_type_obj_free_choices(mabobj);
+    multi_arm_free(mabobj->ma);
+    RedisModule_Free(mabobj);
+}
+
+static void
+mab_sstrs_free(sstr_t **strs, int n)
+{
+    int     i;
+
+    for(i = 0; i < n; i++){
+        RedisModule_Free(strs[i]->data);
+        RedisModule_Free(strs[i]);
+    }
+    RedisModule_Free(strs);
+}
+
+/* free the choices of the object, or drop its reference to shared ones */
+static void
+mab_type_obj_free_choices(mab_type_obj_t *mabobj)
+{
+    mab_shared_choices_t    *shared = mabobj->shared;
+
+    if(shared == NULL){
+        mab_sstrs_free(mabobj->choices, mabobj->choice_num);
+    }else if(__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        mab_sstrs_free(shared->choices, shared->choice_num);
+        RedisModule_Free(shared);
+    }
+    mabobj->choices = NULL;
+    mabobj->shared = NULL;
+}
+
+/* hand the choices of the object over to a shared block it keeps a reference to */
+static mab_shared_choices_t *
+mab_type_obj_share(mab_type_obj_t *mabobj)
+{
+    mab_shared_choices_t    *shared = mabobj->shared;
+
+    if(shared == NULL){
+        shared = RedisModule_Alloc(sizeof(*shared));
+        shared->choices = mabobj->choices;
+        shared->choice_num = mabobj->choice_num;
+        shared->refs = 1;
+        mabobj->shared = shared;
+    }
+    return shared;
+}
+
+/* give the object its own copy of shared choices, before it changes them */
+static void
+mab_type_obj_unshare(mab_type_obj_t *mabobj)
+{
+    sstr_t  **choices;
+    int     i;
+
+    if(mabobj->shared == NULL){
+        return;
+    }
+
+    choices = RedisModule_Alloc(sizeof(sstr_t *) * mabobj->choice_num);
+    for(i = 0; i < mabobj->choice_num; i++){
+        choices[i] = RedisModule_Alloc(sizeof(sstr_t));
+        choices[i]->len = mabobj->choices[i]->len;
+        choices[i]->data = RedisModule_Alloc(choices[i]->len + 1);
+        memcpy(choices[i]->data, mabobj->choices[i]->data, choices[i]->len + 1);
+    }
+    multi_arm_set_choices(mabobj->ma, (void **)choices);
+
+    mab_type_obj_free_choices(mabobj);
+    mabobj->choices = choices;
+}
+
+
+/*
+ * choice_num, the choices then the multi_arm_dump of the bandit. a folded
+ * shared bandit keeps the multi_arm_dump alone in blob
+ */
+static void
+mab_type_obj_dump(mab_type_obj_t *mabobj, multi_arm_buf_t *b)
+{
+    int     i;
+
+    multi_arm_buf_varint(b, mabobj->choice_num);
+    for(i = 0; i < mabobj->choice_num; i++){
+        multi_arm_buf_bytes(b, mabobj->choices[i]->data, mabobj->choices[i]->len);
+    }
+    if(mabobj->blob){
+        multi_arm_buf_raw(b, mabobj->blob, mabobj->bloblen);
+    }else{
+        multi_arm_dump(mabobj->ma, b);
+    }
+}
+
+/*
+ * check the header of a serialized object: the choices, the policy name
+ * and that the arm count matches the choices. return nonzero if corrupt
+ */
+static int
+mab_type_obj_check(const uint8_t *blob, size_t len)
+{
+    multi_arm_reader_t  r = {blob, blob + len, 0};
+    uint64_t            choice_num = multi_arm_read_varint(&r), i;
+    size_t              choice_len;
+
+    //htree has the largest arm limit
+    if(r.err || choice_num == 0 || choice_num > MABREDIS_HTREE_MAXCHOICE_NUM){
+        return 1;
+    }
+    for(i = 0; i < choice_num; i++){
+        multi_arm_read_bytes(&r, &choice_len);
+    }
+    if(r.err){
+        return 1;
+    }
+    return (uint64_t)multi_arm_dump_check(&r) != choice_num;
+}
+
+/*
+ * parse a serialized object into its choices and bandit. return the number
+ * of choices, 0 if the blob is corrupt
+ */
+static int
+mab_type_obj_parse(const uint8_t *blob, size_t bloblen, sstr_t ***choices, multi_arm_t **pma)
+{
+    multi_arm_reader_t  r = {blob, blob + bloblen, 0};
+    uint64_t            choice_num = multi_arm_read_varint(&r);
+    sstr_t              **strs;
+    multi_arm_t         *ma = NULL;
+    const uint8_t       *p;
+    size_t              len;
+    uint64_t            n = 0;
+
+    //every choice takes at least one byte
+    if(r.err || choice_num == 0 || choice_num > (uint64_t)(r.end - r.p)){
+        return 0;
+    }
+
+    strs = RedisModule_Calloc(choice_num, sizeof(sstr_t *));
+    for(n = 0; n < choice_num; n++){
+        p = multi_arm_read_bytes(&r, &len);
+        if(r.err){
+            goto error;
+        }
+        strs[n] = RedisModule_Alloc(sizeof(sstr_t));
+        strs[n]->data = RedisModule_Alloc(len + 1);
+        memcpy(strs[n]->data, p, len);
+        strs[n]->data[len] = '\0';
+        strs[n]->len = len;
+    }
+
+    ma = multi_arm_restore(&r);
+    if(ma == NULL || r.p != r.end || (uint64_t)ma->len != choice_num){
+        goto error;
+    }
+
+    multi_arm_set_choices(ma, (void **)strs);
+    *choices = strs;
+    *pma = ma;
+    return (int)choice_num;
+
+error:
+    if(ma){
+        multi_arm_free(ma);
+    }
+    mab_sstrs_free(strs, (int)n);
+    return 0;
+}
+
+/*
+ * build choices and ma from the serialized form. no-op for an object
+ * which is already materialized. return nonzero if the blob is corrupt,
+ * the object is left untouched then
+ */
+static int
+mab_type_obj_materialize(mab_type_obj_t *mabobj)
+{
+    if(mabobj->blob == NULL){
+        return 0;
+    }
+
+    if(mabobj->shared){
+        multi_arm_reader_t  r = {mabobj->blob, mabobj->blob + mabobj->bloblen, 0};
+        multi_arm_t         *ma = multi_arm_restore(&r);
+
+        if(ma == NULL || r.p != r.end || ma->len != mabobj->choice_num){
+            if(ma){
+                multi_arm_free(ma);
+            }
+            return 1;
+        }
+        multi_arm_set_choices(ma, (void **)mabobj->choices);
+        mabobj->ma = ma;
+    }else{
+        int     n = mab_type_obj_parse(mabobj->blob, mabobj->bloblen, &mabobj->choices,
+                &mabobj->ma);
+
+        if(n == 0){
+            return 1;
+        }
+        mabobj->choice_num = n;
+    }
+
+    RedisModule_Free(mabobj->blob);
+    mabobj->blob = NULL;
+    mabobj->bloblen = 0;
+    return 0;
+}
+
+/*
+ * replace the materialized object by its serialized form. a shared bandit
+ * keeps its reference to the choices and serializes its multi_arm_t only
+ */
+static void
+mab_type_obj_fold(mab_type_obj_t *mabobj)
+{
+    multi_arm_buf_t b = {NULL, 0, 0};
+
+    if(mabobj->shared){
+        multi_arm_dump(mabobj->ma, &b);
+    }else{
+        mab_type_obj_dump(mabobj, &b);
+        mab_type_obj_free_choices(mabobj);
+        mabobj->choice_num = 0;
+    }
+    multi_arm_free(mabobj->ma);
+
+    mabobj->ma = NULL;
+    mabobj->blob = RedisModule_Realloc(b.data, b.len);
+    mabobj->bloblen = b.len;
+}
+
+static int
+mab_cold_linked(mab_type_obj_t *mabobj)
+{
+    return mabobj->prev != NULL || mabCold.head == mabobj;
+}
+
+static void
+mab_cold_remove(mab_type_obj_t *mabobj)
+{
+    if(mabobj->prev){
+        mabobj->prev->next = mabobj->next;
+    }else{
+        mabCold.head = mabobj->next;
+    }
+    if(mabobj->next){
+        mabobj->next->prev = mabobj->prev;
+    }else{
+        mabCold.tail = mabobj->prev;
+    }
+    mabobj->prev = mabobj->next = NULL;
+}
+
+/* move an accessed object to the head of the cold list */
+static void
+mab_cold_touch(mab_type_obj_t *mabobj)
+{
+    if(mabCold.idle_ms == 0){
+        return;
+    }
+
+    pthread_mutex_lock(&mabCold.lock);
+    if(mab_cold_linked(mabobj)){
+        mab_cold_remove(mabobj);
+    }
+    mabobj->atime = RedisModule_Milliseconds();
+    mabobj->next = mabCold.head;
+    if(mabCold.head){
+        mabCold.head->prev = mabobj;
+    }else{
+        mabCold.tail = mabobj;
+    }
+    mabCold.head = mabobj;
+    pthread_mutex_unlock(&mabCold.lock);
+}
+
+static void
+mab_cold_unlink(mab_type_obj_t *mabobj)
+{
+    if(mabCold.idle_ms == 0){
+        return;
+    }
+
+    pthread_mutex_lock(&mabCold.lock);
+    if(mab_cold_linked(mabobj)){
+        mab_cold_remove(mabobj);
+    }
+    pthread_mutex_unlock(&mabCold.lock);
+}
+
+/* fold the idle objects from the tail, runs with the GIL held */
+static void
+mab_cold_sweep(int steps)
+{
+    long long       now = RedisModule_Milliseconds();
+    mab_type_obj_t  *mabobj;
+
+    pthread_mutex_lock(&mabCold.lock);
+    while(steps-- > 0 && (mabobj = mabCold.tail) != NULL &&
+            now - mabobj->atime >= mabCold.idle_ms){
+        mab_cold_remove(mabobj);
+        mab_type_obj_fold(mabobj);
+    }
+    pthread_mutex_unlock(&mabCold.lock);
+}
+
+/* 8 bytes a round then the murmur3 finalizer */
+static uint64_t
+mab_hot_hash(const char *p, size_t len)
+{
+    uint64_t    h = 0x9e3779b97f4a7c15ULL ^ len, w;
+
+    for(; len >= 8; p += 8, len -= 8){
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+/* swap two heap entries and point their index slots at the new positions */
+static void
+mab_hot_swap(int i, int j)
+{
+    mab_hot_key_t   *heap = mabHot.heap, tmp;
+
+    tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+    mabHot.index[heap[i].slot] = i + 1;
+    mabHot.index[heap[j].slot] = j + 1;
+}
+
+/* heap position of the key, -1 when it is not kept */
+static int
+mab_hot_find(uint64_t h, const char *name, size_t len)
+{
+    uint32_t        s, pos;
+    mab_hot_key_t   *e;
+
+    for(s = h & mabHot.mask; (pos = mabHot.index[s]) != 0; s = (s + 1) & mabHot.mask){
+        e = mabHot.heap + pos - 1;
+        if(e->hash == h && e->len == len && memcmp(e->name, name, len) == 0){
+            return pos - 1;
+        }
+    }
+    return -1;
+}
+
+static void
+mab_hot_index_add(int i)
+{
+    uint32_t    s;
+
+    for(s = mabHot.heap[i].hash & mabHot.mask; mabHot.index[s] != 0;
+            s = (s + 1) & mabHot.mask);
+    mabHot.index[s] = i + 1;
+    mabHot.heap[i].slot = s;
+}
+
+/* free the slot of entry i, the later slots of its run shift back to keep the probes whole */
+static void
+mab_hot_index_del(int i)
+{
+    uint32_t    hole = mabHot.heap[i].slot, s = hole, home, pos;
+
+    mabHot.index[hole] = 0;
+    while((pos = mabHot.index[s = (s + 1) & mabHot.mask]) != 0){
+        home = mabHot.heap[pos - 1].hash & mabHot.mask;
+        //an entry may fill the hole unless its home lies in (hole, s]
+        if(((s - home) & mabHot.mask) >= ((s - hole) & mabHot.mask)){
+            mabHot.index[hole] = pos;
+            mabHot.heap[pos - 1].slot = hole;
+            mabHot.index[s] = 0;
+            hole = s;
+        }
+    }
+}
+
+static void
+mab_hot_sift_down(int i)
+{
+    mab_hot_key_t   *heap = mabHot.heap;
+    int             c;
+
+    while((c = 2 * i + 1) < mabHot.len){
+        if(c + 1 < mabHot.len && heap[c + 1].count < heap[c].count){
+            c++;
+        }
+        if(heap[i].count <= heap[c].count){
+            break;
+        }
+        mab_hot_swap(i, c);
+        i = c;
+    }
+}
+
+static void
+mab_hot_sift_up(int i)
+{
+    mab_hot_key_t   *heap = mabHot.heap;
+
+    while(i > 0 && heap[(i - 1) / 2].count > heap[i].count){
+        mab_hot_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* halve every count once per half-life elapsed, halving keeps the heap order */
+static void
+mab_hot_decay(long long now)
+{
+    long long   n;
+    int         i;
+
+    if(now < mabHot.decay_at){
+        return;
+    }
+    n = (now - mabHot.decay_at) / mabHot.halflife_ms + 1;
+    mabHot.decay_at += n * mabHot.halflife_ms;
+    n = n < 32 ? n : 32;
+
+    for(i = 0; i < MABREDIS_HOT_DEPTH * MABREDIS_HOT_WIDTH; i++){
+        mabHot.sketch[i] = (uint32_t)((uint64_t)mabHot.sketch[i] >> n);
+    }
+    for(i = 0; i < mabHot.len; i++){
+        mabHot.heap[i].count = (uint32_t)((uint64_t)mabHot.heap[i].count >> n);
+    }
+}
+
+/*
+ * count a hit of key: raise its smallest sketch counters (conservative
+ * update), one in each quarter of its block, then move it into the heap
+ * if its estimate beats the coldest key kept. O(depth + log topk) whatever
+ * the key space
+ */
+static void
+mab_hot_hit(RedisModuleString *key)
+{
+    size_t          len;
+    const char      *name;
+    uint64_t        h;
+    uint32_t        *block, *cnt[MABREDIS_HOT_DEPTH], est = UINT32_MAX;
+    mab_hot_key_t   *e;
+    int             i;
+
+    if(mabHot.topk == 0){
+        return;
+    }
+    //the clock is a syscall away, a few hundred hits late is fine for a half-life
+    if((++mabHot.hits & 255) == 0){
+        mab_hot_decay(RedisModule_Milliseconds());
+    }
+
+    name = RedisModule_StringPtrLen(key, &len);
+    h = mab_hot_hash(name, len);
+    block = mabHot.sketch + (h & (MABREDIS_HOT_DEPTH * MABREDIS_HOT_WIDTH / 16 - 1)) * 16;
+    for(i = 0; i < MABREDIS_HOT_DEPTH; i++){
+        cnt[i] = block + i * 4 + ((h >> (32 + 2 * i)) & 3);
+        est = *cnt[i] < est ? *cnt[i] : est;
+    }
+    est += est < UINT32_MAX;
+    for(i = 0; i < MABREDIS_HOT_DEPTH; i++){
+        *cnt[i] = *cnt[i] < est ? est : *cnt[i];
     }
 
-    RedisModuleKey  *key = mabType_OpenKey(ctx, argv[1]);
-    if(key == NULL){
-        return REDISMODULE_OK;
+    //a kept key has an estimate above its heap count, so the colder keys can stop here
+    if(mabHot.len == mabHot.topk && est <= mabHot.heap[0].count){
+        return;
+    }
+    if((i = mab_hot_find(h, name, len)) >= 0){
+        mabHot.heap[i].count = est;
+        mab_hot_sift_down(i);
+        return;
     }
 
-    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
-    size_t          arm_len = mabobj->choice_num;
+    //a free slot while the heap fills up, the coldest key once it is full
+    if(mabHot.len < mabHot.topk){
+        e = mabHot.heap + mabHot.len++;
+        e->name = NULL;
+    }else{
+        e = mabHot.heap;
+        mab_hot_index_del(0);
+    }
+    e->name = RedisModule_Realloc(e->name, len ? len : 1);
+    e->hash = h;
+    e->count = est;
+    e->len = len;
+    memcpy(e->name, name, len);
+    mab_hot_index_add(e - mabHot.heap);
+
+    if(e == mabHot.heap){
+        mab_hot_sift_down(0);
+    }else{
+        mab_hot_sift_up(e - mabHot.heap);
+    }
+}
 
-    long long       tmp1;
-    double          tmp2;
-    int             i;
+static void
+mab_hot_reset(void)
+{
+    int     i;
 
-    //check input args
-    for(i = 2; i < argc;){
-        //for $arm_idx
-        if(RedisModule_StringToLongLong(argv[i++], &tmp1) != REDISMODULE_OK){
-            return RedisModule_ReplyWithError(ctx, "ERR expect a integer for arm idx");
-        }
-        if(tmp1 < 0 || tmp1 >= (long long)arm_len){
-            return RedisModule_ReplyWithError(ctx, "ERR invalid idx value");
-        }
+    for(i = 0; i < mabHot.len; i++){
+        RedisModule_Free(mabHot.heap[i].name);
+    }
+    mabHot.len = 0;
+    memset(mabHot.index, 0, sizeof(uint32_t) * (mabHot.mask + 1));
+    memset(mabHot.sketch, 0, sizeof(uint32_t) * MABREDIS_HOT_DEPTH * MABREDIS_HOT_WIDTH);
+}
 
-        //for $count
-        if(RedisModule_StringToLongLong(argv[i++], &tmp1) != REDISMODULE_OK){
-            return RedisModule_ReplyWithError(ctx, "ERR expect a integer for count");
-        }
-        if(tmp1 < 0){
-            return RedisModule_ReplyWithError(ctx, "ERR invalid count value");
-        }
+static uint32_t
+mab_ticket_sec(void)
+{
+    return (uint32_t)((RedisModule_Milliseconds() - mabTickets.start) / 1000);
+}
 
-        //for reward
-        if(RedisModule_StringToDouble(argv[i++], &tmp2) != REDISMODULE_OK){
-            return RedisModule_ReplyWithError(ctx, "ERR expect a double for reward");
-        }
-        if(tmp2 < 0){
-            return RedisModule_ReplyWithError(ctx, "ERR invalid reward value");
-        }
+/* the bandit id of mabobj, registered under key of the selected db if it has none */
+static uint32_t
+mab_ticket_bandit(RedisModuleCtx *ctx, RedisModuleString *key, mab_type_obj_t *mabobj)
+{
+    mab_ticket_bandit_t *b;
+    const char          *name;
+    size_t              len;
+    uint32_t            id = mabobj->ticket;
 
-        //ensure average reward less than 1.0
-        if((tmp1 == 0 && tmp2 > 1.0) || (tmp2 / tmp1 > 1.0)){
-            return RedisModule_ReplyWithError(ctx, "ERR invalid reward/count value");
+    if(id != 0 && mabTickets.bandits[id].obj == mabobj){
+        return id;
+    }
+
+    if(mabTickets.nfree > 0){
+        id = mabTickets.free[--mabTickets.nfree];
+    }else{
+        if(mabTickets.len >= mabTickets.size){
+            mabTickets.size = mabTickets.size ? mabTickets.size * 2 : 64;
+            mabTickets.bandits = RedisModule_Realloc(mabTickets.bandits,
+                    sizeof(mab_ticket_bandit_t) * mabTickets.size);
+            mabTickets.free = RedisModule_Realloc(mabTickets.free,
+                    sizeof(uint32_t) * mabTickets.size);
         }
+        id = mabTickets.len++;
     }
 
+    name = RedisModule_StringPtrLen(key, &len);
+    b = mabTickets.bandits + id;
+    b->obj = mabobj;
+    b->db = RedisModule_GetSelectedDb(ctx);
+    b->key = RedisModule_Alloc(len ? len : 1);
+    memcpy(b->key, name, len);
+    b->keylen = len;
+    b->pending = 0;
+    mabobj->ticket = id;
+    return id;
+}
 
-    arm_t   *arm;
-    for(i = 2; i < argc;){
-        //for $arm_idx
-        RedisModule_StringToLongLong(argv[i++], &tmp1);
-        arm = mabobj->ma->arms + tmp1;
+static void
+mab_ticket_release(uint32_t id)
+{
+    mab_ticket_bandit_t *b = mabTickets.bandits + id;
 
-        RedisModule_StringToLongLong(argv[i++], &tmp1);
-        arm->count = tmp1;
+    if(--b->pending == 0){
+        RedisModule_Free(b->key);
+        b->key = NULL;
+        b->obj = NULL;
+        mabTickets.free[mabTickets.nfree++] = id;
+    }
+}
 
-        RedisModule_StringToDouble(argv[i++], &tmp2);
-        arm->reward = tmp2;
+/*
+ * open the bandit of a ticket and reward arm idx with reward_str, replicated
+ * as mab.reward of its key. without reward_str, trials 0 rewards replicated
+ * as mab.rewardagg. the db of the bandit is selected meanwhile, so the key
+ * opened and the replicated command land in it. return 1 if the bandit is
+ * gone or changed, -1 on invalid reward
+ */
+static int
+mab_ticket_apply(RedisModuleCtx *ctx, uint32_t id, uint32_t idx, uint64_t trials,
+        double reward, RedisModuleString *reward_str)
+{
+    mab_ticket_bandit_t *b = mabTickets.bandits + id;
+    RedisModuleString   *name = RedisModule_CreateString(ctx, b->key, b->keylen);
+    RedisModuleKey      *key = NULL;
+    mab_type_obj_t      *mabobj;
+    int                 ret = 1, db = RedisModule_GetSelectedDb(ctx);
+
+    if(RedisModule_SelectDb(ctx, b->db) != REDISMODULE_OK){
+        goto done;
+    }
+    key = RedisModule_OpenKey(ctx, name, REDISMODULE_READ);
+    if(key == NULL || RedisModule_ModuleTypeGetType(key) != mabType){
+        goto done;
     }
+    mabobj = RedisModule_ModuleTypeGetValue(key);
+    if(mabobj != b->obj || mabobj->ticket != id || mab_type_obj_materialize(mabobj) != 0){
+        goto done;
+    }
+    mab_cold_touch(mabobj);
 
-    RedisModule_ReplyWithLongLong(ctx, 0);
+    if(reward_str){
+        ret = multi_arm_reward(mabobj->ma, (int)idx, reward) ? -1 : 0;
+    }else{
+        ret = multi_arm_reward_agg(mabobj->ma, (int)idx, trials, 0.0, 0) ? -1 : 0;
+    }
+    if(ret == 0){
+        mab_type_obj_modified(mabobj);
+        mab_event_reward(ctx, name, (int)idx, trials, reward);
+        if(reward_str){
+            RedisModule_Replicate(ctx, "mab.reward", "sls", name, (long long)idx, reward_str);
+        }else{
+            RedisModule_Replicate(ctx, "mab.rewardagg", "sllc", name, (long long)idx,
+                    (long long)trials, "0");
+        }
+    }
 
-    RedisModule_ReplicateVerbatim(ctx);
-    return REDISMODULE_OK;
+done:
+    if(key){
+        RedisModule_CloseKey(key);
+    }
+    RedisModule_SelectDb(ctx, db);
+    RedisModule_FreeString(ctx, name);
+    return ret;
 }
 
+/*
+ * drop the oldest pending ticket without its reward. tickets are issued by
+ * mab.choice, a readonly command, it never writes a bandit
+ */
+static void
+mab_ticket_drop(void)
+{
+    mab_ticket_t    *t;
+
+    while(mabTickets.tail < mabTickets.head){
+        t = mabTickets.ring + (mabTickets.tail++ & (mabTickets.cap - 1));
+        if(t->bandit != 0){
+            mab_ticket_release(t->bandit);
+            return;
+        }
+    }
+}
 
 /*
- * command:
- * mab.statjson $key
- *
- * return:
- * a json string
+ * a new ticket for arm idx of mabobj. a full ring doubles up to max, then
+ * the oldest ticket is dropped
+ */
+static long long
+mab_ticket_issue(RedisModuleCtx *ctx, RedisModuleString *key, mab_type_obj_t *mabobj, int idx)
+{
+    mab_ticket_t    *t;
+    uint64_t        seq;
+
+    if(mabTickets.head - mabTickets.tail == mabTickets.cap){
+        if(mabTickets.cap < mabTickets.max){
+            uint64_t        cap = mabTickets.cap ? mabTickets.cap * 2 : MABREDIS_TICKET_MIN_RING;
+
+            cap = cap < mabTickets.max ? cap : mabTickets.max;
+            mab_ticket_t    *ring = RedisModule_Alloc(sizeof(mab_ticket_t) * cap);
+
+            for(seq = mabTickets.tail; seq < mabTickets.head; seq++){
+                ring[seq & (cap - 1)] = mabTickets.ring[seq & (mabTickets.cap - 1)];
+            }
+            RedisModule_Free(mabTickets.ring);
+            mabTickets.ring = ring;
+            mabTickets.cap = cap;
+        }else{
+            mab_ticket_drop();
+        }
+    }
+
+    seq = mabTickets.head++;
+    t = mabTickets.ring + (seq & (mabTickets.cap - 1));
+    t->bandit = mab_ticket_bandit(ctx, key, mabobj);
+    t->idx = (uint32_t)idx;
+    t->sec = mab_ticket_sec();
+    mabTickets.bandits[t->bandit].pending++;
+    return (long long)seq;
+}
+
+/*
+ * return 0 once rewarded, 1 for an unknown or expired ticket, 2 for a
+ * ticket of another key, -1 on invalid reward
  */
 static int
-mabTypeStatJson_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
+mab_ticket_resolve(RedisModuleCtx *ctx, RedisModuleString *key, long long ticket,
+        double reward, RedisModuleString *reward_str)
 {
-    RedisModule_AutoMemory(ctx);
+    uint64_t            seq = (uint64_t)ticket;
+    mab_ticket_t        *t;
+    mab_ticket_bandit_t *b;
+    const char          *name;
+    size_t              len;
+    int                 ret;
+
+    if(ticket < 0 || seq < mabTickets.tail || seq >= mabTickets.head){
+        return 1;
+    }
+    t = mabTickets.ring + (seq & (mabTickets.cap - 1));
+    if(t->bandit == 0 || mab_ticket_sec() - t->sec >= mabTickets.ttl){
+        return 1;
+    }
 
-    if(argc != 2){
-        return RedisModule_WrongArity(ctx);
+    b = mabTickets.bandits + t->bandit;
+    name = RedisModule_StringPtrLen(key, &len);
+    if(b->db != RedisModule_GetSelectedDb(ctx) || len != b->keylen ||
+            memcmp(name, b->key, len) != 0){
+        return 2;
     }
 
-    RedisModuleKey *key = mabType_OpenKey(ctx, argv[1]);
-    if(key == NULL){
-        return REDISMODULE_OK;
+    ret = mab_ticket_apply(ctx, t->bandit, t->idx, 1, reward, reward_str);
+    if(ret >= 0){
+        mab_ticket_release(t->bandit);
+        t->bandit = 0;
     }
+    return ret;
+}
 
-    mab_type_obj_t  *mabobj = RedisModule_ModuleTypeGetValue(key);
-    char    buf[MABREDIS_STATBUF_SIZE];
+static int
+mab_ticket_cmp(const void *a, const void *b)
+{
+    const mab_ticket_t  *x = a, *y = b;
+
+    if(x->bandit != y->bandit){
+        return x->bandit < y->bandit ? -1 : 1;
+    }
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
 
-    if(multi_arm_stat_json(mabobj->ma, buf, sizeof(buf)) != 0){
-        return RedisModule_ReplyWithError(ctx, "buf size not enough");
+/*
+ * move the tail past at most steps (up to MABREDIS_TICKET_STEPS) expired
+ * tickets, return how many. with TICKET-EXPIRE-ZERO the expired tickets
+ * count as 0 rewards, one mab.rewardagg per bandit and arm, on a master
+ */
+static int
+mab_ticket_expire(RedisModuleCtx *ctx, int steps)
+{
+    mab_ticket_t    batch[MABREDIS_TICKET_STEPS], *t;
+    uint32_t        now = mab_ticket_sec();
+    int             n = 0, i, j, apply;
+
+    while(mabTickets.tail < mabTickets.head && n < steps){
+        t = mabTickets.ring + (mabTickets.tail & (mabTickets.cap - 1));
+        if(t->bandit != 0){
+            if(now - t->sec < mabTickets.ttl){
+                break;
+            }
+            batch[n++] = *t;
+        }
+        mabTickets.tail++;
     }
 
-    return RedisModule_ReplyWithSimpleString(ctx, buf);
+    //a former master turned replica gets the rewards from its new master
+    apply = mabTickets.expire_zero &&
+        !(RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE);
+
+    qsort(batch, n, sizeof(mab_ticket_t), mab_ticket_cmp);
+    for(i = 0; i < n; i = j){
+        for(j = i + 1; j < n && mab_ticket_cmp(batch + i, batch + j) == 0; j++);
+
+        if(apply){
+            mab_ticket_apply(ctx, batch[i].bandit, batch[i].idx, j - i, 0.0, NULL);
+        }
+    }
+    for(i = 0; i < n; i++){
+        mab_ticket_release(batch[i].bandit);
+    }
+    return n;
 }
 
-static RedisModuleKey *
-mabType_OpenKey(RedisModuleCtx *ctx, RedisModuleString *key)
+/*
+ * expire the pending tickets every MABREDIS_TICKET_INTERVAL ms, whether
+ * tickets are still issued or not. the lock is taken per batch
+ */
+static void *
+mab_ticket_thread(void *arg)
 {
-    RedisModuleKey *ret = RedisModule_OpenKey(ctx, key, REDISMODULE_READ);
-    if(ret == NULL){
-        RedisModule_ReplyWithError(ctx, "ERR mab key not exist");
-        return NULL;
+    RedisModuleCtx  *ctx = RedisModule_GetThreadSafeContext(NULL);
+    struct timespec ts = {MABREDIS_TICKET_INTERVAL / 1000,
+        MABREDIS_TICKET_INTERVAL % 1000 * 1000000L};
+    int             n;
+
+    REDISMODULE_NOT_USED(arg);
+    for(;;){
+        nanosleep(&ts, NULL);
+
+        do{
+            RedisModule_ThreadSafeContextLock(ctx);
+            n = mab_ticket_expire(ctx, MABREDIS_TICKET_STEPS);
+            RedisModule_ThreadSafeContextUnlock(ctx);
+        }while(n == MABREDIS_TICKET_STEPS);
     }
+    return NULL;
+}
 
-    if(RedisModule_ModuleTypeGetType(ret) != mabType){
-        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
-        return NULL;
+/* hand the buffer at fill to the writer, drop its events if none is free */
+static void
+mab_event_handoff(void)
+{
+    pthread_mutex_lock(&mabEvents.lock);
+    if(mabEvents.fill - mabEvents.flush < MABREDIS_EVENT_BUFFERS - 1){
+        mabEvents.lens[mabEvents.fill % MABREDIS_EVENT_BUFFERS] = mabEvents.len;
+        mabEvents.fill++;
+        pthread_cond_signal(&mabEvents.cond);
+    }else{
+        mabEvents.dropped += mabEvents.len;
     }
-    return ret;
+    mabEvents.len = 0;
+    pthread_mutex_unlock(&mabEvents.lock);
 }
 
+/* the next record of the buffer, stamped, mab_event_push it once filled */
+static mab_event_t *
+mab_event_next(uint64_t hash, int type)
+{
+    mab_event_t *e = mabEvents.bufs + (mabEvents.fill % MABREDIS_EVENT_BUFFERS) *
+        MABREDIS_EVENT_BATCH + mabEvents.len;
 
-static mab_type_obj_t *
-mab_type_obj_new(RedisModuleString *type, RedisModuleString **choice_strs, int choice_num,
-        RedisModuleString *option_str)
+    e->hash = hash;
+    e->stamp = MAB_EVENT_STAMP(RedisModule_Milliseconds(), type);
+    return e;
+}
+
+static void
+mab_event_push(void)
 {
-    mab_type_obj_t  *ret = RedisModule_Alloc(sizeof(*ret));
+    if(++mabEvents.len == MABREDIS_EVENT_BATCH){
+        mab_event_handoff();
+    }
+}
 
-    sstr_t          **choices = RedisModule_StringToSStrs(choice_strs, choice_num);
-    char            *option = NULL, *t = RedisModule_StringToCStr(type);
+static void
+mab_event_append(uint64_t hash, int type, uint32_t idx, uint32_t n, double value)
+{
+    mab_event_t *e = mab_event_next(hash, type);
 
-    if(option_str != NULL){
-        option = RedisModule_StringToCStr(option_str);
+    e->value = value;
+    e->idx = idx;
+    e->n = n;
+    mab_event_push();
+}
+
+static uint32_t
+mab_event_count(double v)
+{
+    return v < (double)UINT32_MAX ? (uint32_t)v : UINT32_MAX;
+}
+
+/*
+ * a choice of arm idx with its propensity, mask as given to the choice.
+ * a thompson choice logs its posteriors (see mab_event.h), they are kept
+ * in the buffer of the choice so a dropped buffer never splits them
+ */
+static void
+mab_event_choice(RedisModuleString *key, mab_type_obj_t *mabobj, const uint64_t *mask, int idx)
+{
+    mab_event_beta_t    *b;
+    uint64_t            hash;
+    double              p, share, fixed;
+    size_t              len;
+    const char          *s;
+    int                 i, n;
+
+    if(mabEvents.bufs == NULL){
+        return;
     }
 
-    ret->ma = multi_arm_new(t, (void **)choices, choice_num, option);
-    if(ret->ma == NULL){
-        int i;
-        for(i = 0; i < choice_num; i++){
-            RedisModule_Free(choices[i]->data);
-            RedisModule_Free(choices[i]);
+    s = RedisModule_StringPtrLen(key, &len);
+    hash = mab_hot_hash(s, len);
+    p = multi_arm_propensity(mabobj->ma, mask, idx);
+    if(p >= 0.0){
+        mab_event_append(hash, MAB_EVENT_CHOICE, (uint32_t)idx, (uint32_t)mabobj->choice_num, p);
+        return;
+    }
+
+    n = multi_arm_posterior(mabobj->ma, mask, idx, mabEvents.betas, mabEvents.nbetas,
+            &share, &fixed);
+    if(n == 0 || n > mabEvents.nbetas){
+        mab_event_append(hash, MAB_EVENT_CHOICE, (uint32_t)idx, (uint32_t)mabobj->choice_num,
+                0.0);
+        return;
+    }
+
+    if(mabEvents.len + n + 1 > MABREDIS_EVENT_BATCH){
+        mab_event_handoff();
+    }
+    for(i = 0; i < n; i++){
+        b = (mab_event_beta_t *)mab_event_next(hash, MAB_EVENT_BETA);
+        b->alpha = mab_event_count(mabEvents.betas[i].alpha);
+        b->beta = mab_event_count(mabEvents.betas[i].beta);
+        b->level = (uint32_t)mabEvents.betas[i].level;
+        b->flags = mabEvents.betas[i].chosen ? MAB_EVENT_BETA_CHOSEN : 0;
+        //the arm itself is the chosen candidate of the last level
+        if(mabEvents.betas[i].chosen && fixed > 0.0 &&
+                mabEvents.betas[i].level == mabEvents.betas[n - 1].level){
+            b->flags |= MAB_EVENT_BETA_BEST;
         }
+        mab_event_push();
+    }
+    mab_event_append(hash, MAB_EVENT_CHOICE, (uint32_t)idx, (uint32_t)mabobj->choice_num,
+            -share);
+}
 
-        RedisModule_Free(choices);
-        RedisModule_Free(ret);
-        ret = NULL;
+/*
+ * trials rewards of arm idx summing to reward. a replica does not log the
+ * rewards it gets from its master, they are in the log of the master
+ */
+static void
+mab_event_reward(RedisModuleCtx *ctx, RedisModuleString *key, int idx, uint64_t trials,
+        double reward)
+{
+    uint64_t    hash;
+    double      part;
+    size_t      len;
+    const char  *p;
 
-    }else{
-        ret->choice_num = choice_num;
-        ret->choices = choices;
+    if(mabEvents.bufs == NULL ||
+            (RedisModule_GetContextFlags(ctx) & REDISMODULE_CTX_FLAGS_SLAVE)){
+        return;
     }
 
-    if(option != NULL){
-        RedisModule_Free(option);
+    p = RedisModule_StringPtrLen(key, &len);
+    hash = mab_hot_hash(p, len);
+    for(; trials > UINT32_MAX; trials -= UINT32_MAX){
+        part = reward * ((double)UINT32_MAX / trials);
+        mab_event_append(hash, MAB_EVENT_REWARD, (uint32_t)idx, UINT32_MAX, part);
+        reward -= part;
     }
-    RedisModule_Free(t);
+    mab_event_append(hash, MAB_EVENT_REWARD, (uint32_t)idx, (uint32_t)trials, reward);
+}
 
-    return ret;
+/*
+ * open a new log at path, a non empty file left there is rotated first.
+ * writer thread (or OnLoad before it starts) only
+ */
+static int
+mab_event_open(void)
+{
+    mab_event_header_t  h = {MAB_EVENT_MAGIC, MAB_EVENT_VERSION, sizeof(mab_event_t)};
+    struct stat         st;
+    char                rotated[PATH_MAX];
+    long long           ms;
+
+    if(stat(mabEvents.path, &st) == 0 && st.st_size > 0){
+        //path.$ms, unique and increasing in the order of the files
+        ms = RedisModule_Milliseconds();
+        ms = ms > mabEvents.rotated ? ms : mabEvents.rotated + 1;
+        do{
+            snprintf(rotated, sizeof(rotated), "%s.%lld", mabEvents.path, ms++);
+        }while(stat(rotated, &st) == 0);
+        mabEvents.rotated = ms - 1;
+
+        if(rename(mabEvents.path, rotated) != 0){
+            return -1;
+        }
+    }
+
+    mabEvents.fd = open(mabEvents.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(mabEvents.fd < 0){
+        return -1;
+    }
+    if(write(mabEvents.fd, &h, sizeof(h)) != (ssize_t)sizeof(h)){
+        close(mabEvents.fd);
+        mabEvents.fd = -1;
+        return -1;
+    }
+    mabEvents.size = sizeof(h);
+    return 0;
 }
 
-static void
-mab_type_obj_free(mab_type_obj_t *mabobj)
+/* append n events, the file is rotated once it reaches the rotation size */
+static int
+mab_event_write(const mab_event_t *e, int n)
 {
-    int     i = 0;
-    for(i = 0; i < (int)mabobj->choice_num; i++){
-        RedisModule_Free(mabobj->choices[i]->data);
-        RedisModule_Free(mabobj->choices[i]);
+    const char  *p = (const char *)e;
+    size_t      left = sizeof(*e) * n;
+    ssize_t     w;
+
+    if(mabEvents.fd < 0 && mab_event_open() != 0){
+        return -1;
     }
 
-    multi_arm_free(mabobj->ma);
-    RedisModule_Free(mabobj->choices);
-    RedisModule_Free(mabobj);
+    while(left > 0){
+        w = write(mabEvents.fd, p, left);
+        if(w < 0){
+            return -1;
+        }
+        p += w;
+        left -= w;
+    }
+
+    mabEvents.size += sizeof(*e) * n;
+    if(mabEvents.size >= mabEvents.rotate){
+        close(mabEvents.fd);
+        mabEvents.fd = -1;
+    }
+    return 0;
+}
+
+static void *
+mab_event_thread(void *arg)
+{
+    RedisModuleCtx  *ctx = RedisModule_GetThreadSafeContext(NULL);
+    struct timespec ts;
+    uint64_t        reported = 0, dropped;
+    long long       report_at = 0;
+    int             i, idle;
+
+    REDISMODULE_NOT_USED(arg);
+    for(;;){
+        pthread_mutex_lock(&mabEvents.lock);
+        if(mabEvents.flush == mabEvents.fill){
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += MABREDIS_EVENT_FLUSH / 1000;
+            pthread_cond_timedwait(&mabEvents.cond, &mabEvents.lock, &ts);
+        }
+        idle = mabEvents.flush == mabEvents.fill;
+        dropped = mabEvents.dropped;
+        pthread_mutex_unlock(&mabEvents.lock);
+
+        if(dropped != reported && RedisModule_Milliseconds() >= report_at){
+            RedisModule_ThreadSafeContextLock(ctx);
+            RedisModule_Log(ctx, "warning", "event log dropped %llu events",
+                    (unsigned long long)(dropped - reported));
+            RedisModule_ThreadSafeContextUnlock(ctx);
+            reported = dropped;
+            report_at = RedisModule_Milliseconds() + MABREDIS_EVENT_FLUSH;
+        }
+
+        if(idle){
+            //nothing filled up for a while, take the partial buffer
+            RedisModule_ThreadSafeContextLock(ctx);
+            if(mabEvents.len > 0){
+                mab_event_handoff();
+            }
+            RedisModule_ThreadSafeContextUnlock(ctx);
+            continue;
+        }
+
+        i = mabEvents.flush % MABREDIS_EVENT_BUFFERS;
+        if(mab_event_write(mabEvents.bufs + i * MABREDIS_EVENT_BATCH, mabEvents.lens[i]) != 0){
+            pthread_mutex_lock(&mabEvents.lock);
+            mabEvents.dropped += mabEvents.lens[i];
+            pthread_mutex_unlock(&mabEvents.lock);
+        }
+
+        pthread_mutex_lock(&mabEvents.lock);
+        mabEvents.flush++;
+        pthread_mutex_unlock(&mabEvents.lock);
+    }
+    return NULL;
 }
 
+static void *
+mab_cold_thread(void *arg)
+{
+    RedisModuleCtx  *ctx = RedisModule_GetThreadSafeContext(NULL);
+    struct timespec ts = {0, MABREDIS_COLD_INTERVAL * 1000000L};
+
+    REDISMODULE_NOT_USED(arg);
+    for(;;){
+        nanosleep(&ts, NULL);
+
+        RedisModule_ThreadSafeContextLock(ctx);
+        mab_cold_sweep(MABREDIS_COLD_STEPS);
+        RedisModule_ThreadSafeContextUnlock(ctx);
+    }
+    return NULL;
+}
 
 static void
 mabTypeRDBSave(RedisModuleIO *rdb, void *value)
 {
     mab_type_obj_t  *mabobj = value;
-    int             i = 0;
-    //save choices array
-    RedisModule_SaveUnsigned(rdb, mabobj->choice_num);
-    for(i = 0; i < mabobj->choice_num; i++){
-        RedisModule_SaveStringBuffer(rdb, (char *)mabobj->choices[i]->data,
-                mabobj->choices[i]->len);
+    multi_arm_buf_t b = {NULL, 0, 0};
+
+    //never accessed since loaded, write it back as is
+    if(mabobj->blob && mabobj->shared == NULL){
+        RedisModule_SaveStringBuffer(rdb, (char *)mabobj->blob, mabobj->bloblen);
+        return;
     }
 
-    multi_arm_rdb_save(mabobj->ma, rdb);
+    mab_type_obj_dump(mabobj, &b);
+    RedisModule_SaveStringBuffer(rdb, (char *)b.data, b.len);
+    multi_arm_buf_free(&b);
 }
 
 
 static void *
 mabTypeRDBLoad(RedisModuleIO *rdb, int encv)
 {
-    if(encv != 0){
+    if(encv > MABREDIS_ENCODING_VERSION){
         RedisModule_LogIOError(rdb, "warning", "can not load with version %d", encv);
         return NULL;
     }
 
+    mab_type_obj_t  *mabobj;
+    size_t          bloblen;
+
+    //keep the serialized form, it is parsed on the first access
+    if(encv >= 2){
+        uint8_t     *blob = (uint8_t *)RedisModule_LoadStringBuffer(rdb, &bloblen);
+
+        if(mab_type_obj_check(blob, bloblen) != 0){
+            RedisModule_LogIOError(rdb, "warning", "corrupt mab object");
+            RedisModule_Free(blob);
+            return NULL;
+        }
+        return mab_type_obj_raw(blob, bloblen);
+    }
+
+    mabobj = mab_type_obj_raw(NULL, 0);
+
     long long   choice_num = RedisModule_LoadUnsigned(rdb);
     sstr_t   **strs = RedisModule_Calloc(choice_num, sizeof(void *));
     int         i;
@@ -465,7 +3596,6 @@ mabTypeRDBLoad(RedisModuleIO *rdb, int encv)
         strs[i]->data = (uint8_t *)RedisModule_LoadStringBuffer(rdb, &(strs[i]->len));
     }
 
-    mab_type_obj_t  *mabobj = RedisModule_Alloc(sizeof(*mabobj));
     mabobj->choices = strs;
     mabobj->choice_num = choice_num;
 
@@ -475,9 +3605,7 @@ mabTypeRDBLoad(RedisModuleIO *rdb, int encv)
     }
 
     mabobj->ma = ma;
-    for(i = 0; i < choice_num; i++){
-        ma->arms[i].choice = mabobj->choices[i];
-    }
+    multi_arm_set_choices(ma, (void **)mabobj->choices);
     goto done;
 
 error1:
@@ -505,14 +3633,23 @@ mabTypeDigest(RedisModuleDigest *md, void *value)
     mab_type_obj_t  *mabobj = (mab_type_obj_t *)value;
     int             i;
 
+    if(mab_type_obj_materialize(mabobj) != 0){
+        RedisModule_DigestAddStringBuffer(md, mabobj->blob, mabobj->bloblen);
+        RedisModule_DigestEndSequence(md);
+        return;
+    }
+
     for(i = 0; i < mabobj->choice_num; i++){
         RedisModule_DigestAddStringBuffer(md, mabobj->choices[i]->data, mabobj->choices[i]->len);
     }
     RedisModule_DigestAddLongLong(md, mabobj->choice_num);
 
     multi_arm_t     *ma = mabobj->ma;
+    uint64_t        count;
+    double          reward;
     for(i = 0; i < ma->len; i++){
-        RedisModule_DigestAddLongLong(md, ma->arms[i].count);
+        multi_arm_get_arm(ma, i, &count, &reward);
+        RedisModule_DigestAddLongLong(md, count);
     }
     RedisModule_DigestAddLongLong(md, ma->len);
 
@@ -530,16 +3667,21 @@ mabTypeMemUsage(const void *value)
     size_t          ret = 0;
     int             i;
 
-    //size of choices;
+    if(mabobj->blob && mabobj->shared == NULL){
+        return sizeof(*mabobj) + mabobj->bloblen;
+    }
+
+    //size of choices, a share of them if they are shared
+    ret += sizeof(sstr_t *) * mabobj->choice_num;
     for(i = 0; i < mabobj->choice_num; i++){
         ret += sizeof(sstr_t) + mabobj->choices[i]->len;
     }
-
-    //size of ma
-    for(i = 0; i < ma->len; i++){
-        ret += sizeof(ma->arms[i]);
+    if(mabobj->shared){
+        ret /= __atomic_load_n(&mabobj->shared->refs, __ATOMIC_RELAXED);
     }
-    ret += sizeof(*ma);
+
+    //size of ma, or of its serialized form once folded
+    ret += mabobj->blob ? mabobj->bloblen : multi_arm_mem_usage(ma);
 
     ret += sizeof(*mabobj);
 
@@ -550,16 +3692,18 @@ static void
 mabTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value)
 {
     mab_type_obj_t  *mabobj = value;
-    arm_t           *arms = mabobj->ma->arms;
-    char            reward_str[128];
-    int             i, len = mabobj->ma->len;
-
-    for(i = 0; i < len; i++){
-        //redis does not support double format specifier. convert to string
-        snprintf(reward_str, sizeof(reward_str), "%.4f", arms[i].reward);
+    multi_arm_buf_t b = {NULL, 0, 0};
 
-        RedisModule_EmitAOF(aof, "mab.config", "sllc", key, i, arms[i].count, reward_str);
+    //the whole bandit as mab.restore takes it, never accessed ones as loaded
+    if(mabobj->blob && mabobj->shared == NULL){
+        RedisModule_EmitAOF(aof, "mab.restore", "sb", key, (char *)mabobj->blob,
+                mabobj->bloblen);
+        return;
     }
+
+    mab_type_obj_dump(mabobj, &b);
+    RedisModule_EmitAOF(aof, "mab.restore", "sb", key, (char *)b.data, b.len);
+    multi_arm_buf_free(&b);
 }
 
 static sstr_t **
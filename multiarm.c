@@ -1,7 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <math.h>
 #include <time.h>
 #include <errno.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -11,9 +15,16 @@
 #include "log.h"
 
 #define UNUSED(p) ((void)p)
+#define ARM_ELIGIBLE(mask, i) ((mask) == NULL || MULTI_ARM_MASK_TEST(mask, i))
+
+/* statistics the policies choose on, windowed ones if the window asks so */
+#define WINDOWED(ma)        ((ma)->window != NULL && (ma)->window->policy)
+#define ARM_COUNT(ma, i)    (WINDOWED(ma) ? (ma)->window->sums[i].count : (ma)->arms[i].count)
+#define ARM_REWARD(ma, i)   (WINDOWED(ma) ? (ma)->window->sums[i].reward : (ma)->arms[i].reward)
+#define TOTAL_COUNT(ma)     (WINDOWED(ma) ? (ma)->window->total : (ma)->total_count)
 #define PRINTF(fmt, ...) do{                            \
     len = snprintf(obuf, maxlen, fmt, ##__VA_ARGS__);   \
-    if(maxlen < len){                                   \
+    if(len >= maxlen){                                  \
         return 1;                                       \
     }                                                   \
     maxlen -= len;                                      \
@@ -30,16 +41,20 @@ extern double  Exponential_Variate_Inversion(void);
 
 typedef void *  (*policy_new)(multi_arm_t *, const char *option);
 typedef void    (*policy_free)(policy_t *);
-typedef void *  (*policy_choice)(policy_t *, multi_arm_t *, int *idx);
+typedef void *  (*policy_choice)(policy_t *, multi_arm_t *, const uint64_t *mask, int *idx);
 typedef int     (*policy_reward)(policy_t *, multi_arm_t *, int idx, double reward);
+typedef void    (*policy_reward_agg)(policy_t *, multi_arm_t *, int idx, uint64_t trials,
+        double reward, uint64_t wins);    /* checked by multi_arm_reward_agg */
 typedef int     (*policy_stat_json)(policy_t *, char *obuf, size_t maxlen); /* return a "key": val pair*/
+typedef void    (*policy_add_arm)(policy_t *, multi_arm_t *);   /* arm m->len - 1 was appended */
+typedef void    (*policy_del_arm)(policy_t *, multi_arm_t *, int idx); /* arm idx is about to be removed */
+typedef size_t  (*policy_mem_usage)(policy_t *, multi_arm_t *);
+typedef void    (*policy_dump)(policy_t *, multi_arm_buf_t *);
+typedef void *  (*policy_restore)(policy_t *, multi_arm_t *, multi_arm_reader_t *); /* return data */
 
 #ifdef MABREDIS_MODULE
 typedef struct RedisModuleIO RedisModuleIO;
 
-extern void (*RedisModule_SaveUnsigned)(RedisModuleIO *io, uint64_t value);
-extern void (*RedisModule_SaveDouble)(RedisModuleIO *io, double value);
-extern void (*RedisModule_SaveStringBuffer)(RedisModuleIO *io, const char *str, size_t len);
 extern uint64_t (*RedisModule_LoadUnsigned)(RedisModuleIO *io);
 extern double (*RedisModule_LoadDouble)(RedisModuleIO *io);
 extern char *(*RedisModule_LoadStringBuffer)(RedisModuleIO *io, size_t *lenptr);
@@ -47,7 +62,7 @@ extern void (*RedisModule_Free)(void *ptr);
 extern void (*RedisModule_LogIOError)(RedisModuleIO *io, const char *levelstr, const char *fmt, ...);
 
 
-typedef void    (*policy_rdb_save)(policy_t *, RedisModuleIO *); 
+/* loader of the legacy rdb encodings */
 typedef void *  (*policy_rdb_load)(policy_t *, RedisModuleIO *);
 #endif
 
@@ -56,37 +71,53 @@ struct policy_op_s{
     policy_free         free;
     policy_choice       choice;
     policy_reward       reward;
+    policy_reward_agg   agg;
     policy_stat_json    sj;
+    policy_add_arm      add;
+    policy_del_arm      del;
+    policy_mem_usage    mem;
+    policy_dump         dump;
+    policy_restore      restore;
 
 #ifdef MABREDIS_MODULE
-    policy_rdb_save save;
     policy_rdb_load load;
 #endif
 };
 
-static void * policy_ucb1_choice(policy_t *, multi_arm_t *mab, int *idx);
+static void * policy_ucb1_choice(policy_t *, multi_arm_t *mab, const uint64_t *mask, int *idx);
 static int    policy_ucb1_reward(policy_t *, multi_arm_t *mab, int idx, double);
+static void   policy_ucb1_reward_agg(policy_t *, multi_arm_t *, int idx, uint64_t, double, uint64_t);
 static policy_op_t policy_ucb1 = {
     .new = NULL,
     .free = NULL,
     .choice = policy_ucb1_choice, 
     .reward = policy_ucb1_reward,
+    .agg = policy_ucb1_reward_agg,
     .sj = NULL,
+    .add = NULL,
+    .del = NULL,
+    .mem = NULL,
+    .dump = NULL,
+    .restore = NULL,
 
 #ifdef MABREDIS_MODULE
-    .save = NULL,
     .load = NULL,
 #endif
 };
 
 static void * policy_egreedy_new(multi_arm_t *, const char *option);
 static void   policy_egreedy_free(policy_t *);
-static void * policy_egreedy_choice(policy_t *, multi_arm_t *, int *idx);
+static void * policy_egreedy_choice(policy_t *, multi_arm_t *, const uint64_t *mask, int *idx);
 #define policy_egreedy_reward policy_ucb1_reward
+#define policy_egreedy_reward_agg policy_ucb1_reward_agg
 static int    policy_egreedy_stat_json(policy_t *, char *, size_t maxlen);
+static size_t policy_egreedy_mem_usage(policy_t *, multi_arm_t *);
+static void   policy_egreedy_dump(policy_t *, multi_arm_buf_t *);
+static void * policy_egreedy_restore(policy_t *, multi_arm_t *, multi_arm_reader_t *);
+static int    egreedy_greedy(multi_arm_t *, const uint64_t *mask);
+static int    count_eligible(multi_arm_t *, const uint64_t *mask);
 
 #ifdef MABREDIS_MODULE
-static void   policy_egreedy_save(policy_t *, RedisModuleIO *);
 static void * policy_egreedy_load(policy_t *, RedisModuleIO *);
 #endif
 static policy_op_t policy_egreedy = {
@@ -94,10 +125,15 @@ static policy_op_t policy_egreedy = {
     .free = policy_egreedy_free,
     .choice = policy_egreedy_choice,
     .reward = policy_egreedy_reward,
+    .agg = policy_egreedy_reward_agg,
     .sj = policy_egreedy_stat_json,
+    .add = NULL,
+    .del = NULL,
+    .mem = policy_egreedy_mem_usage,
+    .dump = policy_egreedy_dump,
+    .restore = policy_egreedy_restore,
 
 #ifdef MABREDIS_MODULE
-    .save = policy_egreedy_save,
     .load = policy_egreedy_load,
 #endif
 };
@@ -113,18 +149,25 @@ typedef struct alpha_beta_s alpha_beta_t;
 
 struct policy_ts_data_s {
     int    len;
+    int    cap;
     alpha_beta_t    *arms;
 };
 typedef struct policy_ts_data_s policy_ts_data_t;
 
 static void * policy_ts_new(multi_arm_t *, const char * option);
 static void   policy_ts_free(policy_t *);
-static void * policy_ts_choice(policy_t *, multi_arm_t *, int *idx);
+static void * policy_ts_choice(policy_t *, multi_arm_t *, const uint64_t *mask, int *idx);
 static int    policy_ts_reward(policy_t *, multi_arm_t *, int idx, double reward);
+static void   policy_ts_reward_agg(policy_t *, multi_arm_t *, int idx, uint64_t, double, uint64_t);
 static int    policy_ts_json(policy_t *, char *obuf, size_t maxlen);
+static int    ts_posterior(multi_arm_t *, const uint64_t *mask, int idx, multi_arm_beta_t *, int max);
+static void   policy_ts_add_arm(policy_t *, multi_arm_t *);
+static void   policy_ts_del_arm(policy_t *, multi_arm_t *, int idx);
+static size_t policy_ts_mem_usage(policy_t *, multi_arm_t *);
+static void   policy_ts_dump(policy_t *, multi_arm_buf_t *);
+static void * policy_ts_restore(policy_t *, multi_arm_t *, multi_arm_reader_t *);
 
 #ifdef MABREDIS_MODULE
-static void     policy_ts_save(policy_t *, RedisModuleIO *);
 static void *   policy_ts_load(policy_t* , RedisModuleIO *);
 #endif
 
@@ -133,14 +176,232 @@ static policy_op_t policy_ts = {
     .free = policy_ts_free,
     .choice = policy_ts_choice,
     .reward = policy_ts_reward,
+    .agg = policy_ts_reward_agg,
     .sj = policy_ts_json,
+    .add = policy_ts_add_arm,
+    .del = policy_ts_del_arm,
+    .mem = policy_ts_mem_usage,
+    .dump = policy_ts_dump,
+    .restore = policy_ts_restore,
 
 #ifdef MABREDIS_MODULE
-    .save = policy_ts_save,
     .load = policy_ts_load,
 #endif
 };
 
+/*
+ * hierarchical thompson sampling. the arms are the leaves of an implicit
+ * complete tree of branching factor b and depth d (the smallest d >= 1 with
+ * b^d >= len). every inner node holds the win/lose of the child with the
+ * best posterior mean, so the best arm of a subtree speaks for it. a choice
+ * samples beta(1 + win, 1 + lose) over the children of one node per level
+ * and descends into the best sample, a reward updates the leaf and
+ * refreshes its ancestors. both cost O(b * d) instead of O(len).
+ */
+#define HTREE_DEFAULT_BRANCHING     16
+#define HTREE_MAX_BRANCHING         256
+
+struct policy_htree_data_s {
+    int             b;
+    int             depth;
+    int             len;
+    int             cap;
+    alpha_beta_t    *leaves;    /* observed wins/loses of every arm, no prior */
+
+    /* inner levels 0 .. depth - 1, level l starts at (b^l - 1) / (b - 1) */
+    alpha_beta_t    *nodes;
+    size_t          nnodes;
+};
+typedef struct policy_htree_data_s policy_htree_data_t;
+
+static void * policy_htree_new(multi_arm_t *, const char *option);
+static void   policy_htree_free(policy_t *);
+static void * policy_htree_choice(policy_t *, multi_arm_t *, const uint64_t *mask, int *idx);
+static int    htree_posterior(multi_arm_t *, const uint64_t *mask, int idx, multi_arm_beta_t *, int max);
+static int    policy_htree_reward(policy_t *, multi_arm_t *, int idx, double reward);
+static void   policy_htree_reward_agg(policy_t *, multi_arm_t *, int idx, uint64_t, double, uint64_t);
+static int    policy_htree_json(policy_t *, char *obuf, size_t maxlen);
+static void   policy_htree_add_arm(policy_t *, multi_arm_t *);
+static void   policy_htree_del_arm(policy_t *, multi_arm_t *, int idx);
+static size_t policy_htree_mem_usage(policy_t *, multi_arm_t *);
+static void   policy_htree_dump(policy_t *, multi_arm_buf_t *);
+static void * policy_htree_restore(policy_t *, multi_arm_t *, multi_arm_reader_t *);
+
+static policy_op_t policy_htree = {
+    .new = policy_htree_new,
+    .free = policy_htree_free,
+    .choice = policy_htree_choice,
+    .reward = policy_htree_reward,
+    .agg = policy_htree_reward_agg,
+    .sj = policy_htree_json,
+    .add = policy_htree_add_arm,
+    .del = policy_htree_del_arm,
+    .mem = policy_htree_mem_usage,
+    .dump = policy_htree_dump,
+    .restore = policy_htree_restore,
+
+#ifdef MABREDIS_MODULE
+    .load = NULL,   /* not in the legacy encodings */
+#endif
+};
+
+/*
+ * kl-ucb for rewards in [0, 1]. the bound of an arm is the largest q with
+ * count * kl(mean, q) <= log(total). solving it is the costly part so every
+ * arm caches its bound together with the count/reward it was computed from,
+ * a reward or any other change of the statistics recomputes that arm only.
+ * all bounds are refreshed when log(total) moved by more than the tolerance
+ * (relative) since the last refresh, which happens O(log(log(total)) / tol)
+ * times. a choice is a max over the cached bounds.
+ */
+#define KLUCB_DEFAULT_TOLERANCE     0.01
+
+struct klucb_bound_s {
+    uint64_t    count;
+    double      reward;
+    double      bound;
+};
+typedef struct klucb_bound_s klucb_bound_t;
+
+struct policy_klucb_data_s {
+    double          tol;
+    double          lt;         /* log(total) the bounds were computed with */
+    int             len;
+    int             cap;
+    klucb_bound_t   *arms;
+};
+typedef struct policy_klucb_data_s policy_klucb_data_t;
+
+static void * policy_klucb_new(multi_arm_t *, const char *option);
+static void   policy_klucb_free(policy_t *);
+static void * policy_klucb_choice(policy_t *, multi_arm_t *, const uint64_t *mask, int *idx);
+static int    policy_klucb_reward(policy_t *, multi_arm_t *, int idx, double reward);
+static void   policy_klucb_reward_agg(policy_t *, multi_arm_t *, int idx, uint64_t, double, uint64_t);
+static int    policy_klucb_json(policy_t *, char *obuf, size_t maxlen);
+static void   policy_klucb_add_arm(policy_t *, multi_arm_t *);
+static void   policy_klucb_del_arm(policy_t *, multi_arm_t *, int idx);
+static size_t policy_klucb_mem_usage(policy_t *, multi_arm_t *);
+static void   policy_klucb_dump(policy_t *, multi_arm_buf_t *);
+static void * policy_klucb_restore(policy_t *, multi_arm_t *, multi_arm_reader_t *);
+
+static policy_op_t policy_klucb = {
+    .new = policy_klucb_new,
+    .free = policy_klucb_free,
+    .choice = policy_klucb_choice,
+    .reward = policy_klucb_reward,
+    .agg = policy_klucb_reward_agg,
+    .sj = policy_klucb_json,
+    .add = policy_klucb_add_arm,
+    .del = policy_klucb_del_arm,
+    .mem = policy_klucb_mem_usage,
+    .dump = policy_klucb_dump,
+    .restore = policy_klucb_restore,
+
+#ifdef MABREDIS_MODULE
+    .load = NULL,   /* not in the legacy encodings */
+#endif
+};
+
+/*
+ * sliding window. every arm owns a ring of nbuckets buckets of span ms,
+ * the ring of arm i is buckets[i * nbuckets, (i + 1) * nbuckets). all rings
+ * rotate together, bucket pos holds epoch head (clock / span). sums are
+ * the running totals of every ring.
+ */
+struct window_bucket_s {
+    uint64_t    count;
+    uint64_t    win;
+    double      reward;
+};
+typedef struct window_bucket_s window_bucket_t;
+
+struct window_sum_s {
+    uint64_t    count;
+    uint64_t    win;
+    double      reward;
+};
+typedef struct window_sum_s window_sum_t;
+
+struct multi_arm_window_s {
+    uint64_t        span;
+    uint64_t        head;
+    int             nbuckets;
+    int             pos;
+    int             policy;
+
+    uint64_t        total;
+    window_bucket_t *buckets;
+    window_sum_t    *sums;
+};
+
+static void window_advance(multi_arm_t *);
+static void window_reward(multi_arm_t *, int idx, uint64_t trials, double reward, uint64_t wins);
+static void window_add_arm(multi_arm_t *);
+static void window_del_arm(multi_arm_t *, int idx);
+static void window_free(multi_arm_window_t *);
+
+/*
+ * convergence detector. every FREEZE_PERIOD rewards the best arm by mean
+ * must have its lower confidence bound above the upper bound of every other
+ * arm (normal approximation, FREEZE_Z standard deviations, every arm pulled
+ * FREEZE_MIN_COUNT times at least). while that holds the bandit is frozen:
+ * a choice takes the cached best arm in O(1), only a share explore of the
+ * choices still runs the policy and keeps feeding the other arms
+ */
+#define FREEZE_Z            3.0
+#define FREEZE_MIN_COUNT    30
+#define FREEZE_PERIOD(ma)   ((ma)->len * 4 > 256 ? (uint64_t)(ma)->len * 4 : 256)
+
+struct multi_arm_freeze_s {
+    double      explore;
+    int         frozen;
+    int         best;
+    uint64_t    rewards;    /* since the last check */
+};
+
+static void freeze_check(multi_arm_t *);
+
+/*
+ * compact encoding. a bandit of at most SMALL_MAX_ARMS arms and
+ * SMALL_MAX_COUNT rewards keeps its statistics in one packed blob of
+ * small_arm_t (the win/lose pair only for thompsen) instead of arm_t plus
+ * the policy arrays. the choice of arm i is read from the owner's choices
+ * array, so only bandits which have one are compacted. the reward sum is
+ * 16.16 fixed point rounded to nearest, every reward or overwrite of a
+ * small bandit moves its sum by at most 2^-17 from the exact value. the
+ * policies run on a view unpacked on the stack.
+ */
+#define SMALL_MAX_ARMS      8
+#define SMALL_MAX_COUNT     65535
+#define SMALL_FIXED_ONE     65536.0
+
+struct small_arm_s {
+    uint32_t    count;
+    uint32_t    reward;
+    uint32_t    win;
+    uint32_t    lose;
+};
+typedef struct small_arm_s small_arm_t;
+
+struct small_view_s {
+    multi_arm_t         ma;
+    arm_t               arms[SMALL_MAX_ARMS];
+    alpha_beta_t        ab[SMALL_MAX_ARMS];
+    policy_ts_data_t    ts;
+};
+typedef struct small_view_s small_view_t;
+
+#define SMALL_STRIDE(ma)    ((ma)->policy.op == &policy_ts ? sizeof(small_arm_t) : \
+        offsetof(small_arm_t, win))
+#define SMALL_ARM(ma, i)    ((small_arm_t *)((ma)->small + SMALL_STRIDE(ma) * (i)))
+
+static void small_unpack(multi_arm_t *, small_view_t *);
+static int  small_pack(multi_arm_t *, small_view_t *);
+static int  small_compact(multi_arm_t *);
+static void small_expand(multi_arm_t *);
+static void small_expand_view(multi_arm_t *, small_view_t *);
+static void small_free(multi_arm_t *);
+
 struct policy_elem_s {
     const char      *name;
     policy_op_t     *op;
@@ -150,7 +411,9 @@ typedef struct policy_elem_s policy_elem_t;
 static policy_elem_t policies[] = {
     {"ucb1", &policy_ucb1},
     {"egreedy", &policy_egreedy},
-    {"thompsen", &policy_ts}
+    {"thompsen", &policy_ts},
+    {"htree", &policy_htree},
+    {"klucb", &policy_klucb}
 };
 static int policy_init(multi_arm_t *, const char *policy, policy_t *dst, const char *option);
 
@@ -158,6 +421,48 @@ static malloc_ptr  _malloc = malloc;
 static free_ptr    _free = free;
 static realloc_ptr _realloc = realloc;
 
+/*
+ * resize an array of *cap elements so that it holds need elements. the
+ * capacity doubles on growth and halves once less than a quarter is used,
+ * so a sequence of add/del costs amortized O(1) reallocs
+ */
+static void *
+array_fit(void *p, int *cap, int need, size_t size)
+{
+    int     ncap = *cap;
+
+    if(need > ncap){
+        ncap = ncap * 2 > need ? ncap * 2 : need;
+    }else if(need < ncap / 4){
+        ncap = ncap / 2;
+    }else{
+        return p;
+    }
+
+    p = _realloc(p, size * ncap);
+    if(p == NULL){
+        log_error("process run out of memory");
+        exit(1);
+    }
+    *cap = ncap;
+    return p;
+}
+
+static uint64_t
+default_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t     (*_clock)(void) = default_clock;
+
+/* thompson beta draws above this count use the normal tier, 0 is off */
+static double       ts_normal_min = MULTI_ARM_TS_NORMAL_DEFAULT;
+static inline double ts_beta_variate(double a, double b);
+
 static void useless_init(unsigned long seed){
     UNUSED(seed);
 }
@@ -186,6 +491,18 @@ multi_arm_init(malloc_ptr m, free_ptr f, realloc_ptr r)
     return 0;
 }
 
+void
+multi_arm_set_clock(uint64_t (*clock)(void))
+{
+    _clock = clock ? clock : default_clock;
+}
+
+void
+multi_arm_set_ts_normal(uint64_t min_count)
+{
+    ts_normal_min = (double)min_count;
+}
+
 multi_arm_t *
 multi_arm_new(const char *policy, void **choices, int len, const char *option)
 {
@@ -207,10 +524,17 @@ multi_arm_new(const char *policy, void **choices, int len, const char *option)
         ret->arms[i].reward = 0.0;
         ret->arms[i].choice = choices[i];
     }
+    ret->choices = choices;
     ret->len = len;
+    ret->cap = len;
     ret->total_count = 0;
+    ret->window = NULL;
+    ret->freeze = NULL;
+
+    ret->small = NULL;
 
     if(policy_init(ret, policy, &ret->policy, option) == 0){
+        small_compact(ret);
         return ret;
     }
 
@@ -222,10 +546,21 @@ multi_arm_new(const char *policy, void **choices, int len, const char *option)
 void
 multi_arm_free(multi_arm_t *arm)
 {
+    if(arm->small){
+        small_free(arm);
+        _free(arm);
+        return;
+    }
+
     if(arm->policy.op->free != NULL){
         arm->policy.op->free(&arm->policy);
     }
 
+    if(arm->window){
+        window_free(arm->window);
+    }
+    _free(arm->freeze);
+
     _free(arm->arms);
     _free(arm);
 }
@@ -233,257 +568,1665 @@ multi_arm_free(multi_arm_t *arm)
 void *
 multi_arm_choice(multi_arm_t *mab, int *idx)
 {
-    return mab->policy.op->choice(&mab->policy, mab, idx);
+    return multi_arm_choice_masked(mab, NULL, idx);
 }
 
+void *
+multi_arm_choice_masked(multi_arm_t *mab, const uint64_t *mask, int *idx)
+{
+    small_view_t    v;
 
-int
-multi_arm_reward(multi_arm_t *mab, int idx, double reward)
+    if(mab->small){
+        small_unpack(mab, &v);
+        return v.ma.policy.op->choice(&v.ma.policy, &v.ma, mask, idx);
+    }
+
+    if(WINDOWED(mab)){
+        window_advance(mab);
+    }
+
+    //the explore share and a masked out best arm go through the policy
+    if(mab->freeze && mab->freeze->frozen && ARM_ELIGIBLE(mask, mab->freeze->best) &&
+            randnumber() >= mab->freeze->explore){
+        *idx = mab->freeze->best;
+        return mab->arms[*idx].choice;
+    }
+    return mab->policy.op->choice(&mab->policy, mab, mask, idx);
+}
+
+double
+multi_arm_propensity(multi_arm_t *mab, const uint64_t *mask, int idx)
 {
-    if(idx > mab->len - 1 || idx < 0){
-        return 1;
+    small_view_t    v;
+    multi_arm_t     *ma = mab;
+    double          p, explore = 1.0, epsilon;
+    int             j;
+
+    if(mab->small){
+        small_unpack(mab, &v);
+        ma = &v.ma;
+    }else if(mab->freeze && mab->freeze->frozen && ARM_ELIGIBLE(mask, mab->freeze->best)){
+        explore = mab->freeze->explore;
     }
 
-    int ret = mab->policy.op->reward(&mab->policy,
-            mab, idx, reward);
+    if(ma->policy.op == &policy_ts || ma->policy.op == &policy_htree){
+        return -1.0;
+    }
 
-    if(ret){
-        return ret;
+    if(ma->policy.op == &policy_egreedy){
+        epsilon = TOTAL_COUNT(ma) == 0 ? 1.0 : *((double *)ma->policy.data);
+        p = epsilon / count_eligible(ma, mask) +
+            (egreedy_greedy(ma, mask) == idx ? 1.0 - epsilon : 0.0);
+    }else{
+        //ucb1 and klucb choose the same arm until the next reward
+        ma->policy.op->choice(&ma->policy, ma, mask, &j);
+        p = j == idx ? 1.0 : 0.0;
     }
 
-    mab->total_count++;
-    return ret;
+    p *= explore;
+    if(explore < 1.0 && idx == mab->freeze->best){
+        p += 1.0 - explore;
+    }
+    return p;
 }
 
-
 int
-multi_arm_stat_json(multi_arm_t *ma, char *obuf, size_t maxlen)
+multi_arm_posterior(multi_arm_t *mab, const uint64_t *mask, int idx,
+        multi_arm_beta_t *out, int max, double *share, double *fixed)
 {
-    size_t     len;
-#define FMT "{\"count\": %lu, \"reward\": %f}"
-
-    PRINTF("{\"total_count\": %lu, \"arms\": [", ma->total_count);
-    const char  *fmt;
-    int         i;
-    for(i = 0; i < ma->len; i++){
-        if(i + 1 == ma->len){
-            fmt = FMT;
-        }else{
-            fmt = FMT",";
-        }
+    small_view_t    v;
+    multi_arm_t     *ma = mab;
+
+    *share = 1.0;
+    *fixed = 0.0;
+    if(mab->small){
+        small_unpack(mab, &v);
+        ma = &v.ma;
+    }else if(mab->freeze && mab->freeze->frozen && ARM_ELIGIBLE(mask, mab->freeze->best)){
+        *share = mab->freeze->explore;
+        *fixed = idx == mab->freeze->best ? 1.0 - *share : 0.0;
+    }
 
-        PRINTF(fmt, ma->arms[i].count, ma->arms[i].reward);
+    if(ma->policy.op == &policy_ts){
+        return ts_posterior(ma, mask, idx, out, max);
     }
-    PRINTF("], ");
-    
-    if(ma->policy.op->sj){
-        len = ma->policy.op->sj(&ma->policy, obuf, maxlen);
-        if(maxlen < len){
-            return 1;
-        }
-        maxlen -= len;
-        obuf += len;
-    }else{
-        PRINTF("\"policy\": \"%s\"", ma->policy.name);
+    if(ma->policy.op == &policy_htree){
+        return htree_posterior(ma, mask, idx, out, max);
     }
-    PRINTF("}");
-#undef FMT
-
     return 0;
 }
 
-#ifdef MABREDIS_MODULE
-void
-multi_arm_rdb_save(multi_arm_t *ma, struct RedisModuleIO *rdb)
+double
+multi_arm_posterior_propensity(const multi_arm_beta_t *out, int n, int draws)
 {
-    //save multi_arm_t arms
-    RedisModule_SaveUnsigned(rdb, ma->len);
+    double  p = 1.0, x, maxp;
+    int     first, last, i, d, wins, best;
 
-    int i;
-    for(i = 0; i < ma->len; i++){
-        RedisModule_SaveUnsigned(rdb, ma->arms[i].count);
-        RedisModule_SaveDouble(rdb, ma->arms[i].reward);
+    if(draws <= 0){
+        return 0.0;
     }
 
-    RedisModule_SaveUnsigned(rdb, ma->total_count);
-
-    RedisModule_SaveStringBuffer(rdb, ma->policy.name,
-            strlen(ma->policy.name));
-    if(ma->policy.op->save){
-        ma->policy.op->save(&ma->policy, rdb);
+    for(first = 0; first < n; first = last){
+        for(last = first + 1; last < n && out[last].level == out[first].level; last++);
+
+        wins = 0;
+        for(d = 0; d < draws; d++){
+            best = -1;
+            maxp = -1.0;
+            for(i = first; i < last; i++){
+                x = ts_beta_variate(out[i].alpha, out[i].beta);
+                if(x > maxp){
+                    maxp = x;
+                    best = i;
+                }
+            }
+            wins += out[best].chosen;
+        }
+        p *= (double)wins / draws;
     }
+    return p;
 }
 
-multi_arm_t *
-multi_arm_rdb_load(struct RedisModuleIO  *rdb, int encv)
-{
-    (void)encv;
-    multi_arm_t     *ma = _malloc(sizeof(*ma));
-    int             i;
 
-    ma->len = RedisModule_LoadUnsigned(rdb);
-    ma->arms = _malloc(ma->len * sizeof(arm_t));
-    for(i = 0; i < ma->len; i++){
-        ma->arms[i].count = RedisModule_LoadUnsigned(rdb);
-        ma->arms[i].reward = RedisModule_LoadDouble(rdb);
+int
+multi_arm_reward(multi_arm_t *mab, int idx, double reward)
+{
+    if(idx > mab->len - 1 || idx < 0){
+        return 1;
     }
 
-    ma->total_count = RedisModule_LoadUnsigned(rdb);
+    if(mab->small){
+        small_view_t    v;
 
-    size_t  policy_len;
-    char    *policy = RedisModule_LoadStringBuffer(rdb, &policy_len);
+        small_unpack(mab, &v);
+        if(v.ma.policy.op->reward(&v.ma.policy, &v.ma, idx, reward)){
+            return 1;
+        }
+        v.ma.total_count++;
 
-    for(i = 0; i < (int)(sizeof(policies)/sizeof(policies[0])); i++){
-        if(strlen(policies[i].name) == policy_len &&
-                strncmp(policies[i].name, policy, policy_len) == 0){
-            ma->policy.op = policies[i].op;
-            ma->policy.name = policies[i].name;
-            break;
+        if(small_pack(mab, &v) != 0){
+            //promote, the view holds the updated statistics
+            small_expand_view(mab, &v);
         }
+        return 0;
     }
 
-    if(i == sizeof(policies)/sizeof(policies[0])){
-        RedisModule_LogIOError(rdb, "warning", "unsupport multi_arm_policy %.*s", (int)policy_len, policy);
-        goto error;
-    }
+    int ret = mab->policy.op->reward(&mab->policy,
+            mab, idx, reward);
 
-    if(ma->policy.op->load){
-        ma->policy.data = ma->policy.op->load(&ma->policy, rdb);
-        if(ma->policy.data == NULL){
-            goto error;
-        }
-    }else{
-        ma->policy.data = NULL;
+    if(ret){
+        return ret;
     }
-    goto done;
 
-error:
-    _free(ma->arms);
-    _free(ma);
-    ma = NULL;
+    if(mab->window){
+        window_reward(mab, idx, 1, reward, reward != 0.0);
+    }
 
-done:
-    RedisModule_Free(policy);
-    return ma;
+    mab->total_count++;
+    if(mab->freeze && ++mab->freeze->rewards >= FREEZE_PERIOD(mab)){
+        freeze_check(mab);
+    }
+    return ret;
 }
-#endif
 
-static int
-policy_init(multi_arm_t *m, const char *policy, policy_t *dst, const char *option)
+int
+multi_arm_reward_agg(multi_arm_t *mab, int idx, uint64_t trials, double reward, uint64_t wins)
 {
-    int         i = 0, len = (int)(sizeof(policies)/sizeof(policies[0]));
-
-    for(i = 0; i < len; i++){
-        if(strcasecmp(policies[i].name, policy) == 0){
-            dst->op = policies[i].op;
-            dst->name = policies[i].name;
-            if(policies[i].op->new == NULL){
-                dst->data = NULL;
-            }else{
-                dst->data = policies[i].op->new(m, option);
-                if(dst->data == NULL){
-                    return 1;
-                }
-            }
-            return 0;
-        }
+    if(idx > mab->len - 1 || idx < 0 || trials == 0 || trials > UINT32_MAX ||
+            wins > trials || !(reward >= 0.0 && reward <= (double)trials)){
+        return 1;
     }
 
-    return 1;
-}
+    if(mab->small){
+        small_view_t    v;
 
+        small_unpack(mab, &v);
+        v.ma.policy.op->agg(&v.ma.policy, &v.ma, idx, trials, reward, wins);
+        v.ma.total_count += trials;
 
-static void *
-policy_ucb1_choice(policy_t *policy, multi_arm_t *ma, int *idx)
-{
-    (void)policy;
-    double  ucb_max = 0.0, ucb;
-    arm_t   *arm;
-    int     i, ridx = 0;
-    for(i = 0; i < ma->len; i++){
-        if(ma->arms[i].count == 0){
-            ridx = i;
-            goto find;
+        if(small_pack(mab, &v) != 0){
+            small_expand_view(mab, &v);
         }
+        return 0;
     }
 
-    for(i = 0; i < ma->len; i++){
-        arm = ma->arms + i;
-
-        ucb = (arm->reward / arm->count) + sqrt(2 * log(ma->total_count + 1) / arm->count);
-
-        if(ucb > ucb_max){
-            ucb_max = ucb;
-            ridx = i;
-        }
+    mab->policy.op->agg(&mab->policy, mab, idx, trials, reward, wins);
+    if(mab->window){
+        window_reward(mab, idx, trials, reward, wins);
     }
 
-find:
-    *idx = ridx;
-    return ma->arms[ridx].choice;
+    mab->total_count += trials;
+    if(mab->freeze && (mab->freeze->rewards += trials) >= FREEZE_PERIOD(mab)){
+        freeze_check(mab);
+    }
+    return 0;
 }
 
-static int
-policy_ucb1_reward(policy_t *policy, multi_arm_t *ma, int idx, double reward)
+int
+multi_arm_get_arm(multi_arm_t *mab, int idx, uint64_t *count, double *reward)
 {
-    (void)policy;
-    if(reward < 0 || reward > 1.0){
+    if(idx > mab->len - 1 || idx < 0){
         return 1;
     }
-    arm_t   *arm = ma->arms + idx;
 
-    arm->reward += reward;
-    arm->count++;
+    if(mab->small){
+        small_arm_t     *s = SMALL_ARM(mab, idx);
 
+        *count = s->count;
+        *reward = s->reward / SMALL_FIXED_ONE;
+    }else{
+        *count = mab->arms[idx].count;
+        *reward = mab->arms[idx].reward;
+    }
     return 0;
 }
 
-
-static void *
-policy_egreedy_new(multi_arm_t *m, const char *option)
+int
+multi_arm_set_arm(multi_arm_t *mab, int idx, uint64_t count, double reward)
 {
-    UNUSED(m);
-    
-    if(option == NULL){
-        return NULL;
+    if(idx > mab->len - 1 || idx < 0){
+        return 1;
     }
 
-    char    *eptr = NULL;
-    double  d = strtod(option, &eptr);
-    if(eptr == option || d < 0 || d > 1.00000000001){
-        printf("conver fail %s\n", eptr);
-        return NULL;
+    if(mab->small){
+        small_expand(mab);
     }
-
-    double  *ret = _malloc(sizeof(double));
-    *ret = d;
-    return (void *)ret;
+    mab->arms[idx].count = count;
+    mab->arms[idx].reward = reward;
+    if(mab->freeze){
+        freeze_check(mab);
+    }
+    small_compact(mab);
+    return 0;
 }
 
-
-static void
-policy_egreedy_free(policy_t *policy)
+void
+multi_arm_set_choices(multi_arm_t *mab, void **choices)
 {
-    _free(policy->data);
+    int     i;
+
+    mab->choices = choices;
+    if(mab->small == NULL){
+        for(i = 0; i < mab->len; i++){
+            mab->arms[i].choice = choices[i];
+        }
+        small_compact(mab);
+    }
 }
 
-static void *
-policy_egreedy_choice(policy_t *policy, multi_arm_t *ma, int *idx)
+int
+multi_arm_add_arm(multi_arm_t *mab, void *choice)
 {
-    double  r = randnumber(), epsilon = *((double *)policy->data);
-    int     i, ridx = -1;
-    if(r < epsilon || ma->total_count == 0){
-        i = randint(ma->len);
-        ridx = i;
-        goto find;
+    int     idx = mab->len;
+
+    if(mab->small){
+        small_expand(mab);
     }
 
-    double  max_avg = -0.1, avg;
-    for(i = 0; i < ma->len; i++){
-        if(ma->arms[i].count){
-            avg = ma->arms[i].reward / ma->arms[i].count;
-        }else{
-            avg = 0.0;
+    mab->arms = array_fit(mab->arms, &mab->cap, idx + 1, sizeof(arm_t));
+    mab->arms[idx].count = 0;
+    mab->arms[idx].reward = 0.0;
+    mab->arms[idx].choice = choice;
+    mab->len++;
+
+    if(mab->policy.op->add){
+        mab->policy.op->add(&mab->policy, mab);
+    }
+    if(mab->window){
+        window_add_arm(mab);
+    }
+    //the new arm has to be explored first
+    if(mab->freeze){
+        mab->freeze->frozen = 0;
+        mab->freeze->rewards = 0;
+    }
+    small_compact(mab);
+    return idx;
+}
+
+int
+multi_arm_del_arm(multi_arm_t *mab, int idx)
+{
+    if(idx > mab->len - 1 || idx < 0 || mab->len == 1){
+        return 1;
+    }
+
+    if(mab->small){
+        small_expand(mab);
+    }
+
+    if(mab->policy.op->del){
+        mab->policy.op->del(&mab->policy, mab, idx);
+    }
+    if(mab->window){
+        window_del_arm(mab, idx);
+    }
+
+    if(mab->total_count > mab->arms[idx].count){
+        mab->total_count -= mab->arms[idx].count;
+    }else{
+        mab->total_count = 0;
+    }
+
+    memmove(mab->arms + idx, mab->arms + idx + 1,
+            sizeof(arm_t) * (mab->len - idx - 1));
+    mab->len--;
+    mab->arms = array_fit(mab->arms, &mab->cap, mab->len, sizeof(arm_t));
+    if(mab->freeze){
+        freeze_check(mab);
+    }
+    small_compact(mab);
+    return 0;
+}
+
+int
+multi_arm_set_window(multi_arm_t *mab, uint64_t span_ms, int buckets, int policy)
+{
+    if(span_ms == 0 || buckets <= 0 || buckets > MULTI_ARM_WINDOW_MAX_BUCKETS){
+        return 1;
+    }
+    //the tree nodes hold lifetime counts, htree can not choose on a window
+    if(policy && mab->policy.op == &policy_htree){
+        return 1;
+    }
+
+    //windowed bandits are always full encoded
+    if(mab->small){
+        small_expand(mab);
+    }
+
+    multi_arm_window_t  *w = _malloc(sizeof(*w));
+    size_t              n = (size_t)mab->len * buckets;
+
+    w->span = span_ms;
+    w->head = _clock() / span_ms;
+    w->nbuckets = buckets;
+    w->pos = 0;
+    w->policy = policy;
+    w->total = 0;
+    w->buckets = _malloc(sizeof(window_bucket_t) * n);
+    w->sums = _malloc(sizeof(window_sum_t) * mab->len);
+    memset(w->buckets, 0, sizeof(window_bucket_t) * n);
+    memset(w->sums, 0, sizeof(window_sum_t) * mab->len);
+
+    if(mab->window){
+        window_free(mab->window);
+    }
+    mab->window = w;
+    return 0;
+}
+
+int
+multi_arm_set_freeze(multi_arm_t *mab, double explore)
+{
+    if(explore > 1.0 || explore != explore){
+        return 1;
+    }
+
+    if(explore < 0.0){
+        _free(mab->freeze);
+        mab->freeze = NULL;
+        small_compact(mab);
+        return 0;
+    }
+
+    //frozen bandits are always full encoded
+    if(mab->small){
+        small_expand(mab);
+    }
+    if(mab->freeze == NULL){
+        mab->freeze = _malloc(sizeof(*mab->freeze));
+        mab->freeze->frozen = 0;
+        mab->freeze->best = 0;
+    }
+    mab->freeze->explore = explore;
+    freeze_check(mab);
+    return 0;
+}
+
+int
+multi_arm_frozen(multi_arm_t *mab)
+{
+    return mab->freeze != NULL && mab->freeze->frozen;
+}
+
+/* half width of the confidence interval of the mean reward of arm i */
+static double
+freeze_width(multi_arm_t *ma, int i)
+{
+    double      n = (double)ARM_COUNT(ma, i);
+    double      p = (ARM_REWARD(ma, i) + 1.0) / (n + 2.0);
+
+    return FREEZE_Z * sqrt(p * (1.0 - p) / n);
+}
+
+static void
+freeze_check(multi_arm_t *ma)
+{
+    multi_arm_freeze_t  *f = ma->freeze;
+    double              mean, low, best_mean = -1.0;
+    int                 i, best = -1;
+
+    f->rewards = 0;
+    f->frozen = 0;
+    for(i = 0; i < ma->len; i++){
+        if(ARM_COUNT(ma, i) < FREEZE_MIN_COUNT){
+            return;
+        }
+        mean = ARM_REWARD(ma, i) / ARM_COUNT(ma, i);
+        if(mean > best_mean){
+            best_mean = mean;
+            best = i;
+        }
+    }
+
+    low = best_mean - freeze_width(ma, best);
+    for(i = 0; i < ma->len; i++){
+        if(i != best &&
+                ARM_REWARD(ma, i) / ARM_COUNT(ma, i) + freeze_width(ma, i) >= low){
+            return;
+        }
+    }
+    f->frozen = 1;
+    f->best = best;
+}
+
+static void
+window_free(multi_arm_window_t *w)
+{
+    _free(w->buckets);
+    _free(w->sums);
+    _free(w);
+}
+
+/*
+ * rotate the rings up to the current epoch. every expired bucket is
+ * subtracted from the running sums once, so the cost is amortized O(1)
+ * per bucket and arm
+ */
+static void
+window_advance(multi_arm_t *ma)
+{
+    multi_arm_window_t  *w = ma->window;
+    uint64_t            epoch = _clock() / w->span, k;
+    int                 i;
+
+    if(epoch <= w->head){
+        return;
+    }
+    k = epoch - w->head;
+    w->head = epoch;
+
+    if(k >= (uint64_t)w->nbuckets){
+        memset(w->buckets, 0, sizeof(window_bucket_t) * ma->len * w->nbuckets);
+        memset(w->sums, 0, sizeof(window_sum_t) * ma->len);
+        w->total = 0;
+        return;
+    }
+
+    for(; k > 0; k--){
+        w->pos = (w->pos + 1) % w->nbuckets;
+        for(i = 0; i < ma->len; i++){
+            window_bucket_t     *b = w->buckets + (size_t)i * w->nbuckets + w->pos;
+            window_sum_t        *sum = w->sums + i;
+
+            sum->count -= b->count;
+            sum->win -= b->win;
+            sum->reward = sum->count ? sum->reward - b->reward : 0.0;
+            w->total -= b->count;
+            memset(b, 0, sizeof(*b));
+        }
+    }
+}
+
+static void
+window_reward(multi_arm_t *ma, int idx, uint64_t trials, double reward, uint64_t wins)
+{
+    multi_arm_window_t  *w = ma->window;
+
+    window_advance(ma);
+
+    window_bucket_t     *b = w->buckets + (size_t)idx * w->nbuckets + w->pos;
+    window_sum_t        *sum = w->sums + idx;
+
+    b->count += trials;
+    b->win += wins;
+    b->reward += reward;
+    sum->count += trials;
+    sum->win += wins;
+    sum->reward += reward;
+    w->total += trials;
+}
+
+static void
+window_add_arm(multi_arm_t *ma)
+{
+    multi_arm_window_t  *w = ma->window;
+    int                 idx = ma->len - 1;
+
+    w->buckets = _realloc(w->buckets, sizeof(window_bucket_t) * ma->len * w->nbuckets);
+    w->sums = _realloc(w->sums, sizeof(window_sum_t) * ma->len);
+    memset(w->buckets + (size_t)idx * w->nbuckets, 0, sizeof(window_bucket_t) * w->nbuckets);
+    memset(w->sums + idx, 0, sizeof(window_sum_t));
+}
+
+/* called before ma->len is decreased */
+static void
+window_del_arm(multi_arm_t *ma, int idx)
+{
+    multi_arm_window_t  *w = ma->window;
+
+    w->total -= w->sums[idx].count;
+    memmove(w->buckets + (size_t)idx * w->nbuckets, w->buckets + (size_t)(idx + 1) * w->nbuckets,
+            sizeof(window_bucket_t) * w->nbuckets * (ma->len - idx - 1));
+    memmove(w->sums + idx, w->sums + idx + 1, sizeof(window_sum_t) * (ma->len - idx - 1));
+    w->buckets = _realloc(w->buckets, sizeof(window_bucket_t) * (ma->len - 1) * w->nbuckets);
+    w->sums = _realloc(w->sums, sizeof(window_sum_t) * (ma->len - 1));
+}
+
+/* policies the compact encoding can hold, thompsen keeps win/lose in it */
+static int
+small_supported(policy_op_t *op)
+{
+    return op == &policy_ucb1 || op == &policy_egreedy || op == &policy_ts;
+}
+
+static void
+small_unpack(multi_arm_t *ma, small_view_t *v)
+{
+    small_arm_t     *s;
+    int             i;
+
+    v->ma = *ma;
+    v->ma.arms = v->arms;
+    v->ma.cap = SMALL_MAX_ARMS;
+    v->ma.small = NULL;
+
+    for(i = 0; i < ma->len; i++){
+        s = SMALL_ARM(ma, i);
+        v->arms[i].count = s->count;
+        v->arms[i].reward = s->reward / SMALL_FIXED_ONE;
+        v->arms[i].choice = ma->choices[i];
+    }
+
+    if(ma->policy.op == &policy_ts){
+        for(i = 0; i < ma->len; i++){
+            s = SMALL_ARM(ma, i);
+            v->ab[i].win = s->win;
+            v->ab[i].lose = s->lose;
+        }
+        v->ts.len = ma->len;
+        v->ts.cap = SMALL_MAX_ARMS;
+        v->ts.arms = v->ab;
+        v->ma.policy.data = &v->ts;
+    }
+}
+
+/*
+ * encode the statistics of src into blob, blob laid out as ma. return
+ * nonzero if they do not fit
+ */
+static int
+small_encode(multi_arm_t *ma, uint8_t *blob, multi_arm_t *src)
+{
+    policy_ts_data_t    *ts = ma->policy.op == &policy_ts ? src->policy.data : NULL;
+    size_t              stride = SMALL_STRIDE(ma);
+    small_arm_t         *s;
+    double              fixed;
+    int                 i;
+
+    if(src->total_count > SMALL_MAX_COUNT){
+        return 1;
+    }
+
+    for(i = 0; i < src->len; i++){
+        fixed = floor(src->arms[i].reward * SMALL_FIXED_ONE + 0.5);
+        if(src->arms[i].count > SMALL_MAX_COUNT || fixed < 0.0 ||
+                fixed > SMALL_MAX_COUNT * SMALL_FIXED_ONE){
+            return 1;
+        }
+        if(ts && (ts->arms[i].win > UINT32_MAX || ts->arms[i].lose > UINT32_MAX)){
+            return 1;
+        }
+
+        s = (small_arm_t *)(blob + stride * i);
+        s->count = (uint32_t)src->arms[i].count;
+        s->reward = (uint32_t)fixed;
+        if(ts){
+            s->win = (uint32_t)ts->arms[i].win;
+            s->lose = (uint32_t)ts->arms[i].lose;
+        }
+    }
+    return 0;
+}
+
+/* write the view back, return nonzero if it no longer fits */
+static int
+small_pack(multi_arm_t *ma, small_view_t *v)
+{
+    if(small_encode(ma, ma->small, &v->ma) != 0){
+        return 1;
+    }
+    ma->total_count = v->ma.total_count;
+    return 0;
+}
+
+/* switch a full encoded bandit to the compact encoding if it fits */
+static int
+small_compact(multi_arm_t *ma)
+{
+    if(ma->small || ma->window || ma->freeze || ma->choices == NULL ||
+            ma->len > SMALL_MAX_ARMS || !small_supported(ma->policy.op)){
+        return 1;
+    }
+
+    uint8_t     *blob = _malloc(SMALL_STRIDE(ma) * ma->len);
+
+    if(small_encode(ma, blob, ma) != 0){
+        _free(blob);
+        return 1;
+    }
+
+    if(ma->policy.op == &policy_ts){
+        ma->policy.op->free(&ma->policy);
+        ma->policy.data = NULL;
+    }
+    _free(ma->arms);
+    ma->arms = NULL;
+    ma->cap = 0;
+    ma->small = blob;
+    return 0;
+}
+
+/* switch to the full encoding holding the statistics of view v */
+static void
+small_expand_view(multi_arm_t *ma, small_view_t *v)
+{
+    ma->arms = _malloc(sizeof(arm_t) * ma->len);
+    memcpy(ma->arms, v->arms, sizeof(arm_t) * ma->len);
+    ma->cap = ma->len;
+    ma->total_count = v->ma.total_count;
+
+    if(ma->policy.op == &policy_ts){
+        policy_ts_data_t    *data = _malloc(sizeof(*data));
+
+        data->arms = _malloc(sizeof(alpha_beta_t) * ma->len);
+        memcpy(data->arms, v->ab, sizeof(alpha_beta_t) * ma->len);
+        data->len = ma->len;
+        data->cap = ma->len;
+        ma->policy.data = data;
+    }
+
+    _free(ma->small);
+    ma->small = NULL;
+}
+
+static void
+small_expand(multi_arm_t *ma)
+{
+    small_view_t    v;
+
+    small_unpack(ma, &v);
+    small_expand_view(ma, &v);
+}
+
+static void
+small_free(multi_arm_t *ma)
+{
+    //thompsen has no policy data while small encoded
+    if(ma->policy.op != &policy_ts && ma->policy.op->free){
+        ma->policy.op->free(&ma->policy);
+    }
+    _free(ma->small);
+    ma->small = NULL;
+}
+
+/*
+ * concurrent bandit. shard s holds one cell per arm, a thread only writes
+ * the cells of shard (thread number & (nshards - 1)). every shard is a
+ * separate allocation with a cache line of padding on both sides, threads
+ * on different shards never write the same line. the cells are read with
+ * relaxed loads on choice, a merged view may miss the rewards in flight
+ */
+#define CONC_LINE   64
+
+struct conc_cell_s {
+    uint64_t    count;
+    uint64_t    win;
+    uint64_t    reward;     //bits of a double, updated by compare and swap
+};
+typedef struct conc_cell_s conc_cell_t;
+
+struct multi_arm_conc_s {
+    multi_arm_t     ma;     //choices and policy, the statistics live in the shards
+    int             nshards;
+    conc_cell_t     **shards;
+};
+
+static int                  conc_next_thread;
+static __thread int         conc_thread = -1;
+
+/* merged view of the calling thread, freed by the key destructor on thread exit */
+struct conc_view_s {
+    arm_t           *arms;
+    alpha_beta_t    *ab;
+    int             cap;
+};
+typedef struct conc_view_s conc_view_t;
+
+static pthread_once_t       conc_once = PTHREAD_ONCE_INIT;
+static pthread_key_t        conc_key;
+static __thread conc_view_t *conc_view;
+
+static void
+conc_view_free(void *p)
+{
+    conc_view_t     *view = (conc_view_t *)p;
+
+    _free(view->arms);
+    _free(view->ab);
+    _free(view);
+}
+
+static void
+conc_key_init(void)
+{
+    if(pthread_key_create(&conc_key, conc_view_free) != 0){
+        log_error("pthread_key_create fail");
+        exit(1);
+    }
+}
+
+multi_arm_conc_t *
+multi_arm_conc_new(const char *policy, void **choices, int len, const char *option, int shards)
+{
+    multi_arm_conc_t    *c;
+    size_t              bytes = sizeof(conc_cell_t) * len;
+    int                 i, n = 1;
+
+    if(len <= 0 || shards <= 0){
+        return NULL;
+    }
+    while(n < shards){
+        n <<= 1;
+    }
+
+    c = _malloc(sizeof(*c));
+    memset(&c->ma, 0, sizeof(c->ma));
+    c->ma.arms = _malloc(sizeof(arm_t) * len);
+    for(i = 0; i < len; i++){
+        c->ma.arms[i].count = 0;
+        c->ma.arms[i].reward = 0.0;
+        c->ma.arms[i].choice = choices[i];
+    }
+    c->ma.choices = choices;
+    c->ma.len = len;
+    c->ma.cap = len;
+
+    if(policy_init(&c->ma, policy, &c->ma.policy, option) != 0 ||
+            !small_supported(c->ma.policy.op)){
+        if(c->ma.policy.data && c->ma.policy.op->free){
+            c->ma.policy.op->free(&c->ma.policy);
+        }
+        _free(c->ma.arms);
+        _free(c);
+        return NULL;
+    }
+    //thompsen gets win/lose from the shards
+    if(c->ma.policy.op == &policy_ts){
+        c->ma.policy.op->free(&c->ma.policy);
+        c->ma.policy.data = NULL;
+    }
+
+    c->nshards = n;
+    c->shards = _malloc(sizeof(conc_cell_t *) * n);
+    for(i = 0; i < n; i++){
+        c->shards[i] = (conc_cell_t *)((char *)_malloc(bytes + 2 * CONC_LINE) + CONC_LINE);
+        memset(c->shards[i], 0, bytes);
+    }
+    return c;
+}
+
+void
+multi_arm_conc_free(multi_arm_conc_t *c)
+{
+    int     i;
+
+    for(i = 0; i < c->nshards; i++){
+        _free((char *)c->shards[i] - CONC_LINE);
+    }
+    _free(c->shards);
+    if(c->ma.policy.data && c->ma.policy.op->free){
+        c->ma.policy.op->free(&c->ma.policy);
+    }
+    _free(c->ma.arms);
+    _free(c);
+}
+
+int
+multi_arm_conc_reward(multi_arm_conc_t *c, int idx, double reward)
+{
+    conc_cell_t     *cell;
+    uint64_t        old, new;
+    double          d;
+
+    if(idx < 0 || idx >= c->ma.len || reward < 0 || reward > 1.0){
+        return 1;
+    }
+
+    if(conc_thread < 0){
+        conc_thread = __atomic_fetch_add(&conc_next_thread, 1, __ATOMIC_RELAXED) & 0x7fffffff;
+    }
+    cell = c->shards[conc_thread & (c->nshards - 1)] + idx;
+
+    __atomic_fetch_add(&cell->count, 1, __ATOMIC_RELAXED);
+    if(reward == 0.0){
+        return 0;
+    }
+    __atomic_fetch_add(&cell->win, 1, __ATOMIC_RELAXED);
+
+    old = __atomic_load_n(&cell->reward, __ATOMIC_RELAXED);
+    do{
+        memcpy(&d, &old, sizeof(d));
+        d += reward;
+        memcpy(&new, &d, sizeof(new));
+    }while(!__atomic_compare_exchange_n(&cell->reward, &old, new, 1,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/*
+ * sum the shards into the view of the calling thread. v is the bandit to
+ * run the policy on, ts its thompsen data
+ */
+static void
+conc_merge(multi_arm_conc_t *c, multi_arm_t *v, policy_ts_data_t *ts)
+{
+    conc_cell_t     *cell;
+    conc_view_t     *view = conc_view;
+    arm_t           *conc_arms;
+    alpha_beta_t    *conc_ab;
+    uint64_t        win, bits;
+    double          d;
+    int             i, s, len = c->ma.len;
+
+    if(view == NULL){
+        pthread_once(&conc_once, conc_key_init);
+        view = _malloc(sizeof(*view));
+        if(view == NULL){
+            log_error("process run out of memory");
+            exit(1);
+        }
+        memset(view, 0, sizeof(*view));
+        pthread_setspecific(conc_key, view);
+        conc_view = view;
+    }
+    if(view->cap < len){
+        view->arms = _realloc(view->arms, sizeof(arm_t) * len);
+        view->ab = _realloc(view->ab, sizeof(alpha_beta_t) * len);
+        if(view->arms == NULL || view->ab == NULL){
+            log_error("process run out of memory");
+            exit(1);
+        }
+        view->cap = len;
+    }
+    conc_arms = view->arms;
+    conc_ab = view->ab;
+
+    for(i = 0; i < len; i++){
+        conc_arms[i].count = 0;
+        conc_arms[i].reward = 0.0;
+        conc_arms[i].choice = c->ma.arms[i].choice;
+        conc_ab[i].win = 0;
+    }
+    for(s = 0; s < c->nshards; s++){
+        for(i = 0, cell = c->shards[s]; i < len; i++, cell++){
+            //win before count, the writer adds them the other way around
+            conc_ab[i].win += __atomic_load_n(&cell->win, __ATOMIC_RELAXED);
+            conc_arms[i].count += __atomic_load_n(&cell->count, __ATOMIC_RELAXED);
+            bits = __atomic_load_n(&cell->reward, __ATOMIC_RELAXED);
+            memcpy(&d, &bits, sizeof(d));
+            conc_arms[i].reward += d;
+        }
+    }
+
+    *v = c->ma;
+    v->arms = conc_arms;
+    v->cap = view->cap;
+    v->total_count = 0;
+    for(i = 0; i < len; i++){
+        win = conc_ab[i].win;
+        v->total_count += conc_arms[i].count;
+        conc_ab[i].win = 1 + win;
+        conc_ab[i].lose = 1 + (conc_arms[i].count > win ? conc_arms[i].count - win : 0);
+    }
+
+    if(c->ma.policy.op == &policy_ts){
+        ts->len = len;
+        ts->cap = view->cap;
+        ts->arms = conc_ab;
+        v->policy.data = ts;
+    }
+}
+
+void *
+multi_arm_conc_choice(multi_arm_conc_t *c, const uint64_t *mask, int *idx)
+{
+    multi_arm_t         v;
+    policy_ts_data_t    ts;
+
+    conc_merge(c, &v, &ts);
+    return v.policy.op->choice(&v.policy, &v, mask, idx);
+}
+
+multi_arm_t *
+multi_arm_conc_snapshot(multi_arm_conc_t *c)
+{
+    multi_arm_t         v, *ma = _malloc(sizeof(*ma));
+    policy_ts_data_t    ts, *data;
+
+    conc_merge(c, &v, &ts);
+    *ma = v;
+    ma->arms = _malloc(sizeof(arm_t) * v.len);
+    memcpy(ma->arms, v.arms, sizeof(arm_t) * v.len);
+    ma->cap = v.len;
+
+    if(v.policy.op == &policy_ts){
+        data = _malloc(sizeof(*data));
+        data->len = data->cap = v.len;
+        data->arms = _malloc(sizeof(alpha_beta_t) * v.len);
+        memcpy(data->arms, ts.arms, sizeof(alpha_beta_t) * v.len);
+        ma->policy.data = data;
+    }else if(v.policy.op == &policy_egreedy){
+        ma->policy.data = _malloc(sizeof(double));
+        *(double *)ma->policy.data = *(double *)v.policy.data;
+    }
+
+    small_compact(ma);
+    return ma;
+}
+
+size_t
+multi_arm_mem_usage(multi_arm_t *ma)
+{
+    size_t  ret = sizeof(*ma);
+
+    if(ma->small){
+        ret += SMALL_STRIDE(ma) * ma->len;
+        if(ma->policy.op != &policy_ts && ma->policy.op->mem){
+            ret += ma->policy.op->mem(&ma->policy, ma);
+        }
+        return ret;
+    }
+
+    ret += sizeof(arm_t) * ma->cap;
+    if(ma->policy.op->mem){
+        ret += ma->policy.op->mem(&ma->policy, ma);
+    }
+
+    if(ma->window){
+        ret += sizeof(multi_arm_window_t) + sizeof(window_sum_t) * ma->len +
+            sizeof(window_bucket_t) * ma->len * ma->window->nbuckets;
+    }
+    if(ma->freeze){
+        ret += sizeof(multi_arm_freeze_t);
+    }
+    return ret;
+}
+
+
+int
+multi_arm_stat_json(multi_arm_t *ma, char *obuf, size_t maxlen)
+{
+    small_view_t    v;
+    size_t     len;
+
+    if(ma->small){
+        small_unpack(ma, &v);
+        ma = &v.ma;
+    }
+#define FMT "{\"count\": %lu, \"reward\": %f}"
+
+    PRINTF("{\"total_count\": %lu, \"arms\": [", ma->total_count);
+    const char  *fmt;
+    int         i;
+    for(i = 0; i < ma->len; i++){
+        if(i + 1 == ma->len){
+            fmt = FMT;
+        }else{
+            fmt = FMT",";
+        }
+
+        PRINTF(fmt, ma->arms[i].count, ma->arms[i].reward);
+    }
+    PRINTF("], ");
+
+    if(ma->window){
+        multi_arm_window_t  *w = ma->window;
+
+        window_advance(ma);
+        PRINTF("\"window\": {\"span\": %lu, \"buckets\": %d, \"total_count\": %lu, \"arms\": [",
+                w->span, w->nbuckets, w->total);
+        for(i = 0; i < ma->len; i++){
+            fmt = (i + 1 == ma->len) ? FMT : FMT",";
+            PRINTF(fmt, w->sums[i].count, w->sums[i].reward);
+        }
+        PRINTF("]}, ");
+    }
+    if(ma->freeze){
+        PRINTF("\"freeze\": {\"explore\": %0.4f, \"frozen\": %d, \"best\": %d}, ",
+                ma->freeze->explore, ma->freeze->frozen, ma->freeze->best);
+    }
+    
+    if(ma->policy.op->sj){
+        len = ma->policy.op->sj(&ma->policy, obuf, maxlen);
+        if(len >= maxlen){
+            return 1;
+        }
+        maxlen -= len;
+        obuf += len;
+    }else{
+        PRINTF("\"policy\": \"%s\"", ma->policy.name);
+    }
+    PRINTF("}");
+#undef FMT
+
+    return 0;
+}
+
+static void
+buf_reserve(multi_arm_buf_t *b, size_t n)
+{
+    size_t  cap = b->cap ? b->cap : 64;
+
+    if(b->len + n <= b->cap){
+        return;
+    }
+    while(cap < b->len + n){
+        cap *= 2;
+    }
+
+    b->data = _realloc(b->data, cap);
+    if(b->data == NULL){
+        log_error("process run out of memory");
+        exit(1);
+    }
+    b->cap = cap;
+}
+
+void
+multi_arm_buf_varint(multi_arm_buf_t *b, uint64_t v)
+{
+    buf_reserve(b, 10);
+    while(v >= 0x80){
+        b->data[b->len++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    b->data[b->len++] = (uint8_t)v;
+}
+
+void
+multi_arm_buf_double(multi_arm_buf_t *b, double d)
+{
+    uint64_t    bits;
+    int         i;
+
+    memcpy(&bits, &d, sizeof(bits));
+    buf_reserve(b, 8);
+    for(i = 0; i < 8; i++){
+        b->data[b->len++] = (uint8_t)(bits >> (i * 8));
+    }
+}
+
+void
+multi_arm_buf_bytes(multi_arm_buf_t *b, const void *p, size_t len)
+{
+    multi_arm_buf_varint(b, len);
+    multi_arm_buf_raw(b, p, len);
+}
+
+/* append bytes without a length, e.g. a serialized bandit kept apart */
+void
+multi_arm_buf_raw(multi_arm_buf_t *b, const void *p, size_t len)
+{
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+}
+
+void
+multi_arm_buf_free(multi_arm_buf_t *b)
+{
+    _free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+uint64_t
+multi_arm_read_varint(multi_arm_reader_t *r)
+{
+    uint64_t    v = 0;
+    int         shift = 0;
+
+    while(r->p < r->end && shift < 64){
+        uint8_t     c = *r->p++;
+
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if(!(c & 0x80)){
+            return v;
+        }
+        shift += 7;
+    }
+    r->err = 1;
+    return 0;
+}
+
+double
+multi_arm_read_double(multi_arm_reader_t *r)
+{
+    uint64_t    bits = 0;
+    double      d;
+    int         i;
+
+    if(r->end - r->p < 8){
+        r->err = 1;
+        return 0.0;
+    }
+    for(i = 0; i < 8; i++){
+        bits |= (uint64_t)*r->p++ << (i * 8);
+    }
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+const uint8_t *
+multi_arm_read_bytes(multi_arm_reader_t *r, size_t *len)
+{
+    const uint8_t   *ret;
+    uint64_t        n = multi_arm_read_varint(r);
+
+    if(r->err || n > (uint64_t)(r->end - r->p)){
+        r->err = 1;
+        *len = 0;
+        return NULL;
+    }
+    ret = r->p;
+    r->p += n;
+    *len = (size_t)n;
+    return ret;
+}
+
+static policy_elem_t *
+policy_find(const char *name, size_t len)
+{
+    int     i;
+
+    for(i = 0; i < (int)(sizeof(policies)/sizeof(policies[0])); i++){
+        if(strlen(policies[i].name) == len && strncmp(policies[i].name, name, len) == 0){
+            return policies + i;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * empty buckets (the common case for a long window) take a single byte,
+ * others a varint count and win then the raw reward
+ */
+static void
+window_dump(multi_arm_t *ma, multi_arm_buf_t *b)
+{
+    multi_arm_window_t  *w = ma->window;
+    size_t              i, n = (size_t)ma->len * w->nbuckets;
+
+    multi_arm_buf_varint(b, w->span);
+    multi_arm_buf_varint(b, w->nbuckets);
+    multi_arm_buf_varint(b, w->policy);
+    multi_arm_buf_varint(b, w->head);
+    multi_arm_buf_varint(b, w->pos);
+
+    for(i = 0; i < n; i++){
+        multi_arm_buf_varint(b, w->buckets[i].count);
+        if(w->buckets[i].count){
+            multi_arm_buf_varint(b, w->buckets[i].win);
+            multi_arm_buf_double(b, w->buckets[i].reward);
+        }
+    }
+}
+
+static int
+window_restore_buckets(multi_arm_t *ma, multi_arm_reader_t *r)
+{
+    multi_arm_window_t  *w = ma->window;
+    size_t              i;
+
+    for(i = 0; i < (size_t)ma->len * w->nbuckets; i++){
+        window_bucket_t     *b = w->buckets + i;
+        window_sum_t        *sum = w->sums + i / w->nbuckets;
+
+        b->count = multi_arm_read_varint(r);
+        if(b->count == 0){
+            continue;
+        }
+        b->win = multi_arm_read_varint(r);
+        b->reward = multi_arm_read_double(r);
+
+        sum->count += b->count;
+        sum->win += b->win;
+        sum->reward += b->reward;
+        w->total += b->count;
+    }
+    return r->err;
+}
+
+static int
+window_restore(multi_arm_t *ma, uint64_t span, int nbuckets, int policy, uint64_t head,
+        int pos, multi_arm_reader_t *r)
+{
+    if(r->err || multi_arm_set_window(ma, span, nbuckets, policy) != 0 ||
+            pos < 0 || pos >= nbuckets){
+        return 1;
+    }
+
+    ma->window->head = head;
+    ma->window->pos = pos;
+    if(window_restore_buckets(ma, r) != 0){
+        window_free(ma->window);
+        ma->window = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * sections after the policy state, announced by one varint of flags. the
+ * forms written before freeze had only the window flag, so they still load
+ */
+#define DUMP_WINDOW     1
+#define DUMP_FREEZE     2
+
+void
+multi_arm_dump(multi_arm_t *ma, multi_arm_buf_t *b)
+{
+    small_view_t    v;
+    int             i;
+
+    //the serialized form does not depend on the encoding
+    if(ma->small){
+        small_unpack(ma, &v);
+        ma = &v.ma;
+    }
+
+    multi_arm_buf_varint(b, ma->len);
+    for(i = 0; i < ma->len; i++){
+        multi_arm_buf_varint(b, ma->arms[i].count);
+        multi_arm_buf_double(b, ma->arms[i].reward);
+    }
+    multi_arm_buf_varint(b, ma->total_count);
+
+    multi_arm_buf_bytes(b, ma->policy.name, strlen(ma->policy.name));
+    if(ma->policy.op->dump){
+        ma->policy.op->dump(&ma->policy, b);
+    }
+
+    multi_arm_buf_varint(b, (ma->window ? DUMP_WINDOW : 0) |
+            (ma->freeze ? DUMP_FREEZE : 0));
+    if(ma->window){
+        window_dump(ma, b);
+    }
+    if(ma->freeze){
+        multi_arm_buf_double(b, ma->freeze->explore);
+        multi_arm_buf_varint(b, ma->freeze->frozen);
+        multi_arm_buf_varint(b, ma->freeze->best);
+        multi_arm_buf_varint(b, ma->freeze->rewards);
+    }
+}
+
+multi_arm_t *
+multi_arm_restore(multi_arm_reader_t *r)
+{
+    multi_arm_t     *ma;
+    policy_elem_t   *elem;
+    const uint8_t   *name;
+    size_t          name_len;
+    uint64_t        len = multi_arm_read_varint(r), sections;
+    int             i;
+
+    //every arm takes at least 9 bytes
+    if(r->err || len == 0 || len > (uint64_t)(r->end - r->p) / 9){
+        r->err = 1;
+        return NULL;
+    }
+
+    ma = _malloc(sizeof(*ma));
+    ma->len = (int)len;
+    ma->cap = ma->len;
+    ma->window = NULL;
+    ma->freeze = NULL;
+    ma->small = NULL;
+    ma->choices = NULL;
+    ma->policy.data = NULL;
+    ma->arms = _malloc(sizeof(arm_t) * ma->len);
+    for(i = 0; i < ma->len; i++){
+        ma->arms[i].count = multi_arm_read_varint(r);
+        ma->arms[i].reward = multi_arm_read_double(r);
+        ma->arms[i].choice = NULL;
+    }
+    ma->total_count = multi_arm_read_varint(r);
+
+    name = multi_arm_read_bytes(r, &name_len);
+    if(r->err || (elem = policy_find((const char *)name, name_len)) == NULL){
+        goto error;
+    }
+    ma->policy.op = elem->op;
+    ma->policy.name = elem->name;
+
+    if(ma->policy.op->restore){
+        ma->policy.data = ma->policy.op->restore(&ma->policy, ma, r);
+        if(ma->policy.data == NULL){
+            goto error;
+        }
+    }
+
+    sections = multi_arm_read_varint(r);
+    if(sections & ~(uint64_t)(DUMP_WINDOW | DUMP_FREEZE)){
+        goto error;
+    }
+    if(sections & DUMP_WINDOW){
+        uint64_t    span = multi_arm_read_varint(r);
+        int         nbuckets = (int)multi_arm_read_varint(r);
+        int         policy = (int)multi_arm_read_varint(r);
+        uint64_t    head = multi_arm_read_varint(r);
+        int         pos = (int)multi_arm_read_varint(r);
+
+        if(window_restore(ma, span, nbuckets, policy, head, pos, r) != 0){
+            goto error;
+        }
+    }
+    if(sections & DUMP_FREEZE){
+        multi_arm_freeze_t  f;
+
+        f.explore = multi_arm_read_double(r);
+        f.frozen = multi_arm_read_varint(r) != 0;
+        f.best = (int)multi_arm_read_varint(r);
+        f.rewards = multi_arm_read_varint(r);
+        if(r->err || !(f.explore >= 0.0 && f.explore <= 1.0) ||
+                f.best < 0 || f.best >= ma->len){
+            goto error;
+        }
+        ma->freeze = _malloc(sizeof(f));
+        *ma->freeze = f;
+    }
+    if(r->err){
+        goto error;
+    }
+    return ma;
+
+error:
+    r->err = 1;
+    if(ma->policy.data && ma->policy.op->free){
+        ma->policy.op->free(&ma->policy);
+    }
+    if(ma->window){
+        window_free(ma->window);
+    }
+    _free(ma->freeze);
+    _free(ma->arms);
+    _free(ma);
+    return NULL;
+}
+
+int
+multi_arm_dump_check(multi_arm_reader_t *r)
+{
+    const uint8_t   *name;
+    size_t          name_len;
+    uint64_t        len = multi_arm_read_varint(r), i;
+
+    if(r->err || len == 0 || len > (uint64_t)(r->end - r->p) / 9){
+        r->err = 1;
+        return 0;
+    }
+
+    for(i = 0; i < len; i++){
+        multi_arm_read_varint(r);
+        multi_arm_read_double(r);
+    }
+    multi_arm_read_varint(r);
+
+    name = multi_arm_read_bytes(r, &name_len);
+    if(r->err || policy_find((const char *)name, name_len) == NULL){
+        r->err = 1;
+        return 0;
+    }
+    return (int)len;
+}
+
+#ifdef MABREDIS_MODULE
+/*
+ * loaders of the rdb encoding versions 0 and 1, which saved the fields one
+ * by one. newer versions save the multi_arm_dump string
+ */
+static int
+window_rdb_load(multi_arm_t *ma, struct RedisModuleIO *rdb)
+{
+    uint64_t            span = RedisModule_LoadUnsigned(rdb);
+    int                 nbuckets = (int)RedisModule_LoadUnsigned(rdb);
+    int                 policy = (int)RedisModule_LoadUnsigned(rdb);
+    uint64_t            head = RedisModule_LoadUnsigned(rdb);
+    int                 pos = (int)RedisModule_LoadUnsigned(rdb);
+    size_t              len;
+    char                *buf = RedisModule_LoadStringBuffer(rdb, &len);
+    multi_arm_reader_t  r = {(uint8_t *)buf, (uint8_t *)buf + len, 0};
+    int                 ret = window_restore(ma, span, nbuckets, policy, head, pos, &r);
+
+    if(ret != 0){
+        RedisModule_LogIOError(rdb, "warning", "corrupt multi_arm window");
+    }
+    RedisModule_Free(buf);
+    return ret;
+}
+
+multi_arm_t *
+multi_arm_rdb_load(struct RedisModuleIO  *rdb, int encv)
+{
+    multi_arm_t     *ma = _malloc(sizeof(*ma));
+    policy_elem_t   *elem;
+    int             i;
+
+    ma->len = RedisModule_LoadUnsigned(rdb);
+    ma->cap = ma->len;
+    ma->window = NULL;
+    ma->freeze = NULL;
+    ma->small = NULL;
+    ma->choices = NULL;
+    ma->arms = _malloc(ma->len * sizeof(arm_t));
+    for(i = 0; i < ma->len; i++){
+        ma->arms[i].count = RedisModule_LoadUnsigned(rdb);
+        ma->arms[i].reward = RedisModule_LoadDouble(rdb);
+        ma->arms[i].choice = NULL;
+    }
+
+    ma->total_count = RedisModule_LoadUnsigned(rdb);
+
+    size_t  policy_len;
+    char    *policy = RedisModule_LoadStringBuffer(rdb, &policy_len);
+
+    elem = policy_find(policy, policy_len);
+    if(elem == NULL){
+        RedisModule_LogIOError(rdb, "warning", "unsupport multi_arm_policy %.*s", (int)policy_len, policy);
+        goto error;
+    }
+    ma->policy.op = elem->op;
+    ma->policy.name = elem->name;
+
+    if(ma->policy.op->load){
+        ma->policy.data = ma->policy.op->load(&ma->policy, rdb);
+        if(ma->policy.data == NULL){
+            goto error;
+        }
+    }else if(ma->policy.op->new){
+        RedisModule_LogIOError(rdb, "warning", "multi_arm_policy %s needs a newer encoding", elem->name);
+        goto error;
+    }else{
+        ma->policy.data = NULL;
+    }
+
+    //encoding version 0 has no window
+    if(encv >= 1 && RedisModule_LoadUnsigned(rdb)){
+        if(window_rdb_load(ma, rdb) != 0){
+            if(ma->policy.op->free){
+                ma->policy.op->free(&ma->policy);
+            }
+            goto error;
+        }
+    }
+    goto done;
+
+error:
+    _free(ma->arms);
+    _free(ma);
+    ma = NULL;
+
+done:
+    RedisModule_Free(policy);
+    return ma;
+}
+#endif
+
+static int
+policy_init(multi_arm_t *m, const char *policy, policy_t *dst, const char *option)
+{
+    int         i = 0, len = (int)(sizeof(policies)/sizeof(policies[0]));
+
+    for(i = 0; i < len; i++){
+        if(strcasecmp(policies[i].name, policy) == 0){
+            dst->op = policies[i].op;
+            dst->name = policies[i].name;
+            if(policies[i].op->new == NULL){
+                dst->data = NULL;
+            }else{
+                dst->data = policies[i].op->new(m, option);
+                if(dst->data == NULL){
+                    return 1;
+                }
+            }
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static void *
+policy_ucb1_choice(policy_t *policy, multi_arm_t *ma, const uint64_t *mask, int *idx)
+{
+    (void)policy;
+    double  ucb_max = -1.0, ucb;
+    int     i, ridx = -1;
+    uint64_t    count;
+    for(i = 0; i < ma->len; i++){
+        if(ARM_COUNT(ma, i) == 0 && ARM_ELIGIBLE(mask, i)){
+            ridx = i;
+            goto find;
+        }
+    }
+
+    double      lt = 2 * log(TOTAL_COUNT(ma) + 1);
+    for(i = 0; i < ma->len; i++){
+        if(!ARM_ELIGIBLE(mask, i)){
+            continue;
+        }
+        count = ARM_COUNT(ma, i);
+
+        ucb = (ARM_REWARD(ma, i) / count) + sqrt(lt / count);
+
+        if(ucb > ucb_max){
+            ucb_max = ucb;
+            ridx = i;
+        }
+    }
+
+find:
+    *idx = ridx;
+    return ridx < 0 ? NULL : ma->arms[ridx].choice;
+}
+
+static int
+policy_ucb1_reward(policy_t *policy, multi_arm_t *ma, int idx, double reward)
+{
+    (void)policy;
+    if(reward < 0 || reward > 1.0){
+        return 1;
+    }
+    arm_t   *arm = ma->arms + idx;
+
+    arm->reward += reward;
+    arm->count++;
+
+    return 0;
+}
+
+
+static void
+policy_ucb1_reward_agg(policy_t *policy, multi_arm_t *ma, int idx, uint64_t trials,
+        double reward, uint64_t wins)
+{
+    (void)policy;
+    (void)wins;
+    arm_t   *arm = ma->arms + idx;
+
+    arm->reward += reward;
+    arm->count += trials;
+}
+
+static void *
+policy_egreedy_new(multi_arm_t *m, const char *option)
+{
+    UNUSED(m);
+    
+    if(option == NULL){
+        return NULL;
+    }
+
+    char    *eptr = NULL;
+    double  d = strtod(option, &eptr);
+    if(eptr == option || d < 0 || d > 1.00000000001){
+        printf("conver fail %s\n", eptr);
+        return NULL;
+    }
+
+    double  *ret = _malloc(sizeof(double));
+    *ret = d;
+    return (void *)ret;
+}
+
+
+static void
+policy_egreedy_free(policy_t *policy)
+{
+    _free(policy->data);
+}
+
+static int
+count_eligible(multi_arm_t *ma, const uint64_t *mask)
+{
+    int         i, n = 0;
+    uint64_t    w;
+
+    if(mask == NULL){
+        return ma->len;
+    }
+    /* no __builtin_popcountll, the module is not linked with libgcc */
+    for(i = 0; i < MULTI_ARM_MASK_WORDS(ma->len); i++){
+        for(w = mask[i]; w; w &= w - 1){
+            n++;
+        }
+    }
+    return n;
+}
+
+/* pick uniformly among the eligible arms */
+static int
+random_eligible(multi_arm_t *ma, const uint64_t *mask)
+{
+    int     i, n;
+
+    if(mask == NULL){
+        return randint(ma->len);
+    }
+
+    n = count_eligible(ma, mask);
+    if(n == 0){
+        return -1;
+    }
+
+    n = randint(n);
+    for(i = 0; i < ma->len; i++){
+        if(MULTI_ARM_MASK_TEST(mask, i) && n-- == 0){
+            break;
+        }
+    }
+    return i;
+}
+
+/* the eligible arm of the best average reward, the first one on ties */
+static int
+egreedy_greedy(multi_arm_t *ma, const uint64_t *mask)
+{
+    double  max_avg = -0.1, avg;
+    int     i, ridx = -1;
+
+    for(i = 0; i < ma->len; i++){
+        if(!ARM_ELIGIBLE(mask, i)){
+            continue;
+        }
+
+        if(ARM_COUNT(ma, i)){
+            avg = ARM_REWARD(ma, i) / ARM_COUNT(ma, i);
+        }else{
+            avg = 0.0;
         }
 
         if(avg > max_avg){
@@ -491,96 +2234,620 @@ policy_egreedy_choice(policy_t *policy, multi_arm_t *ma, int *idx)
             max_avg = avg;
         }
     }
+    return ridx;
+}
+
+static void *
+policy_egreedy_choice(policy_t *policy, multi_arm_t *ma, const uint64_t *mask, int *idx)
+{
+    double  r = randnumber(), epsilon = *((double *)policy->data);
+    int     ridx;
+
+    if(r < epsilon || TOTAL_COUNT(ma) == 0){
+        ridx = random_eligible(ma, mask);
+    }else{
+        ridx = egreedy_greedy(ma, mask);
+    }
 
-find:
     *idx = ridx;
-    return ma->arms[ridx].choice;
+    return ridx < 0 ? NULL : ma->arms[ridx].choice;
 }
 
 static int
 policy_egreedy_stat_json(policy_t *p, char *obuf, size_t maxlen)
 {
-    return snprintf(obuf, maxlen, "\"policy\": \"%s\", \"epsilon\": %0.4f", p->name,
-            *((double *)p->data));
+    return snprintf(obuf, maxlen, "\"policy\": \"%s\", \"epsilon\": %0.4f", p->name,
+            *((double *)p->data));
+}
+
+static size_t
+policy_egreedy_mem_usage(policy_t *p, multi_arm_t *m)
+{
+    UNUSED(p);
+    UNUSED(m);
+    return sizeof(double);
+}
+
+static void
+policy_egreedy_dump(policy_t *p, multi_arm_buf_t *b)
+{
+    multi_arm_buf_double(b, *((double *)p->data));
+}
+
+static void *
+policy_egreedy_restore(policy_t *p, multi_arm_t *m, multi_arm_reader_t *r)
+{
+    UNUSED(p);
+    UNUSED(m);
+
+    double  val = multi_arm_read_double(r);
+    double  *ret;
+
+    if(r->err){
+        return NULL;
+    }
+    ret = _malloc(sizeof(double));
+    *ret = val;
+    return ret;
+}
+
+#ifdef MABREDIS_MODULE
+
+static void *
+policy_egreedy_load(policy_t *p, RedisModuleIO *rdb)
+{
+    (void)p;
+
+    double  val = RedisModule_LoadDouble(rdb);
+    double  *ret = _malloc(sizeof(double));
+
+    *ret = val;
+    return ret;
+}
+#endif
+
+
+static void *
+policy_ts_new(multi_arm_t *m, const char * option)
+{
+    UNUSED(option);
+    policy_ts_data_t    *data = _malloc(sizeof(*data));
+    data->arms = _malloc(sizeof(alpha_beta_t) * m->len);
+    data->len =  m->len;
+    data->cap = m->len;
+
+    int     i;
+    for(i = 0; i < m->len; i++){
+        data->arms[i].win = 1;
+        data->arms[i].lose = 1;
+    }
+
+    return data;
+}
+
+static void
+policy_ts_free(policy_t *p)
+{
+    policy_ts_data_t *data = (policy_ts_data_t *)p->data;
+    _free(data->arms);
+    _free(data);
+}
+
+/*
+ * standard normal variate by the marsaglia polar method, the second value
+ * of a pair is kept for the next call of the same thread
+ */
+static __thread double  normal_spare;
+static __thread int     normal_has_spare;
+
+static double
+normal_variate(void)
+{
+    double  u, v, s;
+
+    if(normal_has_spare){
+        normal_has_spare = 0;
+        return normal_spare;
+    }
+
+    do{
+        u = 2.0 * randnumber() - 1.0;
+        v = 2.0 * randnumber() - 1.0;
+        s = u * u + v * v;
+    }while(s >= 1.0 || s == 0.0);
+
+    s = sqrt(-2.0 * log(s) / s);
+    normal_spare = v * s;
+    normal_has_spare = 1;
+    return u * s;
+}
+
+/*
+ * beta(a, b) draw of the thompson policies. once both a and b reach
+ * ts_normal_min the beta is replaced by the normal of the same mean and
+ * variance plus a one term cornish-fisher correction for its skew
+ *   x = mean + sd * z + (b - a) / (3n(n + 2)) * (z^2 - 1),  n = a + b
+ * which costs one normal variate instead of two gamma rejection samplers.
+ * the total variation distance to the exact beta stays under
+ * 0.18 / min(a, b), so the probability of any decision moves by at most
+ * the sum of that over the arms on the normal tier.
+ */
+static inline double
+ts_beta_variate(double a, double b)
+{
+    double  n, z;
+
+    if(ts_normal_min == 0.0 || a < ts_normal_min || b < ts_normal_min){
+        return Beta_Random_Variate(a, b);
+    }
+
+    n = a + b;
+    z = normal_variate();
+    return a / n + sqrt(a * b / (n + 1.0)) / n * z +
+        (b - a) / (3.0 * n * (n + 2.0)) * (z * z - 1.0);
+}
+
+static void *
+policy_ts_choice(policy_t *p, multi_arm_t *m, const uint64_t *mask, int *idx)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+    int            i, maxi = -1;
+    double              tmp, maxp = -1.0;
+    window_sum_t        *sum;
+
+    for(i = 0; i < data->len; i++){
+        if(!ARM_ELIGIBLE(mask, i)){
+            continue;
+        }
+
+        if(WINDOWED(m)){
+            /* beta(1, 1) prior over the window only */
+            sum = m->window->sums + i;
+            tmp = ts_beta_variate(1.0 + sum->win, 1.0 + (sum->count - sum->win));
+            if(tmp > maxp){
+                maxi = i;
+                maxp = tmp;
+            }
+            continue;
+        }
+
+        tmp = ts_beta_variate((double)data->arms[i].win, (double)data->arms[i].lose);
+        log_dev("choice %d (%ld %ld) %f", i, data->arms[i].win, data->arms[i].lose, tmp);
+        if(tmp > maxp){
+            maxi = i;
+            maxp = tmp;
+        }
+    }
+
+    *idx = maxi;
+    return maxi < 0 ? NULL : m->arms[maxi].choice;
+}
+
+/* the betas policy_ts_choice draws from, see multi_arm_posterior */
+static int
+ts_posterior(multi_arm_t *m, const uint64_t *mask, int idx, multi_arm_beta_t *out, int max)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)m->policy.data;
+    window_sum_t        *sum;
+    int                 i, n = 0;
+
+    for(i = 0; i < data->len; i++){
+        if(!ARM_ELIGIBLE(mask, i)){
+            continue;
+        }
+        if(n < max){
+            if(WINDOWED(m)){
+                sum = m->window->sums + i;
+                out[n].alpha = 1.0 + sum->win;
+                out[n].beta = 1.0 + (sum->count - sum->win);
+            }else{
+                out[n].alpha = (double)data->arms[i].win;
+                out[n].beta = (double)data->arms[i].lose;
+            }
+            out[n].level = 0;
+            out[n].chosen = i == idx;
+        }
+        n++;
+    }
+    return n;
+}
+
+static int
+policy_ts_reward(policy_t *p, multi_arm_t *m, int idx, double reward)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+
+    if(reward != 0.0){
+        data->arms[idx].win += 1;
+    }else{
+        data->arms[idx].lose += 1;
+    }
+
+    arm_t   *arm = m->arms + idx;
+
+    arm->reward += reward;
+    arm->count++;
+
+    return 0;
+}
+
+static void
+policy_ts_reward_agg(policy_t *p, multi_arm_t *m, int idx, uint64_t trials, double reward,
+        uint64_t wins)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+
+    data->arms[idx].win += wins;
+    data->arms[idx].lose += trials - wins;
+    policy_ucb1_reward_agg(p, m, idx, trials, reward, wins);
+}
+
+static void
+policy_ts_add_arm(policy_t *p, multi_arm_t *m)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+
+    UNUSED(m);
+    data->arms = array_fit(data->arms, &data->cap, data->len + 1, sizeof(alpha_beta_t));
+    data->arms[data->len].win = 1;
+    data->arms[data->len].lose = 1;
+    data->len++;
+}
+
+static void
+policy_ts_del_arm(policy_t *p, multi_arm_t *m, int idx)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+
+    UNUSED(m);
+    memmove(data->arms + idx, data->arms + idx + 1,
+            sizeof(alpha_beta_t) * (data->len - idx - 1));
+    data->len--;
+    data->arms = array_fit(data->arms, &data->cap, data->len, sizeof(alpha_beta_t));
+}
+
+static size_t
+policy_ts_mem_usage(policy_t *p, multi_arm_t *m)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+
+    UNUSED(m);
+    return sizeof(*data) + sizeof(alpha_beta_t) * data->cap;
+}
+
+static int
+policy_ts_json(policy_t *p, char *obuf, size_t maxlen)
+{
+    size_t      len;
+    char        *old = obuf;
+#define FMT "{\"idx\": %d, \"win\": %lu, \"lose\": %lu}"
+    const char  *fmt;
+    int         i;
+
+    PRINTF("\"alpha_beta\": [");
+    policy_ts_data_t *data = (policy_ts_data_t *)p->data;
+
+    for(i = 0; i < data->len; i++){
+        if(i + 1 == data->len){
+            fmt = FMT;
+        } else {
+            fmt = FMT",";
+        }
+
+        PRINTF(fmt, i, data->arms[i].win, data->arms[i].lose);
+    }
+
+    PRINTF("]");
+
+#undef FMT
+
+    return obuf - old;
+}
+
+static void
+policy_ts_dump(policy_t *p, multi_arm_buf_t *b)
+{
+    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+    int                 i;
+
+    for(i = 0; i < data->len; i++){
+        multi_arm_buf_varint(b, data->arms[i].win);
+        multi_arm_buf_varint(b, data->arms[i].lose);
+    }
+}
+
+static void *
+policy_ts_restore(policy_t *p, multi_arm_t *m, multi_arm_reader_t *r)
+{
+    UNUSED(p);
+    policy_ts_data_t    *data = _malloc(sizeof(*data));
+    int                 i;
+
+    data->len = m->len;
+    data->cap = m->len;
+    data->arms = _malloc(sizeof(alpha_beta_t) * m->len);
+    for(i = 0; i < m->len; i++){
+        data->arms[i].win = multi_arm_read_varint(r);
+        data->arms[i].lose = multi_arm_read_varint(r);
+    }
+
+    if(r->err){
+        _free(data->arms);
+        _free(data);
+        return NULL;
+    }
+    return data;
+}
+
+#ifdef MABREDIS_MODULE
+
+static void *
+policy_ts_load(policy_t *p, RedisModuleIO *io)
+{
+    UNUSED(p);
+    policy_ts_data_t    *data = _malloc(sizeof(*data));
+
+    data->len = RedisModule_LoadUnsigned(io);
+    data->cap = data->len;
+    data->arms = _malloc(data->len * sizeof(alpha_beta_t));
+
+    int    i;
+    for(i = 0; i < data->len; i++){
+        data->arms[i].win = RedisModule_LoadUnsigned(io);
+        data->arms[i].lose = RedisModule_LoadUnsigned(io);
+    }
+
+    return data;
+}
+#endif
+
+
+/* first node of level l, level l - 1 starts at (that - 1) / b */
+static size_t
+htree_level(const policy_htree_data_t *data, int l)
+{
+    size_t  off = 0, w = 1;
+
+    while(l-- > 0){
+        off += w;
+        w *= data->b;
+    }
+    return off;
+}
+
+/* compare the posterior means (1 + win) / (2 + win + lose) */
+static int
+htree_better(const alpha_beta_t *a, const alpha_beta_t *b)
+{
+    return (1.0 + a->win) * (2.0 + b->win + b->lose) >
+        (1.0 + b->win) * (2.0 + a->win + a->lose);
+}
+
+/*
+ * node k of level l takes the statistics of its best child, span is the
+ * number of leaves under one child
+ */
+static void
+htree_pull(policy_htree_data_t *data, int l, size_t off, size_t k, size_t span)
+{
+    alpha_beta_t    *child = l + 1 == data->depth ? data->leaves : data->nodes + off * data->b + 1;
+    alpha_beta_t    *best = NULL;
+    size_t          c;
+
+    for(c = k * data->b; c < (k + 1) * data->b && c * span < (size_t)data->len; c++){
+        if(best == NULL || htree_better(child + c, best)){
+            best = child + c;
+        }
+    }
+    data->nodes[off + k] = *best;
 }
 
-#ifdef MABREDIS_MODULE
+/* refresh the ancestors of leaf idx, O(b * depth) */
 static void
-policy_egreedy_save(policy_t *p, RedisModuleIO *rdb)
+htree_fix(policy_htree_data_t *data, size_t idx)
 {
-    RedisModule_SaveDouble(rdb, *((double *)p->data));
+    size_t  off = htree_level(data, data->depth - 1), span = 1;
+    int     l;
+
+    for(l = data->depth - 1; l >= 0; l--){
+        idx /= data->b;
+        htree_pull(data, l, off, idx, span);
+        off = off ? (off - 1) / data->b : 0;
+        span *= data->b;
+    }
 }
 
-static void *
-policy_egreedy_load(policy_t *p, RedisModuleIO *rdb)
+/*
+ * size the tree for data->len leaves and fill it bottom up,
+ * O(len + nnodes * b)
+ */
+static void
+htree_rebuild(policy_htree_data_t *data)
 {
-    (void)p;
+    size_t  w, off, span = 1, k;
+    int     l;
 
-    double  val = RedisModule_LoadDouble(rdb);
-    double  *ret = _malloc(sizeof(double));
+    data->depth = 1;
+    for(w = data->b; w < (size_t)data->len; w *= data->b){
+        data->depth++;
+    }
 
-    *ret = val;
-    return ret;
+    data->nnodes = htree_level(data, data->depth);
+    _free(data->nodes);
+    data->nodes = _malloc(sizeof(alpha_beta_t) * data->nnodes);
+    memset(data->nodes, 0, sizeof(alpha_beta_t) * data->nnodes);
+
+    off = htree_level(data, data->depth - 1);
+    for(l = data->depth - 1; l >= 0; l--){
+        for(k = 0; k * span * data->b < (size_t)data->len; k++){
+            htree_pull(data, l, off, k, span);
+        }
+        off = off ? (off - 1) / data->b : 0;
+        span *= data->b;
+    }
 }
-#endif
 
+/* is any arm of [lo, hi) set in mask */
+static int
+htree_mask_any(const uint64_t *mask, size_t lo, size_t hi)
+{
+    size_t      w = lo >> 6, last = (hi - 1) >> 6;
+    uint64_t    bits = mask[w] & (~(uint64_t)0 << (lo & 63));
+
+    for(; w < last; bits = mask[++w]){
+        if(bits){
+            return 1;
+        }
+    }
+    if(hi & 63){
+        bits &= ((uint64_t)1 << (hi & 63)) - 1;
+    }
+    return bits != 0;
+}
 
 static void *
-policy_ts_new(multi_arm_t *m, const char * option)
+policy_htree_new(multi_arm_t *m, const char *option)
 {
-    UNUSED(option);
-    policy_ts_data_t    *data = _malloc(sizeof(*data));
-    data->arms = _malloc(sizeof(alpha_beta_t) * m->len);
-    data->len =  m->len;
+    long    b = HTREE_DEFAULT_BRANCHING;
+    char    *eptr = NULL;
 
-    int     i;
-    for(i = 0; i < m->len; i++){
-        data->arms[i].win = 1;
-        data->arms[i].lose = 1;
+    if(option != NULL){
+        b = strtol(option, &eptr, 10);
+        if(eptr == option || *eptr != '\0' || b < 2 || b > HTREE_MAX_BRANCHING){
+            return NULL;
+        }
     }
 
+    policy_htree_data_t *data = _malloc(sizeof(*data));
+    data->b = (int)b;
+    data->len = m->len;
+    data->cap = m->len;
+    data->leaves = _malloc(sizeof(alpha_beta_t) * m->len);
+    memset(data->leaves, 0, sizeof(alpha_beta_t) * m->len);
+    data->nodes = NULL;
+    htree_rebuild(data);
+
     return data;
 }
 
 static void
-policy_ts_free(policy_t *p)
+policy_htree_free(policy_t *p)
 {
-    policy_ts_data_t *data = (policy_ts_data_t *)p->data;
-    _free(data->arms);
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
+
+    _free(data->leaves);
+    _free(data->nodes);
     _free(data);
 }
 
 static void *
-policy_ts_choice(policy_t *p, multi_arm_t *m, int *idx)
+policy_htree_choice(policy_t *p, multi_arm_t *m, const uint64_t *mask, int *idx)
 {
-    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
-    int            i, maxi = 0;
-    double              tmp, maxp = 0.0;
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
+    size_t              node = 0, span = 1, off = 0, c, first, best;
+    double              tmp, maxp;
+    alpha_beta_t        *ab;
+    int                 l, i;
+
+    for(l = 1; l < data->depth; l++){
+        span *= data->b;
+    }
 
-    for(i = 0; i < data->len; i++){
-        tmp =  Beta_Random_Variate((double)data->arms[i].win, (double)data->arms[i].lose);
-        log_dev("choice %d (%ld %ld) %f", i, data->arms[i].win, data->arms[i].lose, tmp);
-        if(tmp > maxp){
-            maxi = i;
-            maxp = tmp;
+    /* node is the index within its level, span the leaves under a child */
+    for(l = 1; l <= data->depth; l++, span /= data->b){
+        first = node * data->b;
+        off = off * data->b + 1;
+        best = (size_t)-1;
+        maxp = -1.0;
+
+        for(i = 0; i < data->b; i++){
+            c = first + i;
+            if(c * span >= (size_t)data->len){
+                break;
+            }
+            if(mask && !htree_mask_any(mask, c * span,
+                        (c + 1) * span < (size_t)data->len ? (c + 1) * span : (size_t)data->len)){
+                continue;
+            }
+
+            ab = l == data->depth ? data->leaves + c : data->nodes + off + c;
+            tmp = ts_beta_variate(1.0 + ab->win, 1.0 + ab->lose);
+            if(tmp > maxp){
+                maxp = tmp;
+                best = c;
+            }
+        }
+
+        if(best == (size_t)-1){
+            *idx = -1;
+            return NULL;
         }
+        node = best;
     }
 
-    *idx = maxi;
-    return m->arms[maxi].choice;
+    *idx = (int)node;
+    return m->arms[node].choice;
 }
 
+/*
+ * the betas policy_htree_choice draws from on its way down to arm idx,
+ * see multi_arm_posterior
+ */
 static int
-policy_ts_reward(policy_t *p, multi_arm_t *m, int idx, double reward)
+htree_posterior(multi_arm_t *m, const uint64_t *mask, int idx, multi_arm_beta_t *out, int max)
 {
-    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+    policy_htree_data_t *data = (policy_htree_data_t *)m->policy.data;
+    size_t              node = 0, span = 1, off = 0, c, first, path;
+    alpha_beta_t        *ab;
+    int                 l, i, n = 0;
 
-    if(reward != 0.0){
-        data->arms[idx].win += 1;
-    }else{
-        data->arms[idx].lose += 1;
+    for(l = 1; l < data->depth; l++){
+        span *= data->b;
     }
 
+    for(l = 1; l <= data->depth; l++, span /= data->b){
+        first = node * data->b;
+        off = off * data->b + 1;
+        path = (size_t)idx / span;
+
+        for(i = 0; i < data->b; i++){
+            c = first + i;
+            if(c * span >= (size_t)data->len){
+                break;
+            }
+            if(mask && !htree_mask_any(mask, c * span,
+                        (c + 1) * span < (size_t)data->len ? (c + 1) * span : (size_t)data->len)){
+                continue;
+            }
+
+            if(n < max){
+                ab = l == data->depth ? data->leaves + c : data->nodes + off + c;
+                out[n].alpha = 1.0 + ab->win;
+                out[n].beta = 1.0 + ab->lose;
+                out[n].level = l - 1;
+                out[n].chosen = c == path;
+            }
+            n++;
+        }
+        node = path;
+    }
+    return n;
+}
+
+static int
+policy_htree_reward(policy_t *p, multi_arm_t *m, int idx, double reward)
+{
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
+    int                 win = reward != 0.0;
+
+    if(reward < 0 || reward > 1.0){
+        return 1;
+    }
+
+    data->leaves[idx].win += win;
+    data->leaves[idx].lose += !win;
+    htree_fix(data, idx);
+
     arm_t   *arm = m->arms + idx;
 
     arm->reward += reward;
@@ -589,66 +2856,358 @@ policy_ts_reward(policy_t *p, multi_arm_t *m, int idx, double reward)
     return 0;
 }
 
-static int
-policy_ts_json(policy_t *p, char *obuf, size_t maxlen)
+static void
+policy_htree_reward_agg(policy_t *p, multi_arm_t *m, int idx, uint64_t trials, double reward,
+        uint64_t wins)
 {
-    size_t      len;
-    char        *old = obuf;
-#define FMT "{\"idx\": %d, \"win\": %d, \"lose\": %d}"
-    const char  *fmt;
-    int         i;
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
 
-    PRINTF("\"alpha_beta\": [");
-    policy_ts_data_t *data = (policy_ts_data_t *)p->data;
+    data->leaves[idx].win += wins;
+    data->leaves[idx].lose += trials - wins;
+    htree_fix(data, idx);
+    policy_ucb1_reward_agg(p, m, idx, trials, reward, wins);
+}
 
-    for(i = 0; i < data->len; i++){
-        if(i + 1 == data->len){
-            fmt = FMT;
-        } else {
-            fmt = FMT",";
-        }
+static void
+policy_htree_add_arm(policy_t *p, multi_arm_t *m)
+{
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
+    size_t              leaves = 1;
+    int                 l;
 
-        PRINTF(fmt, i, data->arms[i].win, data->arms[i].lose);
+    UNUSED(m);
+    data->leaves = array_fit(data->leaves, &data->cap, data->len + 1, sizeof(alpha_beta_t));
+    data->leaves[data->len].win = 0;
+    data->leaves[data->len].lose = 0;
+    data->len++;
+
+    //only a full tree needs a new level
+    for(l = 0; l < data->depth; l++){
+        leaves *= data->b;
+    }
+    if((size_t)data->len > leaves){
+        htree_rebuild(data);
+    }else{
+        htree_fix(data, data->len - 1);
     }
+}
 
-    PRINTF("]");
+static void
+policy_htree_del_arm(policy_t *p, multi_arm_t *m, int idx)
+{
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
 
-#undef FMT
+    UNUSED(m);
+    memmove(data->leaves + idx, data->leaves + idx + 1,
+            sizeof(alpha_beta_t) * (data->len - idx - 1));
+    data->len--;
+    data->leaves = array_fit(data->leaves, &data->cap, data->len, sizeof(alpha_beta_t));
 
-    return obuf - old;
+    //every leaf after idx moves to another parent
+    htree_rebuild(data);
 }
 
-#ifdef MABREDIS_MODULE
+static size_t
+policy_htree_mem_usage(policy_t *p, multi_arm_t *m)
+{
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
 
+    UNUSED(m);
+    return sizeof(*data) + sizeof(alpha_beta_t) * (data->cap + data->nnodes);
+}
+
+static int
+policy_htree_json(policy_t *p, char *obuf, size_t maxlen)
+{
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
+
+    return snprintf(obuf, maxlen, "\"policy\": \"%s\", \"branching\": %d, \"depth\": %d",
+            p->name, data->b, data->depth);
+}
+
+/*
+ * only the leaves are stored, an inner node holds the statistics of its
+ * best child (see htree_pull), htree_rebuild refills them on restore
+ */
 static void
-policy_ts_save(policy_t *p, RedisModuleIO *io)
+policy_htree_dump(policy_t *p, multi_arm_buf_t *b)
 {
-    policy_ts_data_t    *data = (policy_ts_data_t *)p->data;
+    policy_htree_data_t *data = (policy_htree_data_t *)p->data;
     int                 i;
 
-    RedisModule_SaveUnsigned(io, data->len);
+    multi_arm_buf_varint(b, data->b);
     for(i = 0; i < data->len; i++){
-        RedisModule_SaveUnsigned(io, data->arms[i].win);
-        RedisModule_SaveUnsigned(io, data->arms[i].lose);
+        multi_arm_buf_varint(b, data->leaves[i].win);
+        multi_arm_buf_varint(b, data->leaves[i].lose);
     }
-
 }
 
 static void *
-policy_ts_load(policy_t *p, RedisModuleIO *io)
+policy_htree_restore(policy_t *p, multi_arm_t *m, multi_arm_reader_t *r)
 {
     UNUSED(p);
-    policy_ts_data_t    *data = _malloc(sizeof(*data));
+    uint64_t            b = multi_arm_read_varint(r);
+    policy_htree_data_t *data;
+    int                 i;
 
-    data->len = RedisModule_LoadUnsigned(io);
-    data->arms = _malloc(data->len * sizeof(alpha_beta_t));
+    if(r->err || b < 2 || b > HTREE_MAX_BRANCHING){
+        r->err = 1;
+        return NULL;
+    }
 
-    int    i;
-    for(i = 0; i < data->len; i++){
-        data->arms[i].win = RedisModule_LoadUnsigned(io);
-        data->arms[i].lose = RedisModule_LoadUnsigned(io);
+    data = _malloc(sizeof(*data));
+    data->b = (int)b;
+    data->len = m->len;
+    data->cap = m->len;
+    data->leaves = _malloc(sizeof(alpha_beta_t) * m->len);
+    for(i = 0; i < m->len; i++){
+        data->leaves[i].win = multi_arm_read_varint(r);
+        data->leaves[i].lose = multi_arm_read_varint(r);
     }
 
+    if(r->err){
+        _free(data->leaves);
+        _free(data);
+        return NULL;
+    }
+    data->nodes = NULL;
+    htree_rebuild(data);
     return data;
 }
-#endif
+
+/* kl divergence of bernoulli(p) from bernoulli(q), 0 < q < 1 */
+static double
+klucb_kl(double p, double q)
+{
+    double  d = 0.0;
+
+    if(p > 0.0){
+        d += p * log(p / q);
+    }
+    if(p < 1.0){
+        d += (1.0 - p) * log((1.0 - p) / (1.0 - q));
+    }
+    return d;
+}
+
+/*
+ * largest q in [p, 1] with kl(p, q) <= d. newton from the right side of the
+ * root (pinsker gives q <= p + sqrt(d / 2)) converges monotonically since
+ * kl(p, .) is convex and increasing on [p, 1)
+ */
+static double
+klucb_bound(double p, double d)
+{
+    double  q, f;
+    int     i;
+
+    if(d <= 0.0 || p >= 1.0){
+        return p;
+    }
+
+    q = p + sqrt(d / 2.0);
+    if(q >= 1.0){
+        q = 1.0 - 1e-12;
+        if(klucb_kl(p, q) <= d){
+            return 1.0;
+        }
+    }
+
+    for(i = 0; i < 32; i++){
+        f = klucb_kl(p, q) - d;
+        if(f < 1e-9){
+            break;
+        }
+        q -= f * q * (1.0 - q) / (q - p);
+    }
+    return q;
+}
+
+static void
+klucb_update(policy_klucb_data_t *data, multi_arm_t *m, int i)
+{
+    klucb_bound_t   *a = data->arms + i;
+
+    a->count = ARM_COUNT(m, i);
+    a->reward = ARM_REWARD(m, i);
+    if(a->count == 0){
+        a->bound = 0.0;
+        return;
+    }
+
+    double  p = a->reward / a->count;
+
+    p = p < 0.0 ? 0.0 : (p > 1.0 ? 1.0 : p);
+    a->bound = klucb_bound(p, data->lt / a->count);
+}
+
+/* force a recompute of arms [from, len) on the next choice */
+static void
+klucb_invalidate(policy_klucb_data_t *data, int from)
+{
+    int     i;
+
+    for(i = from; i < data->len; i++){
+        data->arms[i].count = UINT64_MAX;
+    }
+}
+
+static policy_klucb_data_t *
+klucb_data_new(multi_arm_t *m, double tol)
+{
+    policy_klucb_data_t *data = _malloc(sizeof(*data));
+
+    data->tol = tol;
+    data->lt = -1.0;
+    data->len = m->len;
+    data->cap = m->len;
+    data->arms = _malloc(sizeof(klucb_bound_t) * m->len);
+    klucb_invalidate(data, 0);
+    return data;
+}
+
+static void *
+policy_klucb_new(multi_arm_t *m, const char *option)
+{
+    double  tol = KLUCB_DEFAULT_TOLERANCE;
+    char    *eptr = NULL;
+
+    if(option != NULL){
+        tol = strtod(option, &eptr);
+        if(eptr == option || *eptr != '\0' || !(tol >= 0.0 && tol <= 1.0)){
+            return NULL;
+        }
+    }
+    return klucb_data_new(m, tol);
+}
+
+static void
+policy_klucb_free(policy_t *p)
+{
+    policy_klucb_data_t *data = (policy_klucb_data_t *)p->data;
+
+    _free(data->arms);
+    _free(data);
+}
+
+static void *
+policy_klucb_choice(policy_t *p, multi_arm_t *m, const uint64_t *mask, int *idx)
+{
+    policy_klucb_data_t *data = (policy_klucb_data_t *)p->data;
+    uint64_t            total = TOTAL_COUNT(m);
+    double              lt = total > 1 ? log((double)total) : 0.0, max = -1.0;
+    int                 i, ridx = -1;
+
+    if(fabs(lt - data->lt) > data->tol * data->lt){
+        data->lt = lt;
+        klucb_invalidate(data, 0);
+    }
+
+    for(i = 0; i < m->len; i++){
+        if(!ARM_ELIGIBLE(mask, i)){
+            continue;
+        }
+        if(ARM_COUNT(m, i) == 0){
+            ridx = i;
+            break;
+        }
+
+        //rewards of a window, mab.config or a restore
+        klucb_bound_t   *a = data->arms + i;
+        if(a->count != ARM_COUNT(m, i) || a->reward != ARM_REWARD(m, i)){
+            klucb_update(data, m, i);
+        }
+        if(a->bound > max){
+            max = a->bound;
+            ridx = i;
+        }
+    }
+
+    *idx = ridx;
+    return ridx < 0 ? NULL : m->arms[ridx].choice;
+}
+
+static int
+policy_klucb_reward(policy_t *p, multi_arm_t *m, int idx, double reward)
+{
+    if(policy_ucb1_reward(p, m, idx, reward)){
+        return 1;
+    }
+
+    //windowed sums are updated after the policy, the choice catches them
+    if(!WINDOWED(m)){
+        klucb_update((policy_klucb_data_t *)p->data, m, idx);
+    }
+    return 0;
+}
+
+static void
+policy_klucb_reward_agg(policy_t *p, multi_arm_t *m, int idx, uint64_t trials, double reward,
+        uint64_t wins)
+{
+    policy_ucb1_reward_agg(p, m, idx, trials, reward, wins);
+    if(!WINDOWED(m)){
+        klucb_update((policy_klucb_data_t *)p->data, m, idx);
+    }
+}
+
+static void
+policy_klucb_add_arm(policy_t *p, multi_arm_t *m)
+{
+    policy_klucb_data_t *data = (policy_klucb_data_t *)p->data;
+
+    UNUSED(m);
+    data->arms = array_fit(data->arms, &data->cap, data->len + 1, sizeof(klucb_bound_t));
+    data->len++;
+    klucb_invalidate(data, data->len - 1);
+}
+
+static void
+policy_klucb_del_arm(policy_t *p, multi_arm_t *m, int idx)
+{
+    policy_klucb_data_t *data = (policy_klucb_data_t *)p->data;
+
+    UNUSED(m);
+    memmove(data->arms + idx, data->arms + idx + 1,
+            sizeof(klucb_bound_t) * (data->len - idx - 1));
+    data->len--;
+    data->arms = array_fit(data->arms, &data->cap, data->len, sizeof(klucb_bound_t));
+}
+
+static size_t
+policy_klucb_mem_usage(policy_t *p, multi_arm_t *m)
+{
+    policy_klucb_data_t *data = (policy_klucb_data_t *)p->data;
+
+    UNUSED(m);
+    return sizeof(*data) + sizeof(klucb_bound_t) * data->cap;
+}
+
+static int
+policy_klucb_json(policy_t *p, char *obuf, size_t maxlen)
+{
+    policy_klucb_data_t *data = (policy_klucb_data_t *)p->data;
+
+    return snprintf(obuf, maxlen, "\"policy\": \"%s\", \"tolerance\": %0.4f", p->name,
+            data->tol);
+}
+
+/* the bounds are a cache, only the tolerance is stored */
+static void
+policy_klucb_dump(policy_t *p, multi_arm_buf_t *b)
+{
+    multi_arm_buf_double(b, ((policy_klucb_data_t *)p->data)->tol);
+}
+
+static void *
+policy_klucb_restore(policy_t *p, multi_arm_t *m, multi_arm_reader_t *r)
+{
+    UNUSED(p);
+    double  tol = multi_arm_read_double(r);
+
+    if(r->err || !(tol >= 0.0 && tol <= 1.0)){
+        r->err = 1;
+        return NULL;
+    }
+    return klucb_data_new(m, tol);
+}
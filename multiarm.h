@@ -23,29 +23,227 @@ struct arm_s{
 };
 typedef struct arm_s arm_t;
 
+/* sliding window statistics, see multi_arm_set_window */
+struct multi_arm_window_s;
+typedef struct multi_arm_window_s multi_arm_window_t;
+
+/* convergence detector, see multi_arm_set_freeze */
+struct multi_arm_freeze_s;
+typedef struct multi_arm_freeze_s multi_arm_freeze_t;
+
 struct multi_arm_s {
-    arm_t       *arms;
+    arm_t       *arms;      //NULL while small encoded
     int         len;
+    int         cap;
 
     uint64_t    total_count;
     policy_t    policy;
+
+    multi_arm_window_t  *window;
+    multi_arm_freeze_t  *freeze;
+
+    /*
+     * compact encoding of small bandits, see multiarm.c. use the accessor
+     * functions below instead of arms
+     */
+    uint8_t     *small;
+    void        **choices;  //owner's choice array, see multi_arm_set_choices
 };
 
 typedef void * (*malloc_ptr)(size_t);
 typedef void (*free_ptr)(void *);
 typedef void * (*realloc_ptr)(void *, size_t s);
 int multi_arm_init(malloc_ptr m, free_ptr f, realloc_ptr r);
+/*
+ * clock used by windowed bandits, in milliseconds. default to the wall clock
+ */
+void multi_arm_set_clock(uint64_t (*clock)(void));
+/*
+ * thompson sampling draws beta(a, b) from a skew corrected normal once both
+ * a and b reach min_count, see ts_beta_variate. 0 always draws the exact beta
+ */
+#define MULTI_ARM_TS_NORMAL_DEFAULT     1000
+void multi_arm_set_ts_normal(uint64_t min_count);
 
 
 struct multi_arm_s;
 typedef struct multi_arm_s multi_arm_t;
 
+/*
+ * arm eligibility bitset used by multi_arm_choice_masked. bit i set means
+ * arm i may be chosen, bits past the last arm must be zero.
+ */
+#define MULTI_ARM_MASK_WORDS(n)     (((n) + 63) / 64)
+#define MULTI_ARM_MASK_TEST(m, i)   (((m)[(i) >> 6] >> ((i) & 63)) & 1)
+#define MULTI_ARM_MASK_SET(m, i)    ((m)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define MULTI_ARM_MASK_CLR(m, i)    ((m)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
+
 multi_arm_t * multi_arm_new(const char *policy, void **choices, int l, const char *option);
 void multi_arm_free(multi_arm_t *);
 void * multi_arm_choice(multi_arm_t *, int *idx);
+/*
+ * choice among the arms set in mask only. return NULL and set *idx to -1
+ * if no arm is eligible
+ */
+void * multi_arm_choice_masked(multi_arm_t *, const uint64_t *mask, int *idx);
+/*
+ * probability that a choice with mask picks arm idx in the current state,
+ * for off-policy evaluation of logged choices. exact for egreedy, ucb1 and
+ * klucb and frozen bandits. -1 for thompsen and htree, their propensity
+ * has no closed form, see multi_arm_posterior
+ */
+double multi_arm_propensity(multi_arm_t *, const uint64_t *mask, int idx);
+
+/*
+ * a beta posterior a thompson choice drew from. the candidates of a level
+ * compete for the largest draw: the eligible arms of thompsen (level 0),
+ * the eligible children of the node on the path to the arm at every level
+ * of htree
+ */
+struct multi_arm_beta_s {
+    double      alpha;
+    double      beta;
+    int         level;
+    int         chosen;     /* on the path to the chosen arm */
+};
+typedef struct multi_arm_beta_s multi_arm_beta_t;
+
+/*
+ * the candidates behind a choice with mask of arm idx by thompsen or
+ * htree, in level order. fills at most max of them and returns how many
+ * there are, 0 for the other policies. share is the probability the choice
+ * went through the policy (the explore share of a frozen bandit, else 1)
+ * and fixed what it adds to the propensity of idx besides (1 - share for
+ * the best arm of a frozen bandit). the propensity is
+ *   share * multi_arm_posterior_propensity(...) + fixed
+ */
+int multi_arm_posterior(multi_arm_t *, const uint64_t *mask, int idx,
+        multi_arm_beta_t *out, int max, double *share, double *fixed);
+/*
+ * monte carlo estimate of the probability that every chosen candidate of
+ * out (as filled by multi_arm_posterior) wins its level, from draws rounds
+ * per level. the standard error of a level is sqrt(p * (1 - p) / draws)
+ */
+double multi_arm_posterior_propensity(const multi_arm_beta_t *out, int n, int draws);
 int multi_arm_reward(multi_arm_t *, int idx, double reward);
+/*
+ * trials rewards of arm idx at once, summing to reward, wins of them non
+ * zero. same as trials multi_arm_reward calls in O(1). return 0 on success
+ */
+int multi_arm_reward_agg(multi_arm_t *, int idx, uint64_t trials, double reward, uint64_t wins);
+
+/*
+ * read / overwrite the lifetime statistics of arm idx. return 0 on success
+ */
+int multi_arm_get_arm(multi_arm_t *, int idx, uint64_t *count, double *reward);
+int multi_arm_set_arm(multi_arm_t *, int idx, uint64_t count, double reward);
+/*
+ * choices[i] is the choice of arm i. the array passed to multi_arm_new is
+ * used until this is called, a small encoded bandit keeps no choice of its
+ * own and reads them from it. the owner keeps the array in step with
+ * add/del arm and calls this again whenever it moves the array. a bandit
+ * loaded by multi_arm_rdb_load has no array, it is compacted once set.
+ */
+void multi_arm_set_choices(multi_arm_t *, void **choices);
+
+/*
+ * append an arm, return its idx
+ */
+int multi_arm_add_arm(multi_arm_t *, void *choice);
+/*
+ * remove arm idx, the arms after it shift down by one. the statistics of
+ * the remaining arms are kept. return 0 on success
+ */
+int multi_arm_del_arm(multi_arm_t *, int idx);
+
+/*
+ * keep per-arm statistics of the last span_ms * buckets milliseconds in a
+ * ring of buckets. expired buckets are dropped lazily when the bandit is
+ * accessed. with policy set, the policy chooses on the windowed statistics
+ * instead of the lifetime ones. return 0 on success
+ */
+#define MULTI_ARM_WINDOW_MAX_BUCKETS    1440
+int multi_arm_set_window(multi_arm_t *, uint64_t span_ms, int buckets, int policy);
+
+/*
+ * check every few rewards whether the best arm is separated from the others
+ * and, once it is, choose it directly instead of running the policy but for
+ * a share explore of the choices. a later check which fails gives the
+ * choice back to the policy. a negative explore turns it off.
+ * return 0 on success
+ */
+int multi_arm_set_freeze(multi_arm_t *, double explore);
+/* return 1 if the bandit is frozen */
+int multi_arm_frozen(multi_arm_t *);
 
 int multi_arm_stat_json(multi_arm_t *, char *, size_t maxlen);
+size_t multi_arm_mem_usage(multi_arm_t *);
+
+/*
+ * serialized form of a bandit: varints, raw little endian doubles and
+ * length prefixed strings appended to a growable buffer. a zeroed
+ * multi_arm_buf_t is empty, reading past the end sets err
+ */
+struct multi_arm_buf_s {
+    uint8_t     *data;
+    size_t      len;
+    size_t      cap;
+};
+typedef struct multi_arm_buf_s multi_arm_buf_t;
+
+struct multi_arm_reader_s {
+    const uint8_t   *p;
+    const uint8_t   *end;
+    int             err;
+};
+typedef struct multi_arm_reader_s multi_arm_reader_t;
+
+void multi_arm_buf_varint(multi_arm_buf_t *, uint64_t);
+void multi_arm_buf_double(multi_arm_buf_t *, double);
+void multi_arm_buf_bytes(multi_arm_buf_t *, const void *, size_t len);
+void multi_arm_buf_raw(multi_arm_buf_t *, const void *, size_t len);
+void multi_arm_buf_free(multi_arm_buf_t *);
+uint64_t multi_arm_read_varint(multi_arm_reader_t *);
+double multi_arm_read_double(multi_arm_reader_t *);
+const uint8_t * multi_arm_read_bytes(multi_arm_reader_t *, size_t *len);
+
+/*
+ * append the bandit to b / rebuild it from r. the choices are not part of
+ * it, see multi_arm_set_choices. return NULL and set r->err if the input
+ * is corrupt
+ */
+void multi_arm_dump(multi_arm_t *, multi_arm_buf_t *b);
+multi_arm_t * multi_arm_restore(multi_arm_reader_t *r);
+/*
+ * check the arm count and policy name of a dump without restoring it.
+ * return the arm count, 0 and set r->err if the header is corrupt
+ */
+int multi_arm_dump_check(multi_arm_reader_t *r);
+
+/*
+ * concurrent bandit for multi-threaded embedders, no external lock needed.
+ * every thread adds its rewards to its own shard of per-arm counters with
+ * atomic adds, a choice merges the shards and runs the policy on the sum.
+ * the arms are fixed, the policy is ucb1, egreedy or thompsen. shards is
+ * rounded up to a power of two, use about the number of threads. every
+ * thread draws from its own random generator and merges into its own
+ * buffers, released when the thread exits. make check runs
+ * test/mab_conc_test.c
+ */
+struct multi_arm_conc_s;
+typedef struct multi_arm_conc_s multi_arm_conc_t;
+
+multi_arm_conc_t * multi_arm_conc_new(const char *policy, void **choices, int len,
+        const char *option, int shards);
+void multi_arm_conc_free(multi_arm_conc_t *);
+/* mask may be NULL, see multi_arm_choice_masked */
+void * multi_arm_conc_choice(multi_arm_conc_t *, const uint64_t *mask, int *idx);
+int multi_arm_conc_reward(multi_arm_conc_t *, int idx, double reward);
+/*
+ * a regular bandit holding the merged statistics, it keeps using the
+ * choices array given to multi_arm_conc_new
+ */
+multi_arm_t * multi_arm_conc_snapshot(multi_arm_conc_t *);
 
 
 #ifdef MABREDIS_MODULE
@@ -56,7 +254,7 @@ int multi_arm_stat_json(multi_arm_t *, char *, size_t maxlen);
  */
 struct RedisModuleIO;
 
-void multi_arm_rdb_save(multi_arm_t *, struct RedisModuleIO *rdb);
+/* load the rdb encoding versions 0 and 1 */
 multi_arm_t * multi_arm_rdb_load(struct RedisModuleIO *, int encv);
 #endif
 
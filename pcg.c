@@ -1,7 +1,12 @@
-#include <math.h>
 
 #include "pcg.h"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RAND_HAVE_AVX2
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 // *Really* minimal PCG32 code / (c) 2014 M.E. O'Neill / pcg-random.org
 // Licensed under Apache License 2.0 (NO WARRANTY, etc. see website)
 
@@ -17,7 +22,14 @@ uint32_t pcg32_random_r(pcg32_random_t* rng)
 }
 
 
-static pcg32_random_t   pcg32_global = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
+/*
+ * every thread owns its generator. a thread which never calls pcg32_srandom
+ * is seeded on first use from the last seed given to it and a stream
+ * number of its own, so threads never share a stream
+ */
+static __thread pcg32_random_t   pcg32_global = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
+static uint64_t                  pcg32_base_seed;
+static uint64_t                  pcg32_next_stream;
 
 void pcg32_srandom_r(pcg32_random_t* rng, uint64_t initstate, uint64_t initseq)
 {
@@ -28,21 +40,171 @@ void pcg32_srandom_r(pcg32_random_t* rng, uint64_t initstate, uint64_t initseq)
     pcg32_random_r(rng);
 }
 
-void pcg32_srandom(uint64_t seed, uint64_t seq)
+
+/*
+ * xoshiro256+ state, s[word][lane]. the lanes are independent streams
+ * stepped together so the update vectorizes.
+ */
+struct rand_lanes_s {
+    uint64_t    s[4][RAND_LANES] __attribute__((aligned(32)));
+    int         seeded;
+};
+typedef struct rand_lanes_s rand_lanes_t;
+
+static __thread rand_lanes_t    rand_lanes;
+__thread rand_buffer_t          rand_buffer = { .pos = RAND_BUFFER_SIZE };
+
+static uint64_t
+splitmix64(uint64_t *x)
 {
-    pcg32_srandom_r(&pcg32_global, seed, seq);
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
 }
 
-uint32_t
-randint(uint32_t range)
+static void
+rand_lanes_seed(void)
 {
-    uint32_t r = pcg32_random_r(&pcg32_global);
-    return r% range;
+    uint64_t    x = ((uint64_t)pcg32_random_r(&pcg32_global) << 32) |
+        pcg32_random_r(&pcg32_global);
+    int         i, l;
+
+    for(l = 0; l < RAND_LANES; l++){
+        for(i = 0; i < 4; i++){
+            rand_lanes.s[i][l] = splitmix64(&x);
+        }
+    }
+    rand_lanes.seeded = 1;
 }
 
+/* top 52 bits as the mantissa of a double in [1, 2), minus 1 */
+static inline double
+rand_to_double(uint64_t r)
+{
+    union { uint64_t i; double d; } u;
+
+    u.i = (r >> 12) | 0x3ff0000000000000ULL;
+    return u.d - 1.0;
+}
+
+static void
+rand_fill_scalar(double *out)
+{
+    uint64_t    (*s)[RAND_LANES] = rand_lanes.s;
+    int         i, l;
+
+    for(i = 0; i < RAND_BUFFER_SIZE; i += RAND_LANES){
+        for(l = 0; l < RAND_LANES; l++){
+            uint64_t    r = s[0][l] + s[3][l], t = s[1][l] << 17;
+
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s[1][l];
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= t;
+            s[3][l] = (s[3][l] << 45) | (s[3][l] >> 19);
+
+            out[i + l] = rand_to_double(r);
+        }
+    }
+}
+
+#ifdef RAND_HAVE_AVX2
+__attribute__((target("avx2"))) static void
+rand_fill_avx2(double *out)
+{
+    const __m256i   exp = _mm256_set1_epi64x(0x3ff0000000000000LL);
+    const __m256d   one = _mm256_set1_pd(1.0);
+    __m256i         s0[2], s1[2], s2[2], s3[2];
+    int             i, h;
+
+    for(h = 0; h < 2; h++){
+        s0[h] = _mm256_load_si256((__m256i *)(rand_lanes.s[0] + h * 4));
+        s1[h] = _mm256_load_si256((__m256i *)(rand_lanes.s[1] + h * 4));
+        s2[h] = _mm256_load_si256((__m256i *)(rand_lanes.s[2] + h * 4));
+        s3[h] = _mm256_load_si256((__m256i *)(rand_lanes.s[3] + h * 4));
+    }
+
+    for(i = 0; i < RAND_BUFFER_SIZE; i += RAND_LANES){
+        for(h = 0; h < 2; h++){
+            __m256i     r = _mm256_add_epi64(s0[h], s3[h]);
+            __m256i     t = _mm256_slli_epi64(s1[h], 17);
+
+            s2[h] = _mm256_xor_si256(s2[h], s0[h]);
+            s3[h] = _mm256_xor_si256(s3[h], s1[h]);
+            s1[h] = _mm256_xor_si256(s1[h], s2[h]);
+            s0[h] = _mm256_xor_si256(s0[h], s3[h]);
+            s2[h] = _mm256_xor_si256(s2[h], t);
+            s3[h] = _mm256_or_si256(_mm256_slli_epi64(s3[h], 45),
+                    _mm256_srli_epi64(s3[h], 19));
+
+            r = _mm256_or_si256(_mm256_srli_epi64(r, 12), exp);
+            _mm256_storeu_pd(out + i + h * 4,
+                    _mm256_sub_pd(_mm256_castsi256_pd(r), one));
+        }
+    }
+
+    for(h = 0; h < 2; h++){
+        _mm256_store_si256((__m256i *)(rand_lanes.s[0] + h * 4), s0[h]);
+        _mm256_store_si256((__m256i *)(rand_lanes.s[1] + h * 4), s1[h]);
+        _mm256_store_si256((__m256i *)(rand_lanes.s[2] + h * 4), s2[h]);
+        _mm256_store_si256((__m256i *)(rand_lanes.s[3] + h * 4), s3[h]);
+    }
+}
+
+/* cpuid + xgetbv directly, __builtin_cpu_supports needs libgcc at link time */
+static int
+rand_cpu_avx2(void)
+{
+    static int      avx2 = -1;
+    unsigned int    a, b, c, d, lo, hi;
+
+    if(avx2 >= 0){
+        return avx2;
+    }
+
+    avx2 = 0;
+    if(__get_cpuid(1, &a, &b, &c, &d) && (c & bit_OSXSAVE) && (c & bit_AVX)){
+        __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        if((lo & 0x6) == 0x6 && __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+                (b & bit_AVX2)){
+            avx2 = 1;
+        }
+    }
+    return avx2;
+}
+#endif
+
 double
-randnumber()
+rand_buffer_refill(void)
 {
-    return ldexp(pcg32_random_r(&pcg32_global), -32);
+    if(!rand_lanes.seeded){
+        pcg32_srandom_r(&pcg32_global, __atomic_load_n(&pcg32_base_seed, __ATOMIC_RELAXED),
+                __atomic_add_fetch(&pcg32_next_stream, 1, __ATOMIC_RELAXED));
+        rand_lanes_seed();
+    }
+
+#ifdef RAND_HAVE_AVX2
+    if(rand_cpu_avx2()){
+        rand_fill_avx2(rand_buffer.buf);
+    }else{
+        rand_fill_scalar(rand_buffer.buf);
+    }
+#else
+    rand_fill_scalar(rand_buffer.buf);
+#endif
+
+    rand_buffer.pos = 1;
+    return rand_buffer.buf[0];
 }
 
+void pcg32_srandom(uint64_t seed, uint64_t seq)
+{
+    __atomic_store_n(&pcg32_base_seed, seed, __ATOMIC_RELAXED);
+    pcg32_srandom_r(&pcg32_global, seed, seq);
+
+    /* drop what is left of the old stream */
+    rand_lanes_seed();
+    rand_buffer.pos = RAND_BUFFER_SIZE;
+}
@@ -5,17 +5,51 @@
 // Licensed under Apache License 2.0 (NO WARRANTY, etc. see website)
 #include <stdint.h>
 
+/*
+ * uniforms are produced in batches by a multi-lane xoshiro256+ generator
+ * (AVX2 when the cpu has it, scalar otherwise, both give the same stream)
+ * into a per-thread buffer. pcg32 only seeds the lanes.
+ */
+#define RAND_LANES          8
+#define RAND_BUFFER_SIZE    256
+
+struct rand_buffer_s {
+    int         pos;
+    double      buf[RAND_BUFFER_SIZE];
+};
+typedef struct rand_buffer_s rand_buffer_t;
+
+extern __thread rand_buffer_t rand_buffer;
 
 /*
- * return a int value in the range [0, range)
+ * refill the buffer of the calling thread and return its first value
  */
-uint32_t randint(uint32_t range);
+double rand_buffer_refill(void);
 
 /*
  * return a double value in the range [0, 1)
  */
-double randnumber();
+static inline double
+randnumber(void)
+{
+    if(rand_buffer.pos < RAND_BUFFER_SIZE){
+        return rand_buffer.buf[rand_buffer.pos++];
+    }
+    return rand_buffer_refill();
+}
+
+/*
+ * return a int value in the range [0, range)
+ */
+static inline uint32_t
+randint(uint32_t range)
+{
+    return (uint32_t)(randnumber() * range);
+}
 
+/*
+ * seed the generator of the calling thread. the threads which do not call
+ * it get a stream of their own derived from the last seed
+ */
 void pcg32_srandom(uint64_t, uint64_t);
 #endif
-
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# server cpu per call of the hot commands, a build of the module at $base
+# against the working tree. both run the same mab-benchmark load on a fresh
+# redis-server, the tree once more with IDXONLY. run from the repo root
+# after make:
+#
+#   test/mab_bench.sh /path/to/redis-server [base] [mab-benchmark options]
+#
+# base defaults to the handlers before they dropped AutoMemory and parsed
+# their arguments in place, the parent of the commit adding this script.
+# the figures are INFO commandstats usec_per_call, the cpu redis spent in
+# the command itself.
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 redis-server [base] [mab-benchmark options]" >&2
+    exit 1
+fi
+
+redis=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+base=${2:-$(git log --diff-filter=A --format=%H -1 -- test/mab_bench.sh)^}
+shift
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] || set -- -c 50 -P 16 -n 2000000 -k 10000 -r 0:1:1:0
+
+sock=/tmp/mab_test.sock
+tmp=$(mktemp -d)
+trap 'git worktree remove --force "$tmp/base" 2>/dev/null; rm -rf "$tmp"' EXIT
+
+git worktree add --detach "$tmp/base" "$base" >/dev/null 2>&1
+make -C "$tmp/base" mabredis.so >/dev/null
+make mabredis.so mab-benchmark >/dev/null
+
+# run $module $out [extra mab-benchmark options]
+run()
+{
+    module=$1
+    out=$2
+    shift 2
+
+    rm -f $sock
+    "$redis" test/mab_test.conf --loadmodule "$module" >/dev/null 2>&1 &
+    pid=$!
+    while [ ! -S $sock ]; do
+        sleep 0.1
+    done
+
+    ./mab-benchmark -s $sock "$@" | sed -n '/^server cpu/,$p' | tail -n +3 > "$out"
+
+    kill $pid
+    wait $pid 2>/dev/null || true
+}
+
+run "$tmp/base/mabredis.so" "$tmp/base.txt" "$@"
+run "$(pwd)/mabredis.so" "$tmp/head.txt" "$@"
+run "$(pwd)/mabredis.so" "$tmp/idx.txt" "$@" -I
+
+echo "usec/call       base      tree     saved  tree+IDXONLY     saved"
+awk '
+FILENAME ~ /base/   { b[$1] = $3; next }
+FILENAME ~ /head/   { h[$1] = $3; next }
+($1 in b) && ($1 in h) {
+    printf "%-12s %7.3f   %7.3f   %6.1f%%      %7.3f   %6.1f%%\n", $1, b[$1], h[$1],
+        100 * (b[$1] - h[$1]) / b[$1], $3, 100 * (b[$1] - $3) / b[$1]
+}' "$tmp/base.txt" "$tmp/head.txt" "$tmp/idx.txt"
@@ -0,0 +1,143 @@
+/*
+ * mab-conc-test: threads choose and reward one multi_arm_conc_t together,
+ * the merged snapshot must account for every reward exactly. the rewards
+ * are 0, 0.5 and 1 so their sums are exact in any order. run under
+ * valgrind or -fsanitize=address to check the per thread views are freed
+ * on thread exit.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "multiarm.h"
+#include "pcg.h"
+
+#define CONC_THREADS    8
+#define CONC_ROUNDS     200000
+#define CONC_ARMS       5
+
+struct conc_worker_s {
+    pthread_t           tid;
+    int                 id;
+    multi_arm_conc_t    *c;
+    uint64_t            count[CONC_ARMS];
+    double              reward[CONC_ARMS];
+    uint64_t            fail;
+};
+typedef struct conc_worker_s conc_worker_t;
+
+static void *
+conc_worker(void *arg)
+{
+    conc_worker_t   *w = (conc_worker_t *)arg;
+    uint64_t        mask;
+    double          reward;
+    void            *choice;
+    int             i, idx;
+
+    pcg32_srandom(42, (uint64_t)w->id);
+    for(i = 0; i < CONC_ROUNDS; i++){
+        //every fourth choice skips arm 0
+        mask = (((uint64_t)1 << CONC_ARMS) - 1) & ~(uint64_t)1;
+        choice = multi_arm_conc_choice(w->c, i % 4 ? NULL : &mask, &idx);
+        if(idx < 0 || idx >= CONC_ARMS || choice != (void *)(intptr_t)(idx + 1) ||
+                (i % 4 == 0 && idx == 0)){
+            w->fail++;
+            continue;
+        }
+
+        reward = (double)randint(3) / 2;
+        if(multi_arm_conc_reward(w->c, idx, reward) != 0){
+            w->fail++;
+            continue;
+        }
+        w->count[idx]++;
+        w->reward[idx] += reward;
+    }
+    return NULL;
+}
+
+static int
+conc_test(const char *policy, const char *option)
+{
+    conc_worker_t       workers[CONC_THREADS];
+    void                *choices[CONC_ARMS];
+    uint64_t            count[CONC_ARMS], total = 0, got_count, fail = 0;
+    double              reward[CONC_ARMS], got_reward;
+    multi_arm_conc_t    *c;
+    multi_arm_t         *ma;
+    int                 i, t, err = 0;
+
+    for(i = 0; i < CONC_ARMS; i++){
+        choices[i] = (void *)(intptr_t)(i + 1);
+        count[i] = 0;
+        reward[i] = 0.0;
+    }
+    c = multi_arm_conc_new(policy, choices, CONC_ARMS, option, CONC_THREADS);
+    if(c == NULL){
+        fprintf(stderr, "%s: multi_arm_conc_new fail\n", policy);
+        return 1;
+    }
+
+    memset(workers, 0, sizeof(workers));
+    for(t = 0; t < CONC_THREADS; t++){
+        workers[t].id = t;
+        workers[t].c = c;
+        if(pthread_create(&workers[t].tid, NULL, conc_worker, workers + t) != 0){
+            fprintf(stderr, "pthread_create fail\n");
+            exit(1);
+        }
+    }
+    for(t = 0; t < CONC_THREADS; t++){
+        pthread_join(workers[t].tid, NULL);
+        fail += workers[t].fail;
+        for(i = 0; i < CONC_ARMS; i++){
+            count[i] += workers[t].count[i];
+            reward[i] += workers[t].reward[i];
+        }
+    }
+    if(fail){
+        fprintf(stderr, "%s: %lu choices or rewards failed\n", policy, fail);
+        err = 1;
+    }
+
+    ma = multi_arm_conc_snapshot(c);
+    for(i = 0; i < CONC_ARMS; i++){
+        multi_arm_get_arm(ma, i, &got_count, &got_reward);
+        if(got_count != count[i] || got_reward != reward[i]){
+            fprintf(stderr, "%s: arm %d has (%lu, %f), %lu rewards summing to %f were issued\n",
+                    policy, i, got_count, got_reward, count[i], reward[i]);
+            err = 1;
+        }
+        total += count[i];
+    }
+    if(ma->total_count != total || total + fail != (uint64_t)CONC_THREADS * CONC_ROUNDS){
+        fprintf(stderr, "%s: total count %lu, %lu rewards were issued\n", policy,
+                ma->total_count, total);
+        err = 1;
+    }
+
+    printf("%-10s %d threads x %d rounds: %s\n", policy, CONC_THREADS, CONC_ROUNDS,
+            err ? "FAIL" : "ok");
+    multi_arm_free(ma);
+    multi_arm_conc_free(c);
+    return err;
+}
+
+int
+main(void)
+{
+    int     err = 0;
+
+    multi_arm_init(NULL, NULL, NULL);
+
+    err |= conc_test("ucb1", NULL);
+    err |= conc_test("egreedy", "0.1");
+    err |= conc_test("thompsen", NULL);
+
+    return err;
+}
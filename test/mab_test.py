@@ -2,8 +2,11 @@
 
 import os
 import sys
+import glob
+import json
 import time
 import random
+import struct
 import unittest
 import argparse
 import subprocess
@@ -13,6 +16,15 @@ import redis
 REDIS_CONF = "mab_test.conf"
 REDIS_ADDR = "/tmp/mab_test.sock"
 
+def crc64(data):
+    """crc64 (jones) of DUMP payloads"""
+    crc = 0
+    for b in data:
+        crc ^= b
+        for _ in range(0, 8):
+            crc = (crc >> 1) ^ (0x95ac9329ac4bc9b5 if crc & 1 else 0)
+    return crc
+
 class RedisServer:
     def __init__(self, executable, module, *options):
 
@@ -102,6 +114,10 @@ class ThompsenCmd(MabCmd):
     TYPE = "thompsen"
 
 
+class KlucbCmd(MabCmd):
+    TYPE = "klucb"
+
+
 class MabTest(unittest.TestCase):
     REDIS_EXE = None
     REDIS_MODULE = None
@@ -115,11 +131,641 @@ class MabTest(unittest.TestCase):
         self.__test_persistence("--save", "900", "1", "--dbfilename", rdbfile)
         os.remove(rdbfile)
 
+    def test_mab_rdb_lazy(self):
+        rdbfile = "mabredis-lazy.rdb"
+        server = self.redis_server("--save", "900", "1", "--dbfilename", rdbfile)
+        server.start()
+
+        conn = MabCmd.newconn()
+        keys = ["mab-test.lazy0", "mab-test.lazy1"]
+        conn.execute_command("mab.set", keys[0], "ucb1", 3, "c0", "c1", "c2")
+        conn.execute_command("mab.set", keys[1], "thompsen", 3, "c0", "c1", "c2",
+                "window", 60000, 10)
+        for key in keys:
+            for idx in range(0, 3):
+                conn.execute_command("mab.reward", key, idx, 0.1 * (idx + 1))
+        stats = [conn.execute_command("mab.statjson", key) for key in keys]
+        usage = conn.execute_command("memory", "usage", keys[0])
+
+        # loaded as the serialized string, nothing parsed yet
+        server.restart()
+        conn = MabCmd.newconn()
+        self.assertLess(conn.execute_command("memory", "usage", keys[0]), usage)
+
+        # saved back untouched, then loaded again before the first access
+        conn.execute_command("save")
+        server.restart()
+        conn = MabCmd.newconn()
+        self.assertEqual([conn.execute_command("mab.statjson", key) for key in keys], stats)
+        self.assertEqual(conn.execute_command("memory", "usage", keys[0]), usage)
+
+        for key in keys:
+            conn.execute_command("del", key)
+
+        # a corrupt policy name fails the load, not the first access
+        conn.execute_command("mab.set", keys[0], "ucb1", 3, "c0", "c1", "c2")
+        payload = conn.execute_command("dump", keys[0])
+        self.assertEqual(int.from_bytes(payload[-8:], "little"), crc64(payload[:-8]))
+        payload = payload[:-8].replace(b"ucb1", b"ucbx")
+        payload += crc64(payload).to_bytes(8, "little")
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("restore", keys[1], 0, payload)
+        self.assertEqual(conn.execute_command("exists", keys[1]), 0)
+
+        conn.execute_command("del", keys[0])
+        server.stop()
+        os.remove(rdbfile)
+
     def test_mab_aof(self):
         aoffile = "mabredis.aof"
         self.__test_persistence("--appendonly", "yes", "--appendfilename", aoffile)
         os.remove(aoffile)
 
+    def test_mab_aof_rewrite(self):
+        aoffile = "mabredis-rewrite.aof"
+        server = self.redis_server("--appendonly", "yes", "--appendfilename", aoffile)
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.rewrite"
+        conn.execute_command("mab.set", key, "thompsen", 2, "c0", "c1", "window", 60000, 10)
+        conn.execute_command("mab.addarm", key, "c2")
+        conn.execute_command("mab.reward", key, 2, 0.123456789)
+        conn.execute_command("mab.reward", key, 0, 1)
+        stat = conn.execute_command("mab.statjson", key)
+
+        # the rewrite recreates the key, window, added arm and exact reward included
+        conn.execute_command("bgrewriteaof")
+        time.sleep(0.2)
+        while conn.info("persistence")["aof_rewrite_in_progress"]:
+            time.sleep(0.1)
+        server.restart()
+
+        conn = MabCmd.newconn()
+        self.assertEqual(conn.execute_command("mab.statjson", key), stat)
+
+        conn.execute_command("del", key)
+        server.stop()
+        os.remove(aoffile)
+
+    def test_mab_choice_mask(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.mask"
+        conn.execute_command("mab.set", key, "ucb1", 4, "c0", "c1", "c2", "c3")
+        for _ in range(0, 100):
+            idx, _ = conn.execute_command("mab.choice", key, "exclude", 0, 2)
+            self.assertIn(idx, (1, 3))
+            conn.execute_command("mab.reward", key, idx, 1)
+
+            idx, choice = conn.execute_command("mab.choice", key, "include", 2)
+            self.assertEqual((idx, choice), (2, b"c2"))
+
+            # bitmap in SETBIT order, arm 0 and arm 3
+            idx, _ = conn.execute_command("mab.choice", key, "includemask", b"\x90")
+            self.assertIn(idx, (0, 3))
+
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.choice", key, "exclude", 0, 1, 2, 3)
+        # the options do not combine
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.choice", key, "include", 0, "excludemask", b"\x80")
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.choice", key, "includemask", b"\x90", "exclude", 0)
+
+        conn.execute_command("del", key)
+        server.stop()
+
+    def test_mab_choice_maxstale(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.maxstale"
+        conn.execute_command("mab.set", key, "ucb1", 3, "c0", "c1", "c2")
+
+        # a master is never stale
+        idx, _ = conn.execute_command("mab.choice", key, "maxstale", 0)
+        self.assertIn(idx, (0, 1, 2))
+        idx, choice = conn.execute_command("mab.choice", key, "maxstale", 0, "include", 1)
+        self.assertEqual((idx, choice), (1, b"c1"))
+
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.choice", key, "maxstale", -1)
+
+        conn.execute_command("del", key)
+        server.stop()
+
+    def test_mab_add_del_arm(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.arms"
+        conn.execute_command("mab.set", key, "thompsen", 2, "c0", "c1")
+        conn.execute_command("mab.reward", key, 0, 1)
+        conn.execute_command("mab.reward", key, 1, 0)
+
+        self.assertEqual(conn.execute_command("mab.addarm", key, "c2", "c3"), 4)
+        conn.execute_command("mab.reward", key, 3, 1)
+        self.assertEqual(conn.execute_command("mab.delarm", key, 0), 3)
+
+        # c1, c2, c3 are left with their statistics
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual([arm["count"] for arm in stat["arms"]], [1, 0, 1])
+        self.assertEqual([(ab["win"], ab["lose"]) for ab in stat["alpha_beta"]],
+                [(1, 2), (1, 1), (2, 1)])
+
+        idx, choice = conn.execute_command("mab.choice", key, "include", 2)
+        self.assertEqual(choice, b"c3")
+
+        conn.execute_command("del", key)
+        server.stop()
+
+    def test_mab_step(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.step"
+        conn.execute_command("mab.set", key, "ucb1", 2, "c0", "c1")
+
+        idx, choice = conn.execute_command("mab.choice", key)
+        for _ in range(0, 100):
+            idx, choice = conn.execute_command("mab.step", key, idx, 1 if idx == 1 else 0)
+            self.assertEqual(choice, [b"c0", b"c1"][idx])
+
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual(stat["total_count"], 100)
+        self.assertGreater(stat["arms"][1]["count"], stat["arms"][0]["count"])
+
+        idx = conn.execute_command("mab.choice", key, "idxonly")
+        self.assertIn(idx, (0, 1))
+        self.assertEqual(conn.execute_command("mab.choice", key, "idxonly", "exclude", 1), 0)
+        self.assertIn(conn.execute_command("mab.step", key, idx, 0.25, "idxonly"), (0, 1))
+
+        conn.execute_command("del", key)
+        server.stop()
+
+    def test_mab_window(self):
+        rdbfile = "mabredis.rdb"
+        server = self.redis_server("--save", "900", "1", "--dbfilename", rdbfile)
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.window"
+        conn.execute_command("mab.set", key, "ucb1", 2, "c0", "c1", "window", 1000, 5)
+        conn.execute_command("mab.reward", key, 0, 1)
+        conn.execute_command("mab.reward", key, 1, 0)
+
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual(stat["window"]["total_count"], 2)
+
+        server.restart()
+        conn = MabCmd.newconn()
+        self.assertEqual(json.loads(conn.execute_command("mab.statjson", key)), stat)
+
+        # the whole window expires, lifetime statistics stay
+        time.sleep(5.5)
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual(stat["window"]["total_count"], 0)
+        self.assertEqual(stat["total_count"], 2)
+
+        # a bucket holds more than 2^32 trials
+        conn.execute_command("del", key)
+        conn.execute_command("mab.set", key, "thompsen", 2, "c0", "c1", "window", 60000, 5)
+        conn.execute_command("mab.rewardagg", key, 0, 3000000000, 2000000000, 2000000000)
+        conn.execute_command("mab.rewardagg", key, 0, 3000000000, 2000000000, 2000000000)
+        server.restart()
+        conn = MabCmd.newconn()
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual(stat["window"]["total_count"], 6000000000)
+        self.assertEqual(stat["window"]["arms"][0]["count"], 6000000000)
+        self.assertEqual(stat["alpha_beta"][0], {"idx": 0, "win": 4000000001, "lose": 2000000001})
+
+        conn.execute_command("del", key)
+        server.stop()
+        os.remove(rdbfile)
+
+    def test_mab_small_encoding(self):
+        rdbfile = "mabredis.rdb"
+        server = self.redis_server("--save", "900", "1", "--dbfilename", rdbfile)
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.small"
+        conn.execute_command("mab.set", key, "thompsen", 4, "c0", "c1", "c2", "c3")
+        small = conn.execute_command("memory", "usage", key)
+
+        # typical fractional rewards keep the bandit small, every reward
+        # rounds its arm's sum by at most 2^-17
+        rand = random.Random(32)
+        sums, counts = [0.0] * 4, [0] * 4
+        for _ in range(0, 400):
+            idx = rand.randrange(4)
+            reward = rand.choice((0, 0.1, 0.25, 0.3, 0.7, 1))
+            conn.execute_command("mab.reward", key, idx, reward)
+            sums[idx] += reward
+            counts[idx] += 1
+        self.assertEqual(conn.execute_command("memory", "usage", key), small)
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        for i, arm in enumerate(stat["arms"]):
+            self.assertEqual(arm["count"], counts[i])
+            self.assertAlmostEqual(arm["reward"], sums[i], delta=counts[i] * 2**-17 + 1e-6)
+
+        # choices come from the bandit object, also after it grows
+        self.assertEqual(conn.execute_command("mab.choice", key, "include", 2)[1], b"c2")
+        conn.execute_command("mab.addarm", key, "c4")
+        self.assertEqual(conn.execute_command("mab.choice", key, "include", 4)[1], b"c4")
+
+        server.restart()
+        conn = MabCmd.newconn()
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        small = conn.execute_command("memory", "usage", key)
+        self.assertEqual(conn.execute_command("mab.choice", key, "include", 3)[1], b"c3")
+
+        # a count past the compact encoding promotes the bandit
+        conn.execute_command("mab.config", key, 0, 70000, stat["arms"][0]["reward"])
+        self.assertGreater(conn.execute_command("memory", "usage", key), small)
+        stat["arms"][0]["count"] = 70000
+        promoted = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual(promoted["arms"], stat["arms"])
+        self.assertEqual(conn.execute_command("mab.choice", key, "include", 1)[1], b"c1")
+
+        conn.execute_command("del", key)
+        server.stop()
+        os.remove(rdbfile)
+
+    def test_mab_cold(self):
+        # extra arguments right after --loadmodule go to the module
+        server = self.redis_server("COLD-IDLE", "1")
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.cold"
+        conn.execute_command("mab.set", key, "thompsen", 3, "c0", "c1", "c2")
+        conn.execute_command("mab.reward", key, 1, 1)
+        stat = conn.execute_command("mab.statjson", key)
+        hot = conn.execute_command("memory", "usage", key)
+
+        # bandits sharing the choices of a template are folded too
+        tmpl, copy = "mab-test.{cold}", "mab-test.{cold}copy"
+        conn.execute_command("mab.template", tmpl, "ucb1", 3, "c0", "c1", "c2")
+        conn.execute_command("mab.msetfrom", tmpl, copy)
+        conn.execute_command("mab.reward", copy, 2, 1)
+        shared_stat = conn.execute_command("mab.statjson", copy)
+        shared_hot = conn.execute_command("memory", "usage", copy)
+
+        time.sleep(1.5)
+        self.assertLess(conn.execute_command("memory", "usage", key), hot)
+        self.assertLess(conn.execute_command("memory", "usage", copy), shared_hot)
+        self.assertEqual(conn.execute_command("mab.statjson", key), stat)
+        self.assertEqual(conn.execute_command("mab.statjson", copy), shared_stat)
+
+        # folded again, then dumped and restored with its choices
+        time.sleep(1.5)
+        conn.restore(copy + "2", 0, conn.dump(copy))
+        self.assertEqual(conn.execute_command("mab.statjson", copy + "2"), shared_stat)
+        idx, choice = conn.execute_command("mab.choice", copy + "2", "include", 2)
+        self.assertEqual(choice, b"c2")
+
+        conn.execute_command("del", key, tmpl, copy, copy + "2")
+        server.stop()
+
+    def test_mab_htree(self):
+        rdbfile = "mabredis.rdb"
+        server = self.redis_server("--save", "900", "1", "--dbfilename", rdbfile)
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.htree"
+        arms = ["c{}".format(i) for i in range(0, 1000)]
+        conn.execute_command("mab.set", key, "htree", len(arms), *arms, 8)
+        for _ in range(0, 2000):
+            idx, choice = conn.execute_command("mab.choice", key)
+            conn.execute_command("mab.reward", key, idx, 1 if idx == 777 else 0)
+
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual((stat["branching"], stat["depth"]), (8, 4))
+        self.assertGreater(stat["arms"][777]["count"], 100)
+
+        idx, choice = conn.execute_command("mab.choice", key, "include", 3, 999)
+        self.assertIn(idx, (3, 999))
+
+        server.restart()
+        conn = MabCmd.newconn()
+        self.assertEqual(json.loads(conn.execute_command("mab.statjson", key)), stat)
+
+        conn.execute_command("del", key)
+        server.stop()
+        os.remove(rdbfile)
+
+    def test_mab_export_import(self):
+        path = os.path.abspath("mab_export.bin")
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        keys = ["mab-test.export.{}".format(i) for i in range(0, 3)]
+        conn.execute_command("mab.set", keys[0], "thompsen", 2, "c0", "c1")
+        conn.execute_command("mab.set", keys[1], "ucb1", 3, "c0", "c1", "c2")
+        conn.execute_command("mab.set", keys[2], "egreedy", 2, "c0", "c1", 0.1)
+        for key in keys:
+            conn.execute_command("mab.reward", key, 1, 0.5)
+        stats = [conn.execute_command("mab.statjson", key) for key in keys]
+
+        self.assertEqual(conn.execute_command("mab.export", path), 3)
+        conn.execute_command("del", *keys)
+
+        self.assertEqual(conn.execute_command("mab.import", path), 3)
+        self.assertEqual([conn.execute_command("mab.statjson", key) for key in keys], stats)
+        self.assertEqual(conn.execute_command("mab.import", path), 0)
+
+        conn.execute_command("del", *keys)
+        server.stop()
+        os.remove(path)
+
+    def test_mab_autofreeze(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.freeze"
+        conn.execute_command("mab.set", key, "thompsen", 3, "c0", "c1", "c2")
+        self.assertEqual(conn.execute_command("mab.autofreeze", key, 0), 0)
+
+        conn.execute_command("mab.config", key, 0, 1000, 100, 1, 1000, 900, 2, 1000, 150)
+        self.assertEqual(conn.execute_command("mab.autofreeze", key, 0), 1)
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual(stat["freeze"], {"explore": 0.0, "frozen": 1, "best": 1})
+        for _ in range(0, 100):
+            idx, _ = conn.execute_command("mab.choice", key)
+            self.assertEqual(idx, 1)
+
+        # the freeze state is a section of the serialized form
+        _, state = conn.execute_command("mab.snapshot", key)
+        conn.execute_command("mab.restore", key + ".copy", state)
+        self.assertEqual(json.loads(conn.execute_command("mab.statjson", key + ".copy"))["freeze"],
+                stat["freeze"])
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.restore", key + ".bad", state + b"\x00")
+        conn.execute_command("del", key + ".copy")
+
+        # a new arm needs exploring
+        conn.execute_command("mab.addarm", key, "c3")
+        self.assertEqual(json.loads(conn.execute_command("mab.statjson", key))["freeze"]["frozen"], 0)
+
+        self.assertEqual(conn.execute_command("mab.autofreeze", key, "off"), 0)
+        self.assertNotIn("freeze", json.loads(conn.execute_command("mab.statjson", key)))
+
+        conn.execute_command("del", key)
+        server.stop()
+
+    def test_mab_rewardagg(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        single, agg = "mab-test.reward", "mab-test.rewardagg"
+        for key in (single, agg):
+            conn.execute_command("mab.set", key, "thompsen", 2, "c0", "c1")
+
+        for _ in range(0, 30):
+            conn.execute_command("mab.reward", single, 1, 1)
+        for _ in range(0, 70):
+            conn.execute_command("mab.reward", single, 1, 0)
+        conn.execute_command("mab.reward", single, 0, 0.5)
+        conn.execute_command("mab.reward", single, 0, 0.5)
+
+        self.assertEqual(conn.execute_command("mab.rewardagg", agg, 1, 100, 30), 0)
+        self.assertEqual(conn.execute_command("mab.rewardagg", agg, 0, 2, 1.0, 2), 0)
+        self.assertEqual(json.loads(conn.execute_command("mab.statjson", single)),
+                json.loads(conn.execute_command("mab.statjson", agg)))
+
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.rewardagg", agg, 1, 10, 11)
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.rewardagg", agg, 1, 10, 5, 11)
+
+        conn.execute_command("del", single, agg)
+        server.stop()
+
+    def test_mab_snapshot(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.snapshot"
+        conn.execute_command("mab.set", key, "thompsen", 2, "c0", "c1")
+        version, state = conn.execute_command("mab.snapshot", key)
+        self.assertIsNone(conn.execute_command("mab.snapshot", key, "if-version", version))
+
+        conn.execute_command("mab.choice", key)
+        self.assertIsNone(conn.execute_command("mab.snapshot", key, "if-version", version))
+
+        conn.execute_command("mab.reward", key, 1, 1)
+        newversion, newstate = conn.execute_command("mab.snapshot", key, "if-version", version)
+        self.assertGreater(newversion, version)
+        self.assertNotEqual(newstate, state)
+
+        conn.execute_command("mab.restore", key + ".copy", newstate)
+        self.assertEqual(conn.execute_command("mab.statjson", key + ".copy"),
+                conn.execute_command("mab.statjson", key))
+
+        conn.execute_command("del", key, key + ".copy")
+        server.stop()
+
+    def test_mab_ticket(self):
+        server = self.redis_server("TICKET-TTL", "1", "TICKET-EXPIRE-ZERO", "1")
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.ticket"
+        conn.execute_command("mab.set", key, "thompsen", 2, "c0", "c1")
+
+        idx, choice, ticket = conn.execute_command("mab.choice", key, "ticket")
+        self.assertEqual(choice, [b"c0", b"c1"][idx])
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.rewardticket", "mab-test.other", ticket, 1)
+        self.assertEqual(conn.execute_command("mab.rewardticket", key, ticket, 1), 0)
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.rewardticket", key, ticket, 1)
+
+        # left pending, it counts as a 0 reward once expired, with no more tickets issued
+        conn.execute_command("mab.choice", key, "idxonly", "ticket", "include", 1)
+
+        # the ticket of a bandit in another db is resolved and expired in that db
+        conn1 = redis.from_url("unix://@{}?db=1".format(REDIS_ADDR))
+        conn1.execute_command("mab.set", key, "thompsen", 2, "c0", "c1")
+        _, ticket = conn1.execute_command("mab.choice", key, "idxonly", "ticket", "include", 0)
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.rewardticket", key, ticket, 1)
+
+        time.sleep(3.1)
+        stat = json.loads(conn.execute_command("mab.statjson", key))
+        self.assertEqual(stat["total_count"], 2)
+        self.assertEqual(stat["alpha_beta"][1]["lose"], 2)
+        stat = json.loads(conn1.execute_command("mab.statjson", key))
+        self.assertEqual(stat["total_count"], 1)
+        self.assertEqual(stat["alpha_beta"][0]["lose"], 2)
+
+        conn.execute_command("del", key)
+        conn1.execute_command("del", key)
+        server.stop()
+
+    def test_mab_ts_normal(self):
+        # choice frequencies of the exact beta and of the normal tier
+        freqs = []
+        for threshold in ("0", "1000"):
+            server = self.redis_server("TS-NORMAL", threshold)
+            server.start()
+
+            conn = MabCmd.newconn()
+            key = "mab-test.tsnormal"
+            conn.execute_command("mab.set", key, "thompsen", 3, "c0", "c1", "c2")
+            for idx, wins in enumerate((5000, 5050, 4900)):
+                conn.execute_command("mab.rewardagg", key, idx, 100000, wins)
+
+            pipe = conn.pipeline(transaction=False)
+            for _ in range(0, 4000):
+                pipe.execute_command("mab.choice", key, "idxonly")
+            counts = [0, 0, 0]
+            for idx in pipe.execute():
+                counts[idx] += 1
+            freqs.append([c / 4000 for c in counts])
+
+            conn.execute_command("del", key)
+            server.stop()
+
+        for exact, normal in zip(*freqs):
+            self.assertAlmostEqual(exact, normal, delta=0.05)
+
+    def test_mab_eventlog(self):
+        path = "/tmp/mab_test.events"
+        for f in glob.glob(path + "*"):
+            os.remove(f)
+        server = self.redis_server("EVENTLOG", path)
+        server.start()
+
+        conn = MabCmd.newconn()
+        key = "mab-test.eventlog"
+        conn.execute_command("mab.set", key, "egreedy", 4, "c0", "c1", "c2", "c3", 0.2)
+        idx = conn.execute_command("mab.choice", key, "idxonly")
+        conn.execute_command("mab.reward", key, idx, 1)
+        conn.execute_command("mab.rewardagg", key, 2, 10, 3)
+        conn.execute_command("mab.choice", key, "idxonly", "include", 1)
+
+        # the writer flushes a partial buffer after a second without traffic
+        time.sleep(2)
+        with open(path, "rb") as f:
+            data = f.read()
+        self.assertEqual(data[:16], b"MABEVLOG" + struct.pack("=II", 2, 32))
+        events = [struct.unpack_from("=QQdII", data, off) for off in range(16, len(data), 32)]
+        self.assertEqual([e[1] & 0xff for e in events], [1, 2, 2, 1])
+        self.assertEqual(len(set(e[0] for e in events)), 1)
+
+        # (value, idx, n): a choice carries its propensity and the arm count
+        self.assertEqual([(e[2], e[3], e[4]) for e in events],
+                [(0.25, idx, 4), (1.0, idx, 1), (3.0, 2, 10), (1.0, 1, 4)])
+
+        # a thompson choice follows the posteriors of its candidates, value is -share
+        conn.execute_command("del", key)
+        conn.execute_command("mab.set", key, "thompsen", 3, "c0", "c1", "c2")
+        conn.execute_command("mab.rewardagg", key, 1, 4, 3)
+        idx = conn.execute_command("mab.choice", key, "idxonly", "exclude", 0)
+        time.sleep(2)
+        with open(path, "rb") as f:
+            data = f.read()
+        events = [struct.unpack_from("=QQ", data, off) for off in range(16, len(data), 32)]
+        self.assertEqual([e[1] & 0xff for e in events[-4:]], [2, 3, 3, 1])
+        betas = [struct.unpack_from("=IIII", data, off + 16) for off in range(len(data) - 96, len(data) - 32, 32)]
+        self.assertEqual(betas, [(4, 2, 0, idx == 1), (1, 1, 0, idx == 2)])
+        self.assertEqual(struct.unpack_from("=dII", data, len(data) - 16), (-1.0, idx, 3))
+
+        conn.execute_command("del", key)
+        server.stop()
+
+    def test_mab_hotkeys(self):
+        server = self.redis_server("HOTKEYS", "2")
+        server.start()
+
+        conn = MabCmd.newconn()
+        keys = ["mab-test.hot%d" % i for i in range(0, 4)]
+        for key in keys:
+            conn.execute_command("mab.set", key, "ucb1", 2, "c0", "c1")
+        for i, key in enumerate(keys):
+            for _ in range(0, 10 * (i + 1)):
+                conn.execute_command("mab.choice", key)
+                conn.execute_command("mab.reward", key, 0, 1)
+
+        hot = conn.execute_command("mab.hotkeys")
+        self.assertEqual(hot, [keys[3].encode(), 80, keys[2].encode(), 60])
+        self.assertEqual(conn.execute_command("mab.hotkeys", 1), hot[:2])
+
+        self.assertEqual(conn.execute_command("mab.hotkeys", "reset"), b"OK")
+        self.assertEqual(conn.execute_command("mab.hotkeys"), [])
+
+        #a key evicted from the heap comes back once it beats the coldest one
+        for i, n in [(0, 5), (1, 3), (2, 4), (1, 2), (0, 1)]:
+            for _ in range(0, n):
+                conn.execute_command("mab.choice", keys[i])
+        self.assertEqual(conn.execute_command("mab.hotkeys"),
+                [keys[0].encode(), 6, keys[1].encode(), 5])
+
+        conn.execute_command("del", *keys)
+        server.stop()
+
+    def test_mab_template(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        tmpl = "mab-test.{tmpl}"
+        keys = ["mab-test.{tmpl}%d" % i for i in range(0, 3)]
+        self.assertEqual(conn.execute_command("mab.template", tmpl, "egreedy", 2, "c0", "c1", 0.1), 2)
+        self.assertEqual(conn.execute_command("mab.msetfrom", tmpl, *keys), 3)
+        with self.assertRaises(redis.exceptions.ResponseError):
+            conn.execute_command("mab.msetfrom", tmpl, keys[0], "mab-test.{tmpl}new")
+        self.assertEqual(conn.exists("mab-test.{tmpl}new"), 0)
+
+        for key in keys:
+            self.assertEqual(conn.execute_command("mab.statjson", key),
+                    conn.execute_command("mab.statjson", tmpl))
+
+        # a copy owns its choices once it changes them, the others keep theirs
+        self.assertEqual(conn.execute_command("mab.addarm", keys[0], "c2"), 3)
+        conn.execute_command("del", tmpl)
+        idx, choice = conn.execute_command("mab.choice", keys[0], "include", 2)
+        self.assertEqual(choice, b"c2")
+        idx, choice = conn.execute_command("mab.choice", keys[1], "include", 1)
+        self.assertEqual(choice, b"c1")
+
+        conn.execute_command("del", *keys)
+        server.stop()
+
+    def test_mab_mchoice(self):
+        server = self.redis_server()
+        server.start()
+
+        conn = MabCmd.newconn()
+        keys = ["mab-test.{page}headline", "mab-test.{page}image"]
+        conn.execute_command("mab.set", keys[0], "ucb1", 2, "h0", "h1")
+        conn.execute_command("mab.set", keys[1], "thompsen", 3, "i0", "i1", "i2")
+        conn.set("mab-test.{page}string", "v")
+
+        reply = conn.execute_command("mab.mchoice", keys[0], "mab-test.{page}none",
+                keys[1], "mab-test.{page}string")
+        self.assertEqual(len(reply), 4)
+        self.assertEqual(reply[0][1], [b"h0", b"h1"][reply[0][0]])
+        self.assertEqual(reply[2][1], [b"i0", b"i1", b"i2"][reply[2][0]])
+        self.assertIsInstance(reply[1], redis.exceptions.ResponseError)
+        self.assertIsInstance(reply[3], redis.exceptions.ResponseError)
+
+        conn.execute_command("del", "mab-test.{page}string", *keys)
+        server.stop()
+
     def __test_persistence(self, *options):
         server = self.redis_server(*options)
         server.start()
@@ -127,7 +773,8 @@ class MabTest(unittest.TestCase):
         cmds = (
             EgreedyCmd(("choice1", "choice2", "choice3"), 0.1),
             Ucb1Cmd(("choice1, choice2", "choice3", "choice4")),
-            ThompsenCmd(("choice1", "choice2", "choice3"))
+            ThompsenCmd(("choice1", "choice2", "choice3")),
+            KlucbCmd(("choice1", "choice2", "choice3"))
         )
 
         oldstats = []